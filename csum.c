@@ -0,0 +1,556 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "ext2.h"
+#include "helper.h"
+#include "csum.h"
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#define CRC32C_POLY 0x82F63B78u  /* Castagnoli, reflected */
+#define HASH_LANES 4
+
+/* Slice-by-8 tables of the software CRC32C */
+static unsigned int crc_table[8][256];
+static int have_sse42 = 0;
+
+__attribute__((constructor))
+static void init_crc32c(void) {
+    for (unsigned int i = 0; i < 256; i++) {
+        unsigned int crc = i;
+        for (int k = 0; k < 8; k++) {
+            crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        }
+        crc_table[0][i] = crc;
+    }
+    for (unsigned int i = 0; i < 256; i++) {
+        for (int t = 1; t < 8; t++) {
+            crc_table[t][i] = (crc_table[t - 1][i] >> 8) ^ crc_table[0][crc_table[t - 1][i] & 0xFF];
+        }
+    }
+#if defined(__x86_64__)
+    have_sse42 = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+/*
+ * CRC32C eight bytes at a time through the tables.
+ */
+static unsigned int crc32c_soft(unsigned int crc, const unsigned char *p, size_t len) {
+    while (len >= 8) {
+        unsigned long long word;
+        memcpy(&word, p, 8);
+        word ^= crc;
+        crc = crc_table[7][word & 0xFF] ^ crc_table[6][(word >> 8) & 0xFF]
+              ^ crc_table[5][(word >> 16) & 0xFF] ^ crc_table[4][(word >> 24) & 0xFF]
+              ^ crc_table[3][(word >> 32) & 0xFF] ^ crc_table[2][(word >> 40) & 0xFF]
+              ^ crc_table[1][(word >> 48) & 0xFF] ^ crc_table[0][word >> 56];
+        p += 8;
+        len -= 8;
+    }
+    while (len-- > 0) {
+        crc = (crc >> 8) ^ crc_table[0][(crc ^ *p++) & 0xFF];
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+/*
+ * CRC32C with the SSE4.2 crc32 instruction, eight bytes per instruction.
+ */
+__attribute__((target("sse4.2")))
+static unsigned int crc32c_sse42(unsigned int crc, const unsigned char *p, size_t len) {
+    unsigned long long crc64 = crc;
+    while (len >= 8) {
+        unsigned long long word;
+        memcpy(&word, p, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+        p += 8;
+        len -= 8;
+    }
+    crc = (unsigned int) crc64;
+    while (len-- > 0) {
+        crc = _mm_crc32_u8(crc, *p++);
+    }
+    return crc;
+}
+#endif
+
+unsigned int crc32c(unsigned int crc, const void *data, size_t len) {
+    crc = ~crc;
+#if defined(__x86_64__)
+    if (have_sse42) {
+        return ~crc32c_sse42(crc, data, len);
+    }
+#endif
+    return ~crc32c_soft(crc, data, len);
+}
+
+unsigned int block_crc(unsigned char *disk, unsigned int block) {
+    return crc32c(0, disk + (size_t) block * EXT2_BLOCK_SIZE, EXT2_BLOCK_SIZE);
+}
+
+unsigned long long hash_block(const unsigned char *data) {
+    // The words go round robin into HASH_LANES independent multiply-xorshift
+    // lanes, so the lanes can run in parallel (in SIMD registers where the
+    // compiler can), and are only mixed at the end
+    const unsigned long long *words = (const unsigned long long *) data;
+    unsigned long long lanes[HASH_LANES] = {
+        0x9E3779B97F4A7C15ULL, 0xC2B2AE3D27D4EB4FULL, 0x165667B19E3779F9ULL, 0x27D4EB2F165667C5ULL
+    };
+
+    for (int i = 0; i < EXT2_BLOCK_SIZE / 8; i += HASH_LANES) {
+        for (int l = 0; l < HASH_LANES; l++) {
+            lanes[l] = (lanes[l] ^ words[i + l]) * 0xFF51AFD7ED558CCDULL;
+            lanes[l] ^= lanes[l] >> 32;
+        }
+    }
+
+    unsigned long long hash = 0;
+    for (int l = 0; l < HASH_LANES; l++) {
+        hash = (hash ^ lanes[l]) * 0xC4CEB9FE1A85EC53ULL;
+        hash ^= hash >> 29;
+    }
+    return hash;
+}
+
+/*
+ * Mark one block of the given kind, if it is on the disk.
+ */
+static void mark(unsigned char *kinds, unsigned int *owners, unsigned int blocks_count, unsigned int block,
+                 unsigned char kind, unsigned int owner) {
+    if (block > 0 && block < blocks_count) {
+        kinds[block] = kind;
+        owners[block] = owner;
+    }
+}
+
+void map_metadata(unsigned char *disk, unsigned char *kinds, unsigned int *owners) {
+    struct ext2_super_block *sb = get_superblock_loc(disk);
+    struct ext2_group_desc *gd = get_group_descriptor_loc(disk);
+    unsigned int blocks_count = sb->s_blocks_count;
+    int groups = get_groups_count(disk);
+
+    // The primary super block and group descriptors; the backups are only
+    // written by mkfs
+    mark(kinds, owners, blocks_count, 1, META_SUPER, 0);
+    unsigned int gd_blocks = (groups * sizeof(struct ext2_group_desc) + EXT2_BLOCK_SIZE - 1) / EXT2_BLOCK_SIZE;
+    for (unsigned int b = 0; b < gd_blocks; b++) {
+        mark(kinds, owners, blocks_count, 2 + b, META_GROUP_DESC, 0);
+    }
+
+    int inode_size = sb->s_rev_level == 0 ? (int) sizeof(struct ext2_inode) : sb->s_inode_size;
+    unsigned int table_blocks = (sb->s_inodes_per_group * inode_size + EXT2_BLOCK_SIZE - 1) / EXT2_BLOCK_SIZE;
+    for (int g = 0; g < groups; g++) {
+        mark(kinds, owners, blocks_count, gd[g].bg_block_bitmap, META_BLOCK_BITMAP, g);
+        mark(kinds, owners, blocks_count, gd[g].bg_inode_bitmap, META_INODE_BITMAP, g);
+        for (unsigned int b = 0; b < table_blocks; b++) {
+            mark(kinds, owners, blocks_count, gd[g].bg_inode_table + b, META_INODE_TABLE, g);
+        }
+    }
+
+    // The blocks of every directory in use
+    for (unsigned int i_num = 1; i_num <= sb->s_inodes_count; i_num++) {
+        if (!inode_in_use(disk, (int) i_num)) {
+            continue;
+        }
+        struct ext2_inode *inode = get_inode(disk, (int) i_num);
+        if ((inode->i_mode & EXT2_S_IFMT) != EXT2_S_IFDIR) {
+            continue;
+        }
+        for (int i = 0; i < SINGLE_INDIRECT; i++) {
+            mark(kinds, owners, blocks_count, inode->i_block[i], META_DIR, i_num);
+        }
+        unsigned int indirect_num = inode->i_block[SINGLE_INDIRECT];
+        if (indirect_num > 0 && indirect_num < blocks_count) {
+            mark(kinds, owners, blocks_count, indirect_num, META_DIR_INDIRECT, i_num);
+            unsigned int *indirect = get_indirect_block_loc(disk, inode);
+            for (int j = 0; j < EXT2_BLOCK_SIZE / sizeof(unsigned int); j++) {
+                mark(kinds, owners, blocks_count, indirect[j], META_DIR, i_num);
+            }
+        }
+    }
+}
+
+unsigned char *csum_bitmap(struct ext2_fs *fs) {
+    return fs->csum + sizeof(struct csum_header);
+}
+
+unsigned int *csum_array(struct ext2_fs *fs) {
+    struct csum_header *header = (struct csum_header *) fs->csum;
+    size_t bitmap_size = ((size_t) header->blocks_count / 8 + 4) & ~(size_t) 3;
+    return (unsigned int *) (csum_bitmap(fs) + bitmap_size);
+}
+
+/*
+ * Return the size of the sidecar of an image of the given blocks count.
+ */
+static size_t sidecar_size(unsigned int blocks_count) {
+    return sizeof(struct csum_header) + (((size_t) blocks_count / 8 + 4) & ~(size_t) 3)
+           + (size_t) blocks_count * sizeof(unsigned int);
+}
+
+int checksums_open = 0;
+
+/*
+ * Return the kind of a block that is metadata wherever it sits: the super
+ * block, the group descriptors, and the bitmaps and inode table of its
+ * group. META_NONE for the others.
+ */
+static int static_kind(unsigned char *disk, unsigned int block) {
+    struct ext2_super_block *sb = get_superblock_loc(disk);
+    struct ext2_group_desc *gd = get_group_descriptor_loc(disk);
+    int groups = get_groups_count(disk);
+    unsigned int gd_blocks = (groups * sizeof(struct ext2_group_desc) + EXT2_BLOCK_SIZE - 1) / EXT2_BLOCK_SIZE;
+    if (block == 1) {
+        return META_SUPER;
+    } else if (block >= 2 && block < 2 + gd_blocks) {
+        return META_GROUP_DESC;
+    } else if (block < sb->s_first_data_block) {
+        return META_NONE;
+    }
+
+    int g = (int) ((block - sb->s_first_data_block) / sb->s_blocks_per_group);
+    int inode_size = sb->s_rev_level == 0 ? (int) sizeof(struct ext2_inode) : sb->s_inode_size;
+    unsigned int table_blocks = (sb->s_inodes_per_group * inode_size + EXT2_BLOCK_SIZE - 1) / EXT2_BLOCK_SIZE;
+    if (g >= groups) {
+        return META_NONE;
+    } else if (block == gd[g].bg_block_bitmap) {
+        return META_BLOCK_BITMAP;
+    } else if (block == gd[g].bg_inode_bitmap) {
+        return META_INODE_BITMAP;
+    } else if (block >= gd[g].bg_inode_table && block < gd[g].bg_inode_table + table_blocks) {
+        return META_INODE_TABLE;
+    }
+    return META_NONE;
+}
+
+static int test_word_bit(const unsigned long long *bits, unsigned int bit) {
+    return (int) (1 & (__atomic_load_n(&bits[bit / 64], __ATOMIC_ACQUIRE) >> (bit % 64)));
+}
+
+static void touch_fs_block(struct ext2_fs *fs, unsigned int block, int moved) {
+    if (fs == NULL || fs->csum_touched == NULL || block == 0
+        || block >= ((struct csum_header *) fs->csum)->blocks_count) {
+        return;
+    }
+    unsigned long long bit = 1ULL << (block % 64);
+    if (moved) {
+        __atomic_fetch_or(&fs->csum_moved[block / 64], bit, __ATOMIC_RELAXED);
+    }
+    if (test_word_bit(fs->csum_touched, block)) {
+        return;
+    }
+
+    // Under the lock, so that no other thread sees the block touched and
+    // writes it before the check is done
+    pthread_mutex_lock(&fs->csum_lock);
+    if (!test_word_bit(fs->csum_touched, block)) {
+        unsigned char *bitmap = csum_bitmap(fs);
+        if (!moved && (bitmap[block / 8] >> (block % 8)) & 1
+            && csum_array(fs)[block] != block_crc(fs->disk, block)) {
+            __atomic_fetch_or(&fs->csum_bad[block / 64], bit, __ATOMIC_RELAXED);
+        }
+        __atomic_fetch_or(&fs->csum_touched[block / 64], bit, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&fs->csum_lock);
+}
+
+void touch_block(unsigned char *disk, unsigned int block, int moved) {
+    touch_fs_block(get_fs(disk), block, moved);
+}
+
+static int compare_block(const void *a, const void *b) {
+    unsigned int x = *(const unsigned int *) a;
+    unsigned int y = *(const unsigned int *) b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Set dir_owned for each of the moved blocks (sorted) that a directory
+ * owns. A block changes hands only together with the inode that takes or
+ * drops it, so only the directories in the touched inode table blocks are
+ * looked at.
+ */
+static void find_dir_blocks(struct ext2_fs *fs, unsigned int *moved, int moved_count, unsigned char *dir_owned) {
+    unsigned char *disk = fs->disk;
+    struct ext2_super_block *sb = get_superblock_loc(disk);
+    struct ext2_group_desc *gd = get_group_descriptor_loc(disk);
+    unsigned int blocks_count = ((struct csum_header *) fs->csum)->blocks_count;
+    int inode_size = sb->s_rev_level == 0 ? (int) sizeof(struct ext2_inode) : sb->s_inode_size;
+    int per_block = EXT2_BLOCK_SIZE / inode_size;
+
+    for (unsigned int w = 0; w < (blocks_count + 63) / 64; w++) {
+        for (unsigned long long bits = fs->csum_touched[w]; bits != 0; bits &= bits - 1) {
+            unsigned int block = w * 64 + __builtin_ctzll(bits);
+            if (static_kind(disk, block) != META_INODE_TABLE) {
+                continue;
+            }
+            int g = (int) ((block - sb->s_first_data_block) / sb->s_blocks_per_group);
+            int first = (int) (block - gd[g].bg_inode_table) * per_block;
+            for (int i = first; i < first + per_block && i < (int) sb->s_inodes_per_group; i++) {
+                int i_num = g * (int) sb->s_inodes_per_group + i + 1;
+                struct ext2_inode *inode = get_inode(disk, i_num);
+                if (!inode_in_use(disk, i_num) || (inode->i_mode & EXT2_S_IFMT) != EXT2_S_IFDIR) {
+                    continue;
+                }
+                unsigned int owned[SINGLE_INDIRECT + 1 + EXT2_BLOCK_SIZE / sizeof(unsigned int)];
+                int count = 0;
+                for (int k = 0; k <= SINGLE_INDIRECT; k++) {
+                    owned[count++] = inode->i_block[k];
+                }
+                unsigned int indirect_num = inode->i_block[SINGLE_INDIRECT];
+                if (indirect_num > 0 && indirect_num < blocks_count) {
+                    unsigned int *indirect = get_indirect_block_loc(disk, inode);
+                    for (int j = 0; j < EXT2_BLOCK_SIZE / sizeof(unsigned int); j++) {
+                        owned[count++] = indirect[j];
+                    }
+                }
+                for (int k = 0; k < count; k++) {
+                    unsigned int *found = owned[k] == 0 ? NULL
+                        : bsearch(&owned[k], moved, moved_count, sizeof(unsigned int), compare_block);
+                    if (found != NULL) {
+                        dir_owned[found - moved] = 1;
+                    }
+                }
+            }
+        }
+    }
+}
+
+int failed_checksums(struct ext2_fs *fs) {
+    if (fs->csum == NULL) {
+        return 0;
+    }
+    int bad = 0;
+    for (unsigned int w = 0; w < (((struct csum_header *) fs->csum)->blocks_count + 63) / 64; w++) {
+        bad += __builtin_popcountll(fs->csum_bad[w]);
+    }
+    return bad;
+}
+
+/*
+ * Touch the super block and the group descriptors: nearly every operation
+ * changes them, and the getters of both hand out the whole table at once.
+ */
+static void touch_group_metadata(struct ext2_fs *fs) {
+    int groups = get_groups_count(fs->disk);
+    unsigned int gd_blocks = (groups * sizeof(struct ext2_group_desc) + EXT2_BLOCK_SIZE - 1) / EXT2_BLOCK_SIZE;
+    for (unsigned int b = 1; b < 2 + gd_blocks; b++) {
+        touch_fs_block(fs, b, 0);
+    }
+}
+
+/*
+ * Forget what was touched, and touch the group metadata right away.
+ */
+static void reset_tracking(struct ext2_fs *fs) {
+    unsigned int blocks_count = ((struct csum_header *) fs->csum)->blocks_count;
+    size_t words = (blocks_count + 63) / 64;
+    memset(fs->csum_touched, 0, 3 * words * sizeof(unsigned long long));
+    touch_group_metadata(fs);
+}
+
+int refresh_checksums(struct ext2_fs *fs) {
+    if (fs->csum == NULL) {
+        return 0;
+    }
+    unsigned char *disk = fs->disk;
+    unsigned int blocks_count = ((struct csum_header *) fs->csum)->blocks_count;
+    unsigned int words = (blocks_count + 63) / 64;
+
+    // The blocks allocated or freed are metadata now only if a directory
+    // owns them
+    int moved_count = 0;
+    for (unsigned int w = 0; w < words; w++) {
+        moved_count += __builtin_popcountll(fs->csum_moved[w]);
+    }
+    unsigned int *moved = malloc(sizeof(unsigned int) * (moved_count + 1));
+    unsigned char *dir_owned = calloc(moved_count + 1, 1);
+    if (moved == NULL || dir_owned == NULL) {
+        free(moved);
+        free(dir_owned);
+        return -1;
+    }
+    moved_count = 0;
+    for (unsigned int w = 0; w < words; w++) {
+        for (unsigned long long bits = fs->csum_moved[w]; bits != 0; bits &= bits - 1) {
+            moved[moved_count++] = w * 64 + __builtin_ctzll(bits);
+        }
+    }
+    if (moved_count > 0) {
+        find_dir_blocks(fs, moved, moved_count, dir_owned);
+    }
+
+    // Only store what changed, to keep the sidecar pages clean otherwise
+    unsigned char *bitmap = csum_bitmap(fs);
+    unsigned int *crcs = csum_array(fs);
+    int bad = 0, m = 0;
+    for (unsigned int w = 0; w < words; w++) {
+        for (unsigned long long bits = fs->csum_touched[w]; bits != 0; bits &= bits - 1) {
+            unsigned int b = w * 64 + __builtin_ctzll(bits);
+            while (m < moved_count && moved[m] < b) {
+                m++;
+            }
+            if ((fs->csum_bad[w] >> (b % 64)) & 1) {
+                bad++;
+                continue;
+            }
+            int tracked = static_kind(disk, b) != META_NONE;
+            if (!tracked && m < moved_count && moved[m] == b) {
+                tracked = dir_owned[m];
+            } else if (!tracked) { // Same owner as before
+                tracked = (bitmap[b / 8] >> (b % 8)) & 1;
+            }
+            unsigned int crc = tracked ? block_crc(disk, b) : 0;
+            if (((bitmap[b / 8] >> (b % 8)) & 1) != tracked) {
+                bitmap[b / 8] ^= 1 << (b % 8);
+            }
+            if (crcs[b] != crc) {
+                crcs[b] = crc;
+            }
+        }
+        // A block that failed stays touched, so it is never checked again
+        fs->csum_touched[w] &= fs->csum_bad[w];
+        fs->csum_moved[w] = 0;
+    }
+    free(moved);
+    free(dir_owned);
+    // The next batch changes them again
+    touch_group_metadata(fs);
+    return bad;
+}
+
+int refresh_all_checksums(struct ext2_fs *fs) {
+    if (fs->csum == NULL) {
+        return 0;
+    }
+    unsigned int blocks_count = ((struct csum_header *) fs->csum)->blocks_count;
+    unsigned char *kinds = calloc(blocks_count, 1);
+    unsigned int *owners = malloc(sizeof(unsigned int) * blocks_count);
+    if (kinds == NULL || owners == NULL) {
+        free(kinds);
+        free(owners);
+        return -1;
+    }
+    map_metadata(fs->disk, kinds, owners);
+
+    unsigned char *bitmap = csum_bitmap(fs);
+    unsigned int *crcs = csum_array(fs);
+    for (unsigned int b = 0; b < blocks_count; b++) {
+        int tracked = kinds[b] != META_NONE;
+        unsigned int crc = tracked ? block_crc(fs->disk, b) : 0;
+        if (((bitmap[b / 8] >> (b % 8)) & 1) != tracked) {
+            bitmap[b / 8] ^= 1 << (b % 8);
+        }
+        if (crcs[b] != crc) {
+            crcs[b] = crc;
+        }
+    }
+    free(kinds);
+    free(owners);
+    reset_tracking(fs);
+    return 0;
+}
+
+/*
+ * Return the malloc'd path of the sidecar of the image of the given name.
+ */
+static char *sidecar_path(const char *disk_name) {
+    char *path = malloc(strlen(disk_name) + sizeof(CSUM_SUFFIX));
+    if (path != NULL) {
+        sprintf(path, "%s%s", disk_name, CSUM_SUFFIX);
+    }
+    return path;
+}
+
+/*
+ * Map the sidecar at path, creating it first if create is set. Return 0,
+ * or -1 with errno set.
+ */
+static int map_sidecar(struct ext2_fs *fs, const char *path, int create) {
+    unsigned int blocks_count = get_superblock_loc(fs->disk)->s_blocks_count;
+    size_t size = sidecar_size(blocks_count);
+    int fd = open(path, create ? O_RDWR | O_CREAT | O_TRUNC : O_RDWR, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+    struct stat st;
+    if (create ? ftruncate(fd, (off_t) size) < 0 : fstat(fd, &st) < 0 || st.st_size != (off_t) size) {
+        close(fd);
+        errno = create ? errno : EINVAL;
+        return -1;
+    }
+    unsigned char *csum = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (csum == MAP_FAILED) {
+        return -1;
+    }
+
+    struct csum_header *header = (struct csum_header *) csum;
+    if (create) {
+        header->magic = CSUM_MAGIC;
+        header->blocks_count = blocks_count;
+    } else if (header->magic != CSUM_MAGIC || header->blocks_count != blocks_count) {
+        munmap(csum, size);
+        errno = EINVAL;
+        return -1;
+    }
+    unsigned long long *tracking = calloc(3 * (((size_t) blocks_count + 63) / 64), sizeof(unsigned long long));
+    if (tracking == NULL) {
+        munmap(csum, size);
+        errno = ENOMEM;
+        return -1;
+    }
+    fs->csum = csum;
+    fs->csum_size = size;
+    fs->csum_touched = tracking;
+    fs->csum_moved = tracking + (blocks_count + 63) / 64;
+    fs->csum_bad = tracking + 2 * ((blocks_count + 63) / 64);
+    __atomic_add_fetch(&checksums_open, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+void close_checksums(struct ext2_fs *fs) {
+    if (fs->csum == NULL) {
+        return;
+    }
+    __atomic_sub_fetch(&checksums_open, 1, __ATOMIC_RELAXED);
+    munmap(fs->csum, fs->csum_size);
+    free(fs->csum_touched);
+    fs->csum = NULL;
+    fs->csum_touched = fs->csum_moved = fs->csum_bad = NULL;
+}
+
+int open_checksums(struct ext2_fs *fs, const char *disk_name) {
+    char *path = sidecar_path(disk_name);
+    if (path != NULL) {
+        if (map_sidecar(fs, path, 0) == 0) {
+            reset_tracking(fs);
+        }
+        free(path);
+    }
+    return 0;
+}
+
+int create_checksums(struct ext2_fs *fs, const char *disk_name) {
+    char *path = sidecar_path(disk_name);
+    if (path == NULL) {
+        return -1;
+    }
+    close_checksums(fs);
+    int ret = map_sidecar(fs, path, 1);
+    free(path);
+    if (ret == 0 && refresh_all_checksums(fs) < 0) {
+        errno = ENOMEM;
+        ret = -1;
+    }
+    return ret;
+}
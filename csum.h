@@ -0,0 +1,129 @@
+#ifndef CSC369A3_CSUM_H
+#define CSC369A3_CSUM_H
+
+#include <stddef.h>
+#include "fs.h"
+
+/*
+ * Optional CRC32C checksums of the metadata blocks: the super block, the
+ * group descriptors, the bitmaps, the inode tables and the blocks of every
+ * directory. ext2 has no room for them, so they live in a sidecar file next
+ * to the image, <image>.csum:
+ *
+ *   struct csum_header
+ *   a bitmap with one bit per block, set for the blocks checksummed
+ *   one 32-bit CRC32C per block
+ *
+ * ext2_open() maps the sidecar when it exists. The helpers that hand out a
+ * block of the disk touch it (touch_block()): the first touch after a sync
+ * checks the block against its stored checksum, before the caller can
+ * change it. At the next sync point (ext2_sync()) only the touched blocks
+ * get new checksums, so corruption elsewhere stays for ext2_scrub to find,
+ * and a touched block that failed the check keeps its old one.
+ * `ext2_scrub -i` creates the sidecar, `ext2_scrub` verifies it.
+ */
+
+#define CSUM_MAGIC 0x6d757363  /* "csum" */
+#define CSUM_SUFFIX ".csum"
+
+struct csum_header {
+    unsigned int magic;
+    unsigned int blocks_count;  /* Of the image the checksums are for */
+    unsigned int reserved[2];
+};
+
+/* What a metadata block is, as found by map_metadata() */
+enum meta_kind {
+    META_NONE = 0,
+    META_SUPER,
+    META_GROUP_DESC,
+    META_BLOCK_BITMAP,
+    META_INODE_BITMAP,
+    META_INODE_TABLE,
+    META_DIR,
+    META_DIR_INDIRECT,
+};
+
+/*
+ * Extend crc, 0 to start, with the CRC32C (Castagnoli) of len bytes of
+ * data. The SSE4.2 crc32 instruction is used where the CPU has it.
+ */
+unsigned int crc32c(unsigned int crc, const void *data, size_t len);
+
+/*
+ * Return the CRC32C of one block of the disk.
+ */
+unsigned int block_crc(unsigned char *disk, unsigned int block);
+
+/*
+ * Return a 64-bit hash of the content of one block, to tell blocks apart
+ * (not a checksum: it is not meant to catch every change of a bit).
+ */
+unsigned long long hash_block(const unsigned char *data);
+
+/*
+ * Fill kinds (one byte per block, zeroed by the caller) with the kind of
+ * every metadata block, and owners with the group of the group structures
+ * and the inode number of the directory blocks.
+ */
+void map_metadata(unsigned char *disk, unsigned char *kinds, unsigned int *owners);
+
+/* Handles open with a sidecar; touch_block() is skipped while there are none */
+extern int checksums_open;
+
+/*
+ * Note that the current operation uses the given block of the disk, which
+ * may be about to change. The first touch since the last sync checks the
+ * block against its stored checksum. moved is set for a block being
+ * allocated or freed, whose content is not checked.
+ */
+void touch_block(unsigned char *disk, unsigned int block, int moved);
+
+#define TOUCH_BLOCK(disk, block) \
+    do { if (checksums_open > 0) touch_block(disk, block, 0); } while (0)
+#define TOUCH_MOVED_BLOCK(disk, block) \
+    do { if (checksums_open > 0) touch_block(disk, block, 1); } while (0)
+
+/*
+ * Return the number of touched blocks that failed their check.
+ */
+int failed_checksums(struct ext2_fs *fs);
+
+/*
+ * Store the checksums of the blocks touched since the last sync, for those
+ * that are metadata now, and forget the others. Return the number of
+ * touched blocks left alone because they failed their check (they stay so
+ * until the handle is closed), or -1 if memory ran out.
+ */
+int refresh_checksums(struct ext2_fs *fs);
+
+/*
+ * Recompute the checksum of every metadata block, whatever it held before.
+ * Return 0, or -1 if memory ran out.
+ */
+int refresh_all_checksums(struct ext2_fs *fs);
+
+/*
+ * Create the sidecar of the image of the given name, open as fs, map it and
+ * fill it in. Return 0, or -1 with errno set.
+ */
+int create_checksums(struct ext2_fs *fs, const char *disk_name);
+
+/*
+ * Map the sidecar of the image of the given name into fs if it exists and
+ * matches the image. Return 0 whether or not there is one.
+ */
+int open_checksums(struct ext2_fs *fs, const char *disk_name);
+
+/*
+ * Unmap the sidecar of a handle, if it has one.
+ */
+void close_checksums(struct ext2_fs *fs);
+
+/*
+ * Return the checksum bitmap and array of a handle's sidecar.
+ */
+unsigned char *csum_bitmap(struct ext2_fs *fs);
+unsigned int *csum_array(struct ext2_fs *fs);
+
+#endif
@@ -22,6 +22,8 @@
 
 #define EXT2_BLOCK_SIZE 1024
 
+#define EXT2_SUPER_MAGIC 0xEF53
+
 /*
  * Structure of the super block
  */
@@ -97,6 +99,14 @@ struct ext2_super_block {
     unsigned int   s_reserved[190]; /* Padding to the end of the block */
 };
 
+/*
+ * Feature set flags
+ */
+
+#define EXT2_FEATURE_COMPAT_RESIZE_INODE    0x0010 /* Reserved group descriptor blocks for online growth */
+#define EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER 0x0001 /* Backups only in groups 0, 1 and powers of 3, 5, 7 */
+#define EXT2_FEATURE_INCOMPAT_FILETYPE      0x0002 /* Directory entries record the file type */
+
 
 
 
@@ -149,6 +159,7 @@ struct ext2_inode {
  * Type field for file mode
  */
 
+#define    EXT2_S_IFMT   0xF000    /* mask of the type bits */
 /* #define EXT2_S_IFSOCK 0xC000 */ /* socket */
 #define    EXT2_S_IFLNK  0xA000    /* symbolic link */
 #define    EXT2_S_IFREG  0x8000    /* regular file */
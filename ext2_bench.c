@@ -0,0 +1,873 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include "ext2.h"
+#include "helper.h"
+#include "fs.h"
+#include "mkfs.h"
+
+/*
+ * Microbenchmarks of the core helper.c operations. Every benchmark runs
+ * against a freshly formatted synthetic image and prints one JSON object
+ * per line (ops/sec, ns/op and latency percentiles), so the output can be
+ * collected and compared across commits to catch regressions.
+ */
+
+struct bench_config {
+    char *image_path;  /* Scratch image, recreated for every benchmark */
+    int blocks;        /* Blocks count of the synthetic image */
+    int inodes;        /* Inodes count of the synthetic image */
+    int iterations;    /* Timed operations per benchmark */
+    char *filter;      /* Only run benchmarks whose name contains this */
+};
+
+static struct bench_config config = {"/tmp/ext2_bench.img", 8192, 2048, 10000, NULL};
+
+/*
+ * Return the current monotonic time in nanoseconds.
+ */
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int compare_ns(const void *a, const void *b) {
+    long long x = *(const long long *) a;
+    long long y = *(const long long *) b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Return 1 if the benchmark of given name is selected by the filter.
+ */
+static int selected(char *name) {
+    return config.filter == NULL || strstr(name, config.filter) != NULL;
+}
+
+/*
+ * Print one JSON line summarising the per-operation samples. If bytes is
+ * not zero, it is the payload of every operation and throughput is added.
+ */
+static void report(char *name, char *params, long long *samples, int n, long long bytes) {
+    long long total = 0;
+    for (int i = 0; i < n; i++) {
+        total += samples[i];
+    }
+    qsort(samples, n, sizeof(long long), compare_ns);
+
+    double ns_per_op = (double) total / n;
+    printf("{\"bench\":\"%s\",\"params\":{%s},\"ops\":%d,\"ns_per_op\":%.1f,\"ops_per_sec\":%.1f,"
+           "\"p50_ns\":%lld,\"p90_ns\":%lld,\"p99_ns\":%lld,\"max_ns\":%lld",
+           name, params, n, ns_per_op, 1e9 / ns_per_op,
+           samples[n / 2], samples[(n * 90) / 100], samples[(n * 99) / 100], samples[n - 1]);
+    if (bytes) {
+        printf(",\"mb_per_sec\":%.1f", (double) bytes * n / (1 << 20) / ((double) total / 1e9));
+    }
+    printf("}\n");
+    fflush(stdout);
+}
+
+/*
+ * Format the scratch image with the configured geometry and map it.
+ */
+static unsigned char *make_image(void) {
+    struct mkfs_params params;
+    memset(&params, 0, sizeof(params));
+    params.blocks_count = (unsigned int) config.blocks;
+    params.inodes_count = (unsigned int) config.inodes;
+    params.sparse = 1;
+
+    if (format_image(config.image_path, &params) < 0) {
+        perror(config.image_path);
+        exit(1);
+    }
+    return get_disk_loc(config.image_path);
+}
+
+/*
+ * Return the size in bytes of the mapped image.
+ */
+static size_t image_size(unsigned char *disk) {
+    return (size_t) get_superblock_loc(disk)->s_blocks_count * EXT2_BLOCK_SIZE;
+}
+
+static void drop_image(unsigned char *disk) {
+    ext2_close(get_fs(disk));
+}
+
+/*
+ * Create a directory the way ext2_mkdir does. Return its inode number.
+ */
+static int bench_mkdir(unsigned char *disk, int parent_num, char *name) {
+    int i_num = init_inode(disk, parent_num, 0, 'd');
+    if (i_num == -1
+        || add_new_entry(disk, get_inode(disk, parent_num), (unsigned int) i_num, name, 'd') == -1
+        || add_new_entry(disk, get_inode(disk, i_num), (unsigned int) i_num, ".", 'd') == -1
+        || add_new_entry(disk, get_inode(disk, i_num), (unsigned int) parent_num, "..", 'd') == -1) {
+        fprintf(stderr, "ext2_bench: image too small to create directory %s\n", name);
+        exit(1);
+    }
+    count_used_dirs(disk, i_num, 1);
+    return i_num;
+}
+
+/*
+ * Create a regular file holding size bytes the way ext2_cp does. Return its
+ * inode number.
+ */
+static int bench_create(unsigned char *disk, int parent_num, char *name, int size) {
+    char buf[size];
+    memset(buf, 'x', size);
+
+    int i_num = init_inode(disk, parent_num, size, 'f');
+    if (i_num == -1) {
+        fprintf(stderr, "ext2_bench: image too small to create file %s\n", name);
+        exit(1);
+    }
+    write_into_block(disk, get_inode(disk, i_num), buf, size);
+    if (add_new_entry(disk, get_inode(disk, parent_num), (unsigned int) i_num, name, 'f') == -1) {
+        fprintf(stderr, "ext2_bench: image too small to create file %s\n", name);
+        exit(1);
+    }
+    return i_num;
+}
+
+/*
+ * Lookup of a path of increasing depth: /d/d/.../d
+ */
+static void bench_trace_path_deep(void) {
+    int depths[] = {4, 16, 64};
+    long long *samples = malloc(sizeof(long long) * config.iterations);
+
+    for (int d = 0; d < sizeof(depths) / sizeof(int); d++) {
+        unsigned char *disk = make_image();
+        char path[2 * depths[d] + 1];
+        int parent = EXT2_ROOT_INO;
+        for (int i = 0; i < depths[d]; i++) {
+            parent = bench_mkdir(disk, parent, "d");
+            strcpy(&path[2 * i], "/d");
+        }
+
+        for (int i = 0; i < config.iterations; i++) {
+            long long start = now_ns();
+            trace_path(path, disk);
+            samples[i] = now_ns() - start;
+        }
+
+        char params[64];
+        snprintf(params, sizeof(params), "\"depth\":%d", depths[d]);
+        report("trace_path_deep", params, samples, config.iterations, 0);
+        drop_image(disk);
+    }
+    free(samples);
+}
+
+/*
+ * Lookup of the last entry (hit) and of an absent name (miss) in a directory
+ * of increasing width.
+ */
+static void bench_trace_path_wide(void) {
+    int widths[] = {16, 128, 512};
+    long long *samples = malloc(sizeof(long long) * config.iterations);
+
+    for (int w = 0; w < sizeof(widths) / sizeof(int); w++) {
+        unsigned char *disk = make_image();
+        int dir = bench_mkdir(disk, EXT2_ROOT_INO, "w");
+        char name[16];
+        for (int i = 0; i < widths[w]; i++) {
+            snprintf(name, sizeof(name), "f%05d", i);
+            int i_num = init_inode(disk, dir, 0, 'f');
+            add_new_entry(disk, get_inode(disk, dir), (unsigned int) i_num, name, 'f');
+        }
+
+        char hit[32], miss[32], params[64];
+        snprintf(hit, sizeof(hit), "/w/f%05d", widths[w] - 1);
+        snprintf(miss, sizeof(miss), "/w/missing");
+        snprintf(params, sizeof(params), "\"width\":%d", widths[w]);
+
+        for (int i = 0; i < config.iterations; i++) {
+            long long start = now_ns();
+            trace_path(hit, disk);
+            samples[i] = now_ns() - start;
+        }
+        report("trace_path_wide_hit", params, samples, config.iterations, 0);
+
+        for (int i = 0; i < config.iterations; i++) {
+            long long start = now_ns();
+            trace_path(miss, disk);
+            samples[i] = now_ns() - start;
+        }
+        report("trace_path_wide_miss", params, samples, config.iterations, 0);
+        drop_image(disk);
+    }
+    free(samples);
+}
+
+/*
+ * Insert entries one by one into a directory until it holds the given
+ * number of entries; every insert is one sample.
+ */
+static void bench_add_new_entry(void) {
+    int sizes[] = {64, 256, 700};
+
+    for (int s = 0; s < sizeof(sizes) / sizeof(int); s++) {
+        int rounds = config.iterations / sizes[s] > 0 ? config.iterations / sizes[s] : 1;
+        long long *samples = malloc(sizeof(long long) * rounds * sizes[s]);
+        unsigned char *disk = make_image();
+        int dir = bench_mkdir(disk, EXT2_ROOT_INO, "w");
+        int i_num = init_inode(disk, dir, 0, 'f');
+
+        // Restore the empty directory between rounds
+        size_t disk_size = image_size(disk);
+        unsigned char *pristine = malloc(disk_size);
+        memcpy(pristine, disk, disk_size);
+
+        char name[16];
+        for (int r = 0; r < rounds; r++) {
+            for (int i = 0; i < sizes[s]; i++) {
+                snprintf(name, sizeof(name), "f%05d", i);
+                long long start = now_ns();
+                add_new_entry(disk, get_inode(disk, dir), (unsigned int) i_num, name, 'f');
+                samples[r * sizes[s] + i] = now_ns() - start;
+            }
+            discard_prealloc(disk);
+            memcpy(disk, pristine, disk_size);
+        }
+
+        char params[64];
+        snprintf(params, sizeof(params), "\"entries\":%d", sizes[s]);
+        report("add_new_entry", params, samples, rounds * sizes[s], 0);
+        free(pristine);
+        free(samples);
+        drop_image(disk);
+    }
+}
+
+/*
+ * The same inserts as add_new_entry, as one batch of appends through a
+ * cursor; the largest size grows the directory into its indirect block.
+ */
+static void bench_dir_append(void) {
+    int sizes[] = {64, 256, 700, 5000};
+
+    for (int s = 0; s < sizeof(sizes) / sizeof(int); s++) {
+        int rounds = config.iterations / sizes[s] > 0 ? config.iterations / sizes[s] : 1;
+        long long *samples = malloc(sizeof(long long) * rounds * sizes[s]);
+        unsigned char *disk = make_image();
+        int dir = bench_mkdir(disk, EXT2_ROOT_INO, "w");
+        int i_num = init_inode(disk, dir, 0, 'f');
+
+        // Restore the empty directory between rounds
+        size_t disk_size = image_size(disk);
+        unsigned char *pristine = malloc(disk_size);
+        memcpy(pristine, disk, disk_size);
+
+        char name[16];
+        struct dir_append cursor;
+        for (int r = 0; r < rounds; r++) {
+            begin_dir_append(disk, get_inode(disk, dir), &cursor);
+            for (int i = 0; i < sizes[s]; i++) {
+                snprintf(name, sizeof(name), "f%05d", i);
+                long long start = now_ns();
+                dir_append(disk, &cursor, (unsigned int) i_num, name, 'f');
+                samples[r * sizes[s] + i] = now_ns() - start;
+            }
+            end_dir_append(disk, &cursor);
+            discard_prealloc(disk);
+            memcpy(disk, pristine, disk_size);
+        }
+
+        char params[64];
+        snprintf(params, sizeof(params), "\"entries\":%d", sizes[s]);
+        report("dir_append", params, samples, rounds * sizes[s], 0);
+        free(pristine);
+        free(samples);
+        drop_image(disk);
+    }
+}
+
+/*
+ * Allocation of one block with the first fill_pct percent of the block
+ * bitmap already in use. The block is released again after every sample.
+ */
+static void bench_get_free_block(void) {
+    int fills[] = {0, 50, 90, 99};
+    long long *samples = malloc(sizeof(long long) * config.iterations);
+
+    for (int f = 0; f < sizeof(fills) / sizeof(int); f++) {
+        unsigned char *disk = make_image();
+        struct ext2_super_block *sb = get_superblock_loc(disk);
+
+        int used = (int) ((long long) config.blocks * fills[f] / 100);
+        for (int i = 0; i < used && sb->s_free_blocks_count > 1; i++) {
+            get_free_block(disk);
+        }
+
+        for (int i = 0; i < config.iterations; i++) {
+            long long start = now_ns();
+            int b_num = get_free_block(disk);
+            samples[i] = now_ns() - start;
+
+            free_block(disk, b_num);
+        }
+
+        char params[64];
+        snprintf(params, sizeof(params), "\"fill_pct\":%d,\"blocks\":%d", fills[f], config.blocks);
+        report("get_free_block", params, samples, config.iterations, 0);
+        drop_image(disk);
+    }
+    free(samples);
+}
+
+/*
+ * Allocation of one inode with the first fill_pct percent of the inode
+ * bitmap already in use. The inode is released again after every sample.
+ */
+static void bench_get_free_inode(void) {
+    int fills[] = {0, 50, 90, 99};
+    long long *samples = malloc(sizeof(long long) * config.iterations);
+
+    for (int f = 0; f < sizeof(fills) / sizeof(int); f++) {
+        unsigned char *disk = make_image();
+        struct ext2_super_block *sb = get_superblock_loc(disk);
+
+        int used = (int) ((long long) sb->s_inodes_count * fills[f] / 100);
+        for (int i = EXT2_GOOD_OLD_FIRST_INO; i < used && sb->s_free_inodes_count > 1; i++) {
+            get_free_inode(disk);
+        }
+
+        for (int i = 0; i < config.iterations; i++) {
+            long long start = now_ns();
+            int i_num = get_free_inode(disk);
+            samples[i] = now_ns() - start;
+
+            free_inode(disk, i_num);
+        }
+
+        char params[64];
+        snprintf(params, sizeof(params), "\"fill_pct\":%d,\"inodes\":%d", fills[f], config.inodes);
+        report("get_free_inode", params, samples, config.iterations, 0);
+        drop_image(disk);
+    }
+    free(samples);
+}
+
+/*
+ * Write a buffer of increasing size into a new inode. The allocation is
+ * rolled back after every sample so each write starts from the same state.
+ */
+static void bench_write_into_block(void) {
+    int sizes[] = {1024, 12 * 1024, 64 * 1024, 256 * 1024};
+
+    for (int s = 0; s < sizeof(sizes) / sizeof(int); s++) {
+        int rounds = config.iterations / 10 > 0 ? config.iterations / 10 : 1;
+        long long *samples = malloc(sizeof(long long) * rounds);
+        unsigned char *disk = make_image();
+        struct ext2_super_block *sb = get_superblock_loc(disk);
+        struct ext2_group_desc *gd = get_group_descriptor_loc(disk);
+        unsigned char *block_bitmap = get_block_bitmap_loc(disk);
+
+        char *buf = malloc(sizes[s]);
+        memset(buf, 'x', sizes[s]);
+        int i_num = init_inode(disk, EXT2_ROOT_INO, sizes[s], 'f');
+        struct ext2_inode *tar_inode = get_inode(disk, i_num);
+
+        // A file of the root keeps every allocation in group 0, only its state is restored
+        struct ext2_super_block saved_sb = *sb;
+        struct ext2_group_desc saved_gd = *gd;
+        struct ext2_inode saved_inode = *tar_inode;
+        unsigned char saved_bitmap[EXT2_BLOCK_SIZE];
+        memcpy(saved_bitmap, block_bitmap, EXT2_BLOCK_SIZE);
+
+        for (int i = 0; i < rounds; i++) {
+            long long start = now_ns();
+            write_into_block(disk, tar_inode, buf, sizes[s]);
+            samples[i] = now_ns() - start;
+            discard_prealloc(disk);
+
+            *sb = saved_sb;
+            *gd = saved_gd;
+            *tar_inode = saved_inode;
+            memcpy(block_bitmap, saved_bitmap, EXT2_BLOCK_SIZE);
+        }
+
+        char params[64];
+        snprintf(params, sizeof(params), "\"bytes\":%d", sizes[s]);
+        report("write_into_block", params, samples, rounds, sizes[s]);
+        free(buf);
+        free(samples);
+        drop_image(disk);
+    }
+}
+
+/*
+ * Update of a 256 KiB file of which changed_pct percent of the blocks
+ * differ, in place with update_into_block, against freeing and writing the
+ * whole file again as rm + cp would.
+ */
+static void bench_update_into_block(void) {
+    int changes[] = {0, 5, 50};
+    int size = (SINGLE_INDIRECT + 240) * EXT2_BLOCK_SIZE;
+    int blocks = size / EXT2_BLOCK_SIZE;
+    int rounds = config.iterations / 10 > 0 ? config.iterations / 10 : 1;
+    long long *samples = malloc(sizeof(long long) * rounds);
+    char *old_buf = malloc(size);
+    char *new_buf = malloc(size);
+    for (int i = 0; i < size; i++) {
+        old_buf[i] = (char) ('a' + i % 23);
+    }
+
+    for (int c = 0; c < sizeof(changes) / sizeof(int); c++) {
+        memcpy(new_buf, old_buf, size);
+        for (int b = 0; b < blocks * changes[c] / 100; b++) {
+            new_buf[(b * 100 / changes[c]) * EXT2_BLOCK_SIZE] ^= 1;
+        }
+
+        for (int rewrite = 0; rewrite <= 1; rewrite++) {
+            unsigned char *disk = make_image();
+            int i_num = init_inode(disk, EXT2_ROOT_INO, size, 'f');
+            struct ext2_inode *tar_inode = get_inode(disk, i_num);
+            for (int i = 0; i < rounds; i++) {
+                char *from = i % 2 ? new_buf : old_buf;
+                char *to = i % 2 ? old_buf : new_buf;
+                write_into_block(disk, tar_inode, from, size);
+                discard_prealloc(disk);
+
+                long long start = now_ns();
+                if (rewrite) {
+                    for (int b = 0; b < blocks; b++) {
+                        free_block(disk, get_file_block(disk, tar_inode, b));
+                    }
+                    free_block(disk, tar_inode->i_block[SINGLE_INDIRECT]);
+                    memset(tar_inode->i_block, 0, sizeof(tar_inode->i_block));
+                    tar_inode->i_blocks = 0;
+                    write_into_block(disk, tar_inode, to, size);
+                } else {
+                    update_into_block(disk, tar_inode, to, size);
+                }
+                samples[i] = now_ns() - start;
+
+                discard_prealloc(disk);
+                for (int b = 0; b < blocks; b++) {
+                    free_block(disk, get_file_block(disk, tar_inode, b));
+                }
+                free_block(disk, tar_inode->i_block[SINGLE_INDIRECT]);
+                memset(tar_inode->i_block, 0, sizeof(tar_inode->i_block));
+                tar_inode->i_blocks = 0;
+                tar_inode->i_size = (unsigned int) size;
+            }
+
+            char params[64];
+            snprintf(params, sizeof(params), "\"changed_pct\":%d,\"mode\":\"%s\"",
+                     changes[c], rewrite ? "rewrite" : "update");
+            report("update_into_block", params, samples, rounds, size);
+            drop_image(disk);
+        }
+    }
+    free(new_buf);
+    free(old_buf);
+    free(samples);
+}
+
+/*
+ * Build a tree of the given depth under parent where every directory holds
+ * fanout sub directories and files small files.
+ */
+static void build_tree(unsigned char *disk, int parent, int depth, int fanout, int files) {
+    char name[16];
+    for (int i = 0; i < files; i++) {
+        snprintf(name, sizeof(name), "f%d", i);
+        bench_create(disk, parent, name, 64);
+    }
+    if (depth == 0) {
+        return;
+    }
+    for (int i = 0; i < fanout; i++) {
+        snprintf(name, sizeof(name), "d%d", i);
+        build_tree(disk, bench_mkdir(disk, parent, name), depth - 1, fanout, files);
+    }
+}
+
+/*
+ * Recursive removal of a whole directory tree.
+ */
+static void bench_remove_dir(void) {
+    int shapes[][3] = {{1, 4, 4}, {2, 4, 8}, {3, 4, 8}}; // depth, fanout, files
+
+    for (int s = 0; s < sizeof(shapes) / sizeof(shapes[0]); s++) {
+        int rounds = config.iterations / 100 > 0 ? config.iterations / 100 : 1;
+        long long *samples = malloc(sizeof(long long) * rounds);
+        unsigned char *disk = make_image();
+        build_tree(disk, bench_mkdir(disk, EXT2_ROOT_INO, "t"), shapes[s][0], shapes[s][1], shapes[s][2]);
+
+        discard_prealloc(disk);
+        size_t disk_size = image_size(disk);
+        unsigned char *pristine = malloc(disk_size);
+        memcpy(pristine, disk, disk_size);
+
+        for (int i = 0; i < rounds; i++) {
+            long long start = now_ns();
+            remove_dir(disk, "/t");
+            samples[i] = now_ns() - start;
+            memcpy(disk, pristine, disk_size);
+        }
+
+        char params[96];
+        snprintf(params, sizeof(params), "\"depth\":%d,\"fanout\":%d,\"files\":%d",
+                 shapes[s][0], shapes[s][1], shapes[s][2]);
+        report("remove_dir", params, samples, rounds, 0);
+        free(pristine);
+        free(samples);
+        drop_image(disk);
+    }
+}
+
+/*
+ * Return the block group of the given block.
+ */
+static int block_group(unsigned char *disk, unsigned int block_num) {
+    struct ext2_super_block *sb = get_superblock_loc(disk);
+    return (int) ((block_num - sb->s_first_data_block) / sb->s_blocks_per_group);
+}
+
+/*
+ * Return the block of the inode table that holds the given inode.
+ */
+static unsigned int inode_block(unsigned char *disk, int inode_num) {
+    return (unsigned int) (((unsigned char *) get_inode(disk, inode_num) - disk) / EXT2_BLOCK_SIZE);
+}
+
+/*
+ * Placement of a tree of top level directories, each holding files and
+ * sub directories with more files, on an image of 8 groups under every
+ * allocation policy. Reported are the share of files whose inode and data
+ * share the group of their directory, the mean distance in blocks from a
+ * directory's block to a file's inode and from there to its data, and the
+ * time to resolve and read every file.
+ */
+static void bench_placement(void) {
+    int policies[] = {ALLOC_FIRST_FIT, ALLOC_LOCALITY};
+    char *policy_names[] = {"first", "locality"};
+    int saved_policy = alloc_policy;
+    int tops = 8, subdirs = 2, files = 16, size = 4 * EXT2_BLOCK_SIZE;
+
+    for (int p = 0; p < sizeof(policies) / sizeof(int); p++) {
+        alloc_policy = policies[p];
+
+        struct mkfs_params params;
+        memset(&params, 0, sizeof(params));
+        params.blocks_count = (unsigned int) config.blocks;
+        params.blocks_per_group = (unsigned int) (config.blocks / 8) & ~7U;
+        params.inodes_count = (unsigned int) config.inodes;
+        params.sparse = 1;
+        if (format_image(config.image_path, &params) < 0) {
+            perror(config.image_path);
+            exit(1);
+        }
+        unsigned char *disk = get_disk_loc(config.image_path);
+
+        // Creation order interleaves the trees, as unrelated users would
+        int count = tops * (1 + subdirs) * files;
+        int *file_nums = malloc(sizeof(int) * count);
+        int *dir_nums = malloc(sizeof(int) * count);
+        char (*paths)[64] = malloc(sizeof(*paths) * count);
+        char name[32];
+        int n = 0;
+        for (int t = 0; t < tops; t++) {
+            snprintf(name, sizeof(name), "t%d", t);
+            int top = bench_mkdir(disk, EXT2_ROOT_INO, name);
+            for (int d = 0; d <= subdirs; d++) {
+                int dir = top;
+                char dir_path[32];
+                snprintf(dir_path, sizeof(dir_path), "/t%d", t);
+                if (d > 0) {
+                    snprintf(name, sizeof(name), "d%d", d);
+                    dir = bench_mkdir(disk, top, name);
+                    snprintf(dir_path, sizeof(dir_path), "/t%d/d%d", t, d);
+                }
+                for (int f = 0; f < files; f++) {
+                    snprintf(name, sizeof(name), "f%d", f);
+                    dir_nums[n] = dir;
+                    file_nums[n] = bench_create(disk, dir, name, size);
+                    snprintf(paths[n], sizeof(paths[n]), "%s/%s", dir_path, name);
+                    n++;
+                }
+            }
+        }
+
+        int same_group = 0;
+        long long distance = 0;
+        for (int i = 0; i < count; i++) {
+            struct ext2_inode *inode = get_inode(disk, file_nums[i]);
+            unsigned int dir_block = get_inode(disk, dir_nums[i])->i_block[0];
+            unsigned int i_block = inode_block(disk, file_nums[i]);
+            same_group += block_group(disk, i_block) == block_group(disk, dir_block)
+                          && block_group(disk, inode->i_block[0]) == block_group(disk, i_block);
+            distance += llabs((long long) i_block - dir_block) + llabs((long long) inode->i_block[0] - i_block);
+        }
+        printf("{\"bench\":\"placement\",\"params\":{\"policy\":\"%s\",\"groups\":%d},\"files\":%d,"
+               "\"same_group_pct\":%.1f,\"mean_distance_blocks\":%.1f}\n",
+               policy_names[p], get_groups_count(disk), count, 100.0 * same_group / count,
+               (double) distance / count);
+
+        int rounds = config.iterations / 100 > 0 ? config.iterations / 100 : 1;
+        long long *samples = malloc(sizeof(long long) * rounds);
+        volatile unsigned char sink = 0;
+        for (int r = 0; r < rounds; r++) {
+            long long start = now_ns();
+            for (int i = 0; i < count; i++) {
+                struct ext2_inode *inode = trace_path(paths[i], disk);
+                for (int b = 0; b < size / EXT2_BLOCK_SIZE; b++) {
+                    sink ^= disk[(size_t) inode->i_block[b] * EXT2_BLOCK_SIZE];
+                }
+            }
+            samples[r] = now_ns() - start;
+        }
+        char walk_params[64];
+        snprintf(walk_params, sizeof(walk_params), "\"policy\":\"%s\",\"files\":%d", policy_names[p], count);
+        report("placement_walk", walk_params, samples, rounds, 0);
+
+        free(samples);
+        free(paths);
+        free(dir_nums);
+        free(file_nums);
+        drop_image(disk);
+    }
+    alloc_policy = saved_policy;
+}
+
+/*
+ * Return the number of physically contiguous runs of the direct blocks of
+ * the given inode.
+ */
+static int count_runs(struct ext2_inode *inode) {
+    int runs = 0;
+    for (int k = 0; k < SINGLE_INDIRECT && inode->i_block[k]; k++) {
+        runs += k == 0 || inode->i_block[k] != inode->i_block[k - 1] + 1;
+    }
+    return runs;
+}
+
+/*
+ * Interleaved growth of several directories, one entry at a time in turn,
+ * as a batch session would do. With batch set the preallocation windows
+ * live for the whole session, otherwise they are released after every
+ * insert as separate tool runs would. Reported are the runs per directory
+ * and the time per insert.
+ */
+static void bench_prealloc(void) {
+    int dirs = 4, entries = 400;
+
+    for (int batch = 0; batch <= 1; batch++) {
+        unsigned char *disk = make_image();
+        int dir_nums[dirs];
+        char name[32];
+        for (int d = 0; d < dirs; d++) {
+            snprintf(name, sizeof(name), "d%d", d);
+            dir_nums[d] = bench_mkdir(disk, EXT2_ROOT_INO, name);
+        }
+        discard_prealloc(disk);
+        int i_num = init_inode(disk, EXT2_ROOT_INO, 0, 'f');
+
+        long long *samples = malloc(sizeof(long long) * dirs * entries);
+        for (int i = 0; i < entries; i++) {
+            for (int d = 0; d < dirs; d++) {
+                snprintf(name, sizeof(name), "entry_with_a_long_name_%05d", i);
+                long long start = now_ns();
+                add_new_entry(disk, get_inode(disk, dir_nums[d]), (unsigned int) i_num, name, 'f');
+                if (!batch) {
+                    discard_prealloc(disk);
+                }
+                samples[i * dirs + d] = now_ns() - start;
+            }
+        }
+
+        int runs = 0;
+        for (int d = 0; d < dirs; d++) {
+            runs += count_runs(get_inode(disk, dir_nums[d]));
+        }
+        char params[96];
+        snprintf(params, sizeof(params), "\"session\":\"%s\",\"dirs\":%d,\"runs_per_dir\":%.1f",
+                 batch ? "batch" : "per_op", dirs, (double) runs / dirs);
+        report("prealloc_interleave", params, samples, dirs * entries, 0);
+        free(samples);
+        drop_image(disk);
+    }
+}
+
+struct parallel_worker {
+    unsigned char *disk;
+    int dir_num;   /* Directory the worker creates its files in */
+    int files;
+    int id;
+};
+
+static void *parallel_worker_run(void *arg) {
+    struct parallel_worker *worker = arg;
+    char name[32];
+    for (int f = 0; f < worker->files; f++) {
+        snprintf(name, sizeof(name), "w%d_f%d", worker->id, f);
+        bench_create(worker->disk, worker->dir_num, name, 2 * EXT2_BLOCK_SIZE);
+    }
+    return NULL;
+}
+
+/*
+ * File creation by 1 to 8 threads on one image of 8 groups, each thread in
+ * its own directory, the same number of files in total. Reported is the
+ * throughput over the wall clock time of every thread count.
+ */
+static void bench_parallel_create(void) {
+    int total = config.iterations < config.inodes / 2 ? config.iterations : config.inodes / 2;
+
+    for (int threads = 1; threads <= 8; threads *= 2) {
+        struct mkfs_params params;
+        memset(&params, 0, sizeof(params));
+        params.blocks_count = (unsigned int) config.blocks;
+        params.blocks_per_group = (unsigned int) (config.blocks / 8) & ~7U;
+        params.inodes_count = (unsigned int) config.inodes;
+        params.sparse = 1;
+        if (format_image(config.image_path, &params) < 0) {
+            perror(config.image_path);
+            exit(1);
+        }
+        unsigned char *disk = get_disk_loc(config.image_path);
+
+        pthread_t tids[threads];
+        struct parallel_worker workers[threads];
+        char name[32];
+        for (int t = 0; t < threads; t++) {
+            snprintf(name, sizeof(name), "w%d", t);
+            workers[t].disk = disk;
+            workers[t].dir_num = bench_mkdir(disk, EXT2_ROOT_INO, name);
+            workers[t].files = total / threads;
+            workers[t].id = t;
+        }
+
+        long long start = now_ns();
+        for (int t = 0; t < threads; t++) {
+            pthread_create(&tids[t], NULL, parallel_worker_run, &workers[t]);
+        }
+        for (int t = 0; t < threads; t++) {
+            pthread_join(tids[t], NULL);
+        }
+        long long elapsed = now_ns() - start;
+
+        int ops = total / threads * threads;
+        printf("{\"bench\":\"parallel_create\",\"params\":{\"threads\":%d,\"groups\":%d},\"ops\":%d,"
+               "\"ns_per_op\":%.1f,\"ops_per_sec\":%.1f}\n",
+               threads, get_groups_count(disk), ops, (double) elapsed / ops, 1e9 * ops / elapsed);
+        fflush(stdout);
+        drop_image(disk);
+    }
+}
+
+struct alloc_worker {
+    unsigned char *disk;
+    int blocks;   /* Blocks to allocate */
+    int inodes;   /* Inodes to allocate */
+};
+
+static void *alloc_worker_run(void *arg) {
+    struct alloc_worker *worker = arg;
+    for (int i = 0; i < worker->blocks; i++) {
+        if (get_free_block(worker->disk) == -1) {
+            fprintf(stderr, "ext2_bench: image too small for alloc_scaling\n");
+            exit(1);
+        }
+    }
+    for (int i = 0; i < worker->inodes; i++) {
+        if (get_free_inode(worker->disk) == -1) {
+            fprintf(stderr, "ext2_bench: image too small for alloc_scaling\n");
+            exit(1);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Raw block and inode allocation by 1 to 8 threads on one image of 8
+ * groups, the same number of allocations in total, most of the free blocks
+ * and inodes. Reported is the throughput over the wall clock time.
+ */
+static void bench_alloc_scaling(void) {
+    for (int threads = 1; threads <= 8; threads *= 2) {
+        struct mkfs_params params;
+        memset(&params, 0, sizeof(params));
+        params.blocks_count = (unsigned int) config.blocks;
+        params.blocks_per_group = (unsigned int) (config.blocks / 8) & ~7U;
+        params.inodes_count = (unsigned int) config.inodes;
+        params.sparse = 1;
+        if (format_image(config.image_path, &params) < 0) {
+            perror(config.image_path);
+            exit(1);
+        }
+        unsigned char *disk = get_disk_loc(config.image_path);
+        struct ext2_super_block *sb = get_superblock_loc(disk);
+
+        pthread_t tids[threads];
+        struct alloc_worker worker = {disk, (int) sb->s_free_blocks_count * 3 / 4 / 8 * 8 / threads,
+                                      (int) sb->s_free_inodes_count * 3 / 4 / 8 * 8 / threads};
+        long long start = now_ns();
+        for (int t = 0; t < threads; t++) {
+            pthread_create(&tids[t], NULL, alloc_worker_run, &worker);
+        }
+        for (int t = 0; t < threads; t++) {
+            pthread_join(tids[t], NULL);
+        }
+        long long elapsed = now_ns() - start;
+
+        int ops = (worker.blocks + worker.inodes) * threads;
+        printf("{\"bench\":\"alloc_scaling\",\"params\":{\"threads\":%d,\"groups\":%d},\"ops\":%d,"
+               "\"ns_per_op\":%.1f,\"ops_per_sec\":%.1f}\n",
+               threads, get_groups_count(disk), ops, (double) elapsed / ops, 1e9 * ops / elapsed);
+        fflush(stdout);
+        drop_image(disk);
+    }
+}
+
+int main(int argc, char **argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "b:i:n:o:f:")) != -1) {
+        switch (opt) {
+            case 'b': config.blocks = atoi(optarg); break;
+            case 'i': config.inodes = atoi(optarg); break;
+            case 'n': config.iterations = atoi(optarg); break;
+            case 'o': config.image_path = optarg; break;
+            case 'f': config.filter = optarg; break;
+            default:
+                printf("Usage: ext2_bench [-b blocks] [-i inodes] [-n iterations] [-o image] [-f filter]\n");
+                exit(1);
+        }
+    }
+
+    if (config.blocks < 512 || config.inodes < 64 || config.iterations < 1) {
+        printf("ext2_bench: At least 512 blocks, 64 inodes and 1 iteration are required.\n");
+        exit(1);
+    }
+
+    if (selected("trace_path_deep")) bench_trace_path_deep();
+    if (selected("trace_path_wide")) bench_trace_path_wide();
+    if (selected("add_new_entry")) bench_add_new_entry();
+    if (selected("dir_append")) bench_dir_append();
+    if (selected("get_free_block")) bench_get_free_block();
+    if (selected("get_free_inode")) bench_get_free_inode();
+    if (selected("write_into_block")) bench_write_into_block();
+    if (selected("update_into_block")) bench_update_into_block();
+    if (selected("remove_dir")) bench_remove_dir();
+    if (selected("placement")) bench_placement();
+    if (selected("prealloc")) bench_prealloc();
+    if (selected("parallel_create")) bench_parallel_create();
+    if (selected("alloc_scaling")) bench_alloc_scaling();
+
+    unlink(config.image_path);
+    return 0;
+}
@@ -0,0 +1,46 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "ext2.h"
+#include "helper.h"
+
+/*
+ * This program compacts a directory on the disk: its live entries are
+ * repacked densely, and the directory blocks left empty by earlier removals
+ * are freed. With the "s" flag the entries are also ordered by name hash.
+ */
+int main(int argc, char **argv) {
+    // Check valid user input
+    if (argc != 3 && argc != 4) {
+        printf("Usage: ext2_compact <virtual_disk> <absolute_path> <-s>\n");
+        exit(1);
+    } else if (argc == 4 && strcmp(argv[3], "-s") != 0) {
+        printf("Usage: ext2_compact <virtual_disk> <absolute_path> <-s>\n");
+        exit(1);
+    }
+
+    // Map disk image file into memory
+    struct ext2_fs *fs = open_disk(argv[1]);
+    unsigned char *disk = fs->disk;
+
+    // Get the inode of the given path
+    struct ext2_inode *path_inode = trace_path(argv[2], disk);
+    if (path_inode == NULL) {
+        printf("ext2_compact: The path %s do not exist.\n", argv[2]);
+        return ENOENT;
+    }
+    if (!(path_inode->i_mode & EXT2_S_IFDIR)) {
+        printf("ext2_compact: The path %s is not a directory.\n", argv[2]);
+        return ENOTDIR;
+    }
+
+    int freed = compact_dir(disk, path_inode, argc == 4);
+    if (freed < 0) {
+        printf("ext2_compact: Not enough memory to compact %s.\n", argv[2]);
+        return ENOMEM;
+    }
+    printf("ext2_compact: %s: %d blocks freed.\n", argv[2], freed);
+
+    return sync_disk(disk);
+}
@@ -1,30 +1,61 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <string.h>
 #include <memory.h>
 #include "ext2.h"
 #include "helper.h"
+#include "libext2.h"
+#include "timer.h"
+#include "record.h"
 
-unsigned char *disk;
+/*
+ * Read size bytes of the source file into buf, which is zeroed already.
+ * Only the data regions are read: SEEK_DATA/SEEK_HOLE skip the holes of a
+ * sparse source. Return 0, or -1 on a read error.
+ */
+static int read_source(int fd, char *buf, int size) {
+    TIMED_SCOPE(PHASE_COPY);
+    off_t data = 0;
+    while (data < size && (data = lseek(fd, data, SEEK_DATA)) >= 0 && data < size) {
+        off_t hole = lseek(fd, data, SEEK_HOLE);
+        if (hole < 0 || hole > size) {
+            hole = size;
+        }
+        for (off_t pos = data; pos < hole; ) {
+            ssize_t n = pread(fd, buf + pos, hole - pos, pos);
+            if (n <= 0) {
+                return n == 0 ? 0 : -1;
+            }
+            pos += n;
+        }
+        data = hole;
+    }
+    // ENXIO means no data past this offset; a file system without SEEK_DATA
+    // support reports everything as data
+    return data < 0 && errno != ENXIO ? -1 : 0;
+}
 
 /*
  * This program copies the file on local file system on to the the specified
- * location on the disk. The program works similar to cp.
+ * location on the disk. The program works similar to cp. With -u an existing
+ * regular file is updated in place: only the blocks that changed are
+ * rewritten.
  */
 int main (int argc, char **argv) {
     // Check valid command line arguments
-    if (argc != 4) {
-        printf("Usage: ext2_cp <virtual_disk> <source_file> <absolute_path>\n");
+    int update = argc == 5 && strcmp(argv[4], "-u") == 0;
+    if (argc != 4 && !update) {
+        printf("Usage: ext2_cp <virtual_disk> <source_file> <absolute_path> [-u]\n");
         exit(1);
     }
 
     // Check valid disk
-    unsigned char *disk = get_disk_loc(argv[1]);
-    struct ext2_super_block *sb = get_superblock_loc(disk);
-    struct ext2_inode *i_table = get_inode_table_loc(disk);
+    struct ext2_fs *fs = open_disk(argv[1]);
 
     // Check valid path on native file system
     // Open source file
@@ -36,87 +67,64 @@ int main (int argc, char **argv) {
     // Get source file size.
     struct stat st;
     fstat(fd, &st);
+    record_local_file(2, st.st_size);
+    if (st.st_size > EXT2_MAX_FILE_SIZE) {
+        printf("ext2_cp: %s :File too large.\n", argv[2]);
+        return EFBIG;
+    }
     int file_size = (int) st.st_size;
-    int blocks_needed = file_size / EXT2_BLOCK_SIZE + (file_size % EXT2_BLOCK_SIZE != 0);
-
-    char *name_var = NULL;
-    struct ext2_inode *dir_inode = NULL;
-
-    // Check valid target absolute_path
-    struct ext2_inode *target_inode = trace_path(argv[3], disk);
-    char *parent_path = NULL;
-    struct ext2_inode *parent_inode = NULL;
-    if (target_inode != NULL) { // Target path exists
-        name_var = get_file_name(argv[2]);
-        // If source path is a directory
-        if (target_inode->i_mode & EXT2_S_IFDIR) {
-            // test whether the directory exist the same file name
-            struct ext2_inode *check = get_entry_with_name(disk, name_var, target_inode);
-            if (check == NULL) { // no file with same name exist
-                dir_inode = target_inode;
-            } else {
-                printf("ext2_cp: %s :File exists.\n", name_var);
-                return EEXIST;
-            }
 
-            // If such file exist -> EEXIST, no overwrite
-        } else { // Source path is a file or a link
-            printf("ext2_cp: %s :File exists.\n", name_var);
-            return EEXIST;
-        }
-    } else {
-        parent_path = get_dir_parent_path(argv[3]);
-        parent_inode = trace_path(parent_path, disk);
-
-        if (parent_inode == NULL) { // Parent path does not exist
-            printf("ext2_cp: %s :Invalid path.\n", argv[3]);
-            return ENOENT;
-            // Path like /file_name/ should fail
-        } else if ((argv[3])[strlen(argv[3]) - 1] == '/') {
-            printf("ext2_cp: %s :Invalid path.\n", argv[3]);
-            return ENOENT;
-        } else { // File path with file DNE (yet) in a valid directory path.
-            name_var = get_file_name(argv[3]);
-            dir_inode = parent_inode;
-        }
+    // Read the whole source before the target is created, so that a source
+    // that cannot be read leaves the image as it was
+    char *buf = calloc(file_size + 1, 1);
+    if (buf == NULL || read_source(fd, buf, file_size) < 0) {
+        perror("Read");
+        exit(1);
     }
 
-    if (strlen(name_var) > EXT2_NAME_LEN) { // target name too long
-        printf("ext2_cp: Target file with name too long: %s\n", name_var);
-        return ENOENT;
+    // Copying into a directory keeps the name of the source file
+    char *path = argv[3];
+    struct ext2_stat target;
+    if (ext2_stat(fs, argv[3], &target) == 0 && (target.mode & EXT2_S_IFMT) == EXT2_S_IFDIR) {
+        char *name = get_file_name(argv[2]);
+        path = malloc(strlen(argv[3]) + strlen(name) + 2);
+        sprintf(path, "%s%s%s", argv[3], argv[3][strlen(argv[3]) - 1] == '/' ? "" : "/", name);
+        free(name);
     }
 
-    // Check if there is enough inode (require 1)
-    if (sb->s_free_inodes_count <= 0) {
+    // If such file exist -> EEXIST, unless it is updated
+    int existed = ext2_lookup(fs, path) >= 0;
+    int i_num = ext2_file_open(fs, path, EXT2_O_CREAT | (update ? 0 : EXT2_O_EXCL));
+    if (i_num == -EEXIST || i_num == -EISDIR || i_num == -EINVAL) {
+        char *name = get_file_name(path);
+        printf("ext2_cp: %s :File exists.\n", name);
+        return EEXIST;
+    } else if (i_num == -ENAMETOOLONG) { // target name too long
+        char *name = get_file_name(path);
+        printf("ext2_cp: Target file with name too long: %s\n", name);
+        return ENOENT;
+    } else if (i_num == -ENOSPC) {
         printf("ext2_cp: File system does not have enough free inodes.\n");
         return ENOSPC;
+    } else if (i_num < 0) { // Parent path does not exist, or a path like /file_name/
+        printf("ext2_cp: %s :Invalid path.\n", argv[3]);
+        return ENOENT;
     }
 
-    // Check if there is enough blocks for Data
-    if ((blocks_needed <= 12 && sb->s_free_blocks_count < blocks_needed) ||
-        (blocks_needed > 12 && sb->s_free_blocks_count < blocks_needed + 1)) {
+    // Write into target file; zero blocks, whether holes of the source or
+    // not, stay unmapped, and blocks an update leaves as they are are not
+    // rewritten
+    if (ext2_file_write(fs, i_num, buf, file_size, 0) < 0) {
+        if (!existed) {
+            ext2_unlink(fs, path);
+        }
         printf("ext2_cp: File system does not have enough free blocks.\n");
         return ENOSPC;
-    } // If indirected block needed, one more indirect block is required to store pointers
-
-    // Require a free inode
-    int i_num = init_inode(disk, file_size, 'f');
-    struct ext2_inode *tar_inode = &(i_table[i_num - 1]);
-
-    // Write into target file (data blocks
-    char buf[file_size];
-    if (read(fd, buf, file_size) < 0) {
-        perror("Read");
-        exit(1);
     }
-
-    write_into_block(disk, tar_inode, buf, file_size);
-
-    // Create a new entry in directory
-    if (add_new_entry(disk, dir_inode, (unsigned int) i_num, name_var, 'f') == -1) {
-        printf("ext2_cp: Fail to add new directory entry in directory: %s\n", argv[3]);
-        exit(0);
+    if (existed) { // An update may shrink the file
+        ext2_file_truncate(fs, i_num, file_size);
     }
-    return 0;
-}
+    free(buf);
 
+    return sync_disk(fs->disk);
+}
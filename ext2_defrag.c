@@ -0,0 +1,211 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "ext2.h"
+#include "helper.h"
+#include "stats.h"
+#include "timer.h"
+
+#define USAGE "Usage: ext2_defrag [-n] [-t seconds] [-b blocks] <virtual_disk> [absolute_path]\n"
+
+/*
+ * Totals of one defragmentation pass.
+ */
+struct defrag_report {
+    int files;            /* Regular files looked at */
+    int fragmented;       /* Files made of more than one run */
+    int defragmented;     /* Files relocated into one run */
+    int skipped;          /* Fragmented files left as they are for lack of space or budget */
+    long long runs_before;
+    long long runs_after;
+    long long blocks_moved;
+};
+
+/*
+ * Fill layout with the physical blocks of the file in on-disk order: the
+ * mapped direct blocks, the indirect block, then the mapped blocks it points
+ * to. Holes are left out. Return the number of blocks in layout.
+ */
+static int get_layout(unsigned char *disk, struct ext2_inode *inode, unsigned int *layout) {
+    int count = 0;
+    for (int i = 0; i < SINGLE_INDIRECT; i++) {
+        if (inode->i_block[i]) {
+            layout[count++] = inode->i_block[i];
+        }
+    }
+    if (inode->i_block[SINGLE_INDIRECT]) {
+        unsigned int *indirect = get_indirect_block_loc(disk, inode);
+        layout[count++] = inode->i_block[SINGLE_INDIRECT];
+        for (int j = 0; j < INDIRECT_ENTRIES; j++) {
+            if (indirect[j]) {
+                layout[count++] = indirect[j];
+            }
+        }
+    }
+    return count;
+}
+
+/*
+ * Return the number of physically contiguous runs in a layout.
+ */
+static int count_runs(unsigned int *layout, int count) {
+    int runs = count > 0;
+    for (int i = 1; i < count; i++) {
+        if (layout[i] != layout[i - 1] + 1) {
+            runs++;
+        }
+    }
+    return runs;
+}
+
+/*
+ * Copy the blocks of layout to the run starting at new_start, one memcpy
+ * per run of contiguous source blocks.
+ */
+static void copy_layout(unsigned char *disk, unsigned int *layout, int count, unsigned int new_start) {
+    TIMED_SCOPE(PHASE_COPY);
+    int i = 0;
+    while (i < count) {
+        int run = 1;
+        while (i + run < count && layout[i + run] == layout[i] + run) {
+            run++;
+        }
+        memcpy(disk + (size_t) (new_start + i) * EXT2_BLOCK_SIZE,
+               disk + (size_t) layout[i] * EXT2_BLOCK_SIZE, (size_t) run * EXT2_BLOCK_SIZE);
+        STAT_ADD(bytes_copied, (unsigned long long) run * EXT2_BLOCK_SIZE);
+        i += run;
+    }
+}
+
+/*
+ * Move the blocks of the inode into one contiguous run if they are spread
+ * over several and fit in the remaining I/O budget (in blocks, -1 for none).
+ * Return the number of blocks moved.
+ */
+static int defrag_inode(unsigned char *disk, struct ext2_inode *inode, long long budget,
+                        struct defrag_report *report, int dry_run) {
+    unsigned int layout[SINGLE_INDIRECT + 1 + INDIRECT_ENTRIES];
+    int count = get_layout(disk, inode, layout);
+    int runs = count_runs(layout, count);
+
+    report->files++;
+    report->runs_before += runs;
+    if (runs <= 1) {
+        report->runs_after += runs;
+        return 0;
+    }
+    report->fragmented++;
+    if (dry_run) {
+        report->runs_after += runs;
+        return 0;
+    }
+
+    int new_start = (budget >= 0 && count > budget) ? -1 : get_free_run(disk, count);
+    if (new_start == -1) {
+        report->skipped++;
+        report->runs_after += runs;
+        return 0;
+    }
+
+    // The indirect block moves with the data, so rewrite its copy
+    copy_layout(disk, layout, count, (unsigned int) new_start);
+    int pos = 0;
+    for (int i = 0; i < SINGLE_INDIRECT; i++) {
+        if (inode->i_block[i]) {
+            inode->i_block[i] = (unsigned int) new_start + pos++;
+        }
+    }
+    if (inode->i_block[SINGLE_INDIRECT]) {
+        unsigned int *new_indirect = (unsigned int *) (disk + (size_t) (new_start + pos) * EXT2_BLOCK_SIZE);
+        inode->i_block[SINGLE_INDIRECT] = (unsigned int) new_start + pos++;
+        for (int j = 0; j < INDIRECT_ENTRIES; j++) {
+            if (new_indirect[j]) {
+                new_indirect[j] = (unsigned int) new_start + pos++;
+            }
+        }
+    }
+
+    for (int i = 0; i < count; i++) {
+        free_block(disk, layout[i]);
+    }
+
+    report->defragmented++;
+    report->runs_after += 1;
+    report->blocks_moved += count;
+    return count;
+}
+
+/*
+ * This program measures the fragmentation of regular files (the number of
+ * physically discontiguous runs of their blocks) and relocates fragmented
+ * files into one contiguous run each. Without a path the whole disk is
+ * processed, as far as the time (-t) and I/O (-b, blocks moved) budgets
+ * allow. With -n the fragmentation is only reported.
+ */
+int main(int argc, char **argv) {
+    int dry_run = 0;
+    double time_budget = -1;
+    long long io_budget = -1;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "nt:b:")) != -1) {
+        switch (opt) {
+            case 'n': dry_run = 1; break;
+            case 't': time_budget = atof(optarg); break;
+            case 'b': io_budget = atoll(optarg); break;
+            default:
+                printf(USAGE);
+                exit(1);
+        }
+    }
+    if (argc - optind != 1 && argc - optind != 2) {
+        printf(USAGE);
+        exit(1);
+    }
+
+    // Map disk image file into memory
+    struct ext2_fs *fs = open_disk(argv[optind]);
+    unsigned char *disk = fs->disk;
+    struct ext2_super_block *sb = get_superblock_loc(disk);
+
+    struct defrag_report report;
+    memset(&report, 0, sizeof(report));
+
+    if (argc - optind == 2) { // A single file
+        struct ext2_inode *path_inode = trace_path(argv[optind + 1], disk);
+        if (path_inode == NULL) {
+            printf("ext2_defrag: The path %s do not exist.\n", argv[optind + 1]);
+            return ENOENT;
+        }
+        if ((path_inode->i_mode & 0xF000) != EXT2_S_IFREG) {
+            printf("ext2_defrag: The path %s is not a regular file.\n", argv[optind + 1]);
+            return EINVAL;
+        }
+        defrag_inode(disk, path_inode, io_budget, &report, dry_run);
+    } else { // Every regular file, until a budget runs out
+        double deadline = time_budget >= 0 ? now_seconds() + time_budget : -1;
+        for (int i_num = EXT2_GOOD_OLD_FIRST_INO + 1; i_num <= sb->s_inodes_count; i_num++) {
+            if ((deadline >= 0 && now_seconds() > deadline) || io_budget == 0) {
+                break;
+            }
+            struct ext2_inode *inode = get_inode(disk, i_num);
+            if (!inode_in_use(disk, i_num) || inode->i_links_count == 0
+                || (inode->i_mode & 0xF000) != EXT2_S_IFREG) {
+                continue;
+            }
+            int moved = defrag_inode(disk, inode, io_budget, &report, dry_run);
+            if (io_budget >= 0) {
+                io_budget -= moved;
+            }
+        }
+    }
+
+    printf("{\"files\":%d,\"fragmented\":%d,\"defragmented\":%d,\"skipped\":%d,"
+           "\"runs_before\":%lld,\"runs_after\":%lld,\"blocks_moved\":%lld}\n",
+           report.files, report.fragmented, report.defragmented, report.skipped,
+           report.runs_before, report.runs_after, report.blocks_moved);
+
+    return sync_disk(disk);
+}
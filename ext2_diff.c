@@ -0,0 +1,334 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include "ext2.h"
+#include "helper.h"
+#include "csum.h"
+
+#if defined(__x86_64__)
+#include <emmintrin.h>
+#endif
+
+#define USAGE "Usage: ext2_diff [-t threads] [-f] <old_disk> <new_disk>\n"
+
+/*
+ * One image being compared: the owner of each of its blocks, for the blocks
+ * that belong to an inode, and the paths of the changed inodes.
+ */
+struct diff_side {
+    unsigned char *disk;
+    unsigned char *kinds;      /* enum meta_kind of each block */
+    int *owners;               /* Inode number owning each block, 0 for none */
+    int *owner_index;          /* File block index of each block, -1 for the indirect block */
+    char **paths;              /* Of the listed inodes, PATH_WANTED until found */
+};
+
+struct diff_job {
+    unsigned char *old_disk;
+    unsigned char *new_disk;
+    unsigned int *blocks;      /* Blocks to compare, in order */
+    unsigned char *changed;    /* One byte per entry of blocks, set if they differ */
+    long long from;
+    long long to;
+};
+
+/*
+ * Return 1 if the two blocks differ. 64 bytes are compared per step, as four
+ * SSE2 vectors (or eight words elsewhere) whose XORs are ORed together.
+ */
+static int blocks_differ(const unsigned char *a, const unsigned char *b) {
+#if defined(__x86_64__)
+    const __m128i *x = (const __m128i *) a, *y = (const __m128i *) b;
+    for (int i = 0; i < EXT2_BLOCK_SIZE / 16; i += 4) {
+        __m128i acc = _mm_or_si128(
+                _mm_or_si128(_mm_xor_si128(_mm_loadu_si128(x + i), _mm_loadu_si128(y + i)),
+                             _mm_xor_si128(_mm_loadu_si128(x + i + 1), _mm_loadu_si128(y + i + 1))),
+                _mm_or_si128(_mm_xor_si128(_mm_loadu_si128(x + i + 2), _mm_loadu_si128(y + i + 2)),
+                             _mm_xor_si128(_mm_loadu_si128(x + i + 3), _mm_loadu_si128(y + i + 3))));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) != 0xFFFF) {
+            return 1;
+        }
+    }
+    return 0;
+#else
+    const unsigned long long *x = (const unsigned long long *) a, *y = (const unsigned long long *) b;
+    for (int i = 0; i < EXT2_BLOCK_SIZE / 8; i += 8) {
+        unsigned long long acc = 0;
+        for (int l = 0; l < 8; l++) {
+            acc |= x[i + l] ^ y[i + l];
+        }
+        if (acc) {
+            return 1;
+        }
+    }
+    return 0;
+#endif
+}
+
+static void *compare_range(void *arg) {
+    struct diff_job *job = arg;
+    for (long long i = job->from; i < job->to; i++) {
+        size_t offset = (size_t) job->blocks[i] * EXT2_BLOCK_SIZE;
+        job->changed[i] = (unsigned char) blocks_differ(job->old_disk + offset, job->new_disk + offset);
+    }
+    return NULL;
+}
+
+/*
+ * Return the number of inodes in one inode table block.
+ */
+static unsigned int get_inodes_per_block(unsigned char *disk) {
+    struct ext2_super_block *sb = get_superblock_loc(disk);
+    return EXT2_BLOCK_SIZE / (sb->s_rev_level == 0 ? (unsigned int) sizeof(struct ext2_inode) : sb->s_inode_size);
+}
+
+static void set_owner(struct diff_side *side, unsigned int blocks_count, unsigned int block, int inode_num,
+                      int index) {
+    if (block > 0 && block < blocks_count) {
+        side->owners[block] = inode_num;
+        side->owner_index[block] = index;
+    }
+}
+
+/*
+ * Fill in the kind and owner of every block of one image.
+ */
+static void map_owners(struct diff_side *side) {
+    struct ext2_super_block *sb = get_superblock_loc(side->disk);
+    unsigned int blocks_count = sb->s_blocks_count;
+    side->kinds = calloc(blocks_count, 1);
+    side->owners = calloc(blocks_count, sizeof(int));
+    side->owner_index = calloc(blocks_count, sizeof(int));
+    side->paths = calloc(sb->s_inodes_count, sizeof(char *));
+    unsigned int *unused = malloc(sizeof(unsigned int) * blocks_count);
+    if (side->kinds == NULL || side->owners == NULL || side->owner_index == NULL || side->paths == NULL
+        || unused == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    map_metadata(side->disk, side->kinds, unused);
+    free(unused);
+
+    for (int i_num = EXT2_ROOT_INO; i_num <= sb->s_inodes_count; i_num++) {
+        if (!owns_blocks(side->disk, i_num)) {
+            continue;
+        }
+        struct ext2_inode *inode = get_inode(side->disk, i_num);
+        for (int k = 0; k < SINGLE_INDIRECT; k++) {
+            set_owner(side, blocks_count, inode->i_block[k], i_num, k);
+        }
+        unsigned int indirect_num = inode->i_block[SINGLE_INDIRECT];
+        if (indirect_num > 0 && indirect_num < blocks_count) {
+            set_owner(side, blocks_count, indirect_num, i_num, -1);
+            unsigned int *indirect = get_indirect_block_loc(side->disk, inode);
+            for (int j = 0; j < INDIRECT_ENTRIES; j++) {
+                set_owner(side, blocks_count, indirect[j], i_num, SINGLE_INDIRECT + j);
+            }
+        }
+    }
+}
+
+static const char *path_of(struct diff_side *side, int inode_num) {
+    char *path = side->paths[inode_num - 1];
+    return path != NULL && path != PATH_WANTED ? path : "?";
+}
+
+/*
+ * Print what a changed block is in one image.
+ */
+static void print_block_owner(struct diff_side *side, unsigned int block) {
+    unsigned int inodes_per_block = get_inodes_per_block(side->disk);
+    int inode_num = side->owners[block];
+    if (inode_num > 0 && side->owner_index[block] < 0) {
+        printf("indirect block of inode %d (%s)", inode_num, path_of(side, inode_num));
+    } else if (inode_num > 0) {
+        printf("block %d of inode %d (%s)", side->owner_index[block], inode_num, path_of(side, inode_num));
+    } else if (side->kinds[block] == META_INODE_TABLE) {
+        struct ext2_super_block *sb = get_superblock_loc(side->disk);
+        struct ext2_group_desc *gd = get_group_descriptor_loc(side->disk);
+        int group = (int) ((block - sb->s_first_data_block) / sb->s_blocks_per_group);
+        unsigned int first = group * sb->s_inodes_per_group
+                             + (block - gd[group].bg_inode_table) * inodes_per_block + 1;
+        printf("inode table of group %d (inodes %u-%u)", group, first, first + inodes_per_block - 1);
+    } else if (side->kinds[block] == META_BLOCK_BITMAP) {
+        printf("block bitmap");
+    } else if (side->kinds[block] == META_INODE_BITMAP) {
+        printf("inode bitmap");
+    } else if (side->kinds[block] == META_SUPER) {
+        printf("super block");
+    } else if (side->kinds[block] == META_GROUP_DESC) {
+        printf("group descriptors");
+    } else if (block_in_use(side->disk, block)) {
+        printf("allocated, no owner");
+    } else {
+        printf("free");
+    }
+}
+
+/*
+ * This program compares two images of the same geometry block by block,
+ * skipping the blocks free in both, and lists the changed blocks with what
+ * they hold in each image, then the files added (A), deleted (D) or modified
+ * (M) between them. A file is modified when one of its blocks or its inode
+ * changed. With -f only the files are listed. A final JSON line gives the
+ * counts and the compare throughput.
+ */
+int main(int argc, char **argv) {
+    int threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    int files_only = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "t:f")) != -1) {
+        switch (opt) {
+            case 't': threads = atoi(optarg); break;
+            case 'f': files_only = 1; break;
+            default:
+                printf(USAGE);
+                exit(1);
+        }
+    }
+    if (argc - optind != 2 || threads < 1) {
+        printf(USAGE);
+        exit(1);
+    }
+
+    // Map both disk image files into memory
+    struct diff_side old = {get_disk_loc(argv[optind])};
+    struct diff_side new = {get_disk_loc(argv[optind + 1])};
+    struct ext2_super_block *sb = get_superblock_loc(new.disk);
+    struct ext2_super_block *old_sb = get_superblock_loc(old.disk);
+    if (sb->s_blocks_count != old_sb->s_blocks_count || sb->s_blocks_per_group != old_sb->s_blocks_per_group
+        || sb->s_inodes_count != old_sb->s_inodes_count || sb->s_inodes_per_group != old_sb->s_inodes_per_group) {
+        printf("ext2_diff: %s :Not the same geometry as %s.\n", argv[optind + 1], argv[optind]);
+        return EINVAL;
+    }
+    unsigned int blocks_count = sb->s_blocks_count;
+    double start = now_seconds();
+
+    // Only the blocks allocated in either image
+    unsigned int *blocks = malloc(sizeof(unsigned int) * blocks_count);
+    unsigned char *changed = malloc(blocks_count);
+    if (blocks == NULL || changed == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    long long count = 0;
+    for (unsigned int b = 0; b < blocks_count; b++) {
+        if (block_in_use(old.disk, b) || block_in_use(new.disk, b)) {
+            blocks[count++] = b;
+        }
+    }
+
+    // Compare in parallel, each thread a contiguous range of the images
+    double compare_start = now_seconds();
+    pthread_t tids[threads];
+    struct diff_job jobs[threads];
+    for (int t = 0; t < threads; t++) {
+        jobs[t].old_disk = old.disk;
+        jobs[t].new_disk = new.disk;
+        jobs[t].blocks = blocks;
+        jobs[t].changed = changed;
+        jobs[t].from = count * t / threads;
+        jobs[t].to = count * (t + 1) / threads;
+        pthread_create(&tids[t], NULL, compare_range, &jobs[t]);
+    }
+    for (int t = 0; t < threads; t++) {
+        pthread_join(tids[t], NULL);
+    }
+    double compare_seconds = now_seconds() - compare_start;
+
+    // Inodes touched: owners of changed blocks, and inodes whose own
+    // record or in-use bit changed
+    map_owners(&old);
+    map_owners(&new);
+    unsigned char *touched = calloc(sb->s_inodes_count + 1, 1);
+    if (touched == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    long long changed_count = 0;
+    for (long long i = 0; i < count; i++) {
+        if (!changed[i]) {
+            continue;
+        }
+        unsigned int b = blocks[i];
+        changed_count++;
+        touched[old.owners[b]] = touched[new.owners[b]] = 1;
+        if (new.kinds[b] == META_INODE_TABLE || new.kinds[b] == META_INODE_BITMAP) {
+            // Each of its inodes is compared by record and in-use bit
+            struct ext2_group_desc *gd = get_group_descriptor_loc(new.disk);
+            int group = (int) ((b - sb->s_first_data_block) / sb->s_blocks_per_group);
+            unsigned int first = group * sb->s_inodes_per_group + 1;
+            unsigned int last = first + sb->s_inodes_per_group - 1;
+            if (new.kinds[b] == META_INODE_TABLE) {
+                unsigned int inodes_per_block = get_inodes_per_block(new.disk);
+                first += (b - gd[group].bg_inode_table) * inodes_per_block;
+                last = first + inodes_per_block - 1;
+            }
+            for (unsigned int i_num = first; i_num <= last && i_num <= sb->s_inodes_count; i_num++) {
+                if (inode_in_use(old.disk, (int) i_num) != inode_in_use(new.disk, (int) i_num)
+                    || memcmp(get_inode(old.disk, (int) i_num), get_inode(new.disk, (int) i_num),
+                              sizeof(struct ext2_inode)) != 0) {
+                    touched[i_num] = 1;
+                }
+            }
+        }
+    }
+    touched[0] = 0;
+
+    // Paths, from the image in which each touched inode is in use
+    for (int i_num = 1; i_num <= sb->s_inodes_count; i_num++) {
+        if (touched[i_num]) {
+            if (inode_in_use(old.disk, i_num)) {
+                old.paths[i_num - 1] = PATH_WANTED;
+            }
+            if (inode_in_use(new.disk, i_num)) {
+                new.paths[i_num - 1] = PATH_WANTED;
+            }
+        }
+    }
+    old.paths[EXT2_ROOT_INO - 1] = new.paths[EXT2_ROOT_INO - 1] = "/";
+    find_paths(old.disk, get_inode(old.disk, EXT2_ROOT_INO), "/", old.paths);
+    find_paths(new.disk, get_inode(new.disk, EXT2_ROOT_INO), "/", new.paths);
+
+    if (!files_only) {
+        for (long long i = 0; i < count; i++) {
+            if (changed[i]) {
+                printf("block %u: ", blocks[i]);
+                print_block_owner(&old, blocks[i]);
+                printf(" -> ");
+                print_block_owner(&new, blocks[i]);
+                printf("\n");
+            }
+        }
+    }
+
+    int files_changed = 0;
+    for (int i_num = EXT2_ROOT_INO; i_num <= sb->s_inodes_count; i_num++) {
+        if (!touched[i_num]) {
+            continue;
+        }
+        int in_old = inode_in_use(old.disk, i_num) && get_inode(old.disk, i_num)->i_links_count > 0;
+        int in_new = inode_in_use(new.disk, i_num) && get_inode(new.disk, i_num)->i_links_count > 0;
+        if (in_old && in_new) {
+            printf("M %s\n", path_of(&new, i_num));
+        } else if (in_new) {
+            printf("A %s\n", path_of(&new, i_num));
+        } else if (in_old) {
+            printf("D %s\n", path_of(&old, i_num));
+        } else {
+            continue;
+        }
+        files_changed++;
+    }
+
+    double seconds = now_seconds() - start;
+    printf("{\"blocks_compared\":%lld,\"blocks_skipped\":%lld,\"blocks_changed\":%lld,\"files_changed\":%d,"
+           "\"threads\":%d,\"seconds\":%.3f,\"compare_mb_per_sec\":%.1f}\n",
+           count, blocks_count - count, changed_count, files_changed, threads, seconds,
+           compare_seconds > 0 ? count * 2.0 * EXT2_BLOCK_SIZE / (1 << 20) / compare_seconds : 0);
+    return 0;
+}
@@ -0,0 +1,292 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include "ext2.h"
+#include "helper.h"
+#include "csum.h"
+#include "timer.h"
+
+#define USAGE "Usage: ext2_dups [-t threads] [-l groups] <virtual_disk>\n"
+
+/*
+ * A scanned data block and the hash of its content.
+ */
+struct block_hash {
+    unsigned long long hash;
+    unsigned int block;
+};
+
+/*
+ * Blocks of equal content. The first block is kept, the others could be
+ * shared with it.
+ */
+struct dup_group {
+    unsigned int first;    /* Index of the first member in the sorted hashes */
+    unsigned int count;
+};
+
+/*
+ * A file block that belongs to a duplicate group.
+ */
+struct dup_owner {
+    unsigned int block;
+    int inode_num;
+    int block_index;
+};
+
+struct hash_job {
+    unsigned char *disk;
+    struct block_hash *hashes;
+    long long from;
+    long long to;
+};
+
+static void *hash_range(void *arg) {
+    struct hash_job *job = arg;
+    for (long long i = job->from; i < job->to; i++) {
+        job->hashes[i].hash = hash_block(job->disk + (size_t) job->hashes[i].block * EXT2_BLOCK_SIZE);
+    }
+    return NULL;
+}
+
+/*
+ * Call visit for every data block of the inode (indirect blocks excluded).
+ */
+static void for_each_data_block(unsigned char *disk, int inode_num, void (*visit)(int, int, unsigned int, void *), void *arg) {
+    struct ext2_inode *inode = get_inode(disk, inode_num);
+    for (int k = 0; k < SINGLE_INDIRECT; k++) {
+        if (inode->i_block[k]) {
+            visit(inode_num, k, inode->i_block[k], arg);
+        }
+    }
+    if (inode->i_block[SINGLE_INDIRECT]) {
+        unsigned int *indirect = get_indirect_block_loc(disk, inode);
+        for (int j = 0; j < INDIRECT_ENTRIES; j++) {
+            if (indirect[j]) {
+                visit(inode_num, SINGLE_INDIRECT + j, indirect[j], arg);
+            }
+        }
+    }
+}
+
+static void mark_data_block(int inode_num, int block_index, unsigned int block, void *arg) {
+    unsigned char *data_map = arg;
+    data_map[block / 8] |= 1 << (block % 8);
+}
+
+/*
+ * Owners of the blocks that belong to a duplicate group, found by a second
+ * pass over the inodes. dup_map marks those blocks.
+ */
+struct owner_list {
+    unsigned char *dup_map;
+    struct dup_owner *owners;
+    int len;
+    int cap;
+};
+
+static void collect_owner(int inode_num, int block_index, unsigned int block, void *arg) {
+    struct owner_list *list = arg;
+    if (!(1 & (list->dup_map[block / 8] >> (block % 8)))) {
+        return;
+    }
+    if (list->len == list->cap) {
+        list->cap = list->cap ? list->cap * 2 : 256;
+        list->owners = realloc(list->owners, sizeof(struct dup_owner) * list->cap);
+        if (list->owners == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    list->owners[list->len].block = block;
+    list->owners[list->len].inode_num = inode_num;
+    list->owners[list->len].block_index = block_index;
+    list->len++;
+}
+
+static int compare_hash(const void *a, const void *b) {
+    const struct block_hash *x = a, *y = b;
+    if (x->hash != y->hash) {
+        return x->hash < y->hash ? -1 : 1;
+    }
+    return (x->block > y->block) - (x->block < y->block);
+}
+
+static int compare_owner_block(const void *a, const void *b) {
+    const struct dup_owner *x = a, *y = b;
+    return (x->block > y->block) - (x->block < y->block);
+}
+
+static int compare_group_size(const void *a, const void *b) {
+    const struct dup_group *x = a, *y = b;
+    return (y->count > x->count) - (y->count < x->count);
+}
+
+/*
+ * This program reports duplicate data blocks in the disk: every allocated
+ * block that belongs to a file, directory or symlink is hashed (by several
+ * threads), blocks of equal hash are compared byte for byte, and each group
+ * of identical blocks is listed with the files that own its blocks. At the
+ * end the space that sharing the duplicates would reclaim is summed up.
+ */
+int main(int argc, char **argv) {
+    int threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    int shown = 20;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "t:l:")) != -1) {
+        switch (opt) {
+            case 't': threads = atoi(optarg); break;
+            case 'l': shown = atoi(optarg); break;
+            default:
+                printf(USAGE);
+                exit(1);
+        }
+    }
+    if (argc - optind != 1 || threads < 1) {
+        printf(USAGE);
+        exit(1);
+    }
+
+    // Map disk image file into memory
+    struct ext2_fs *fs = open_disk(argv[optind]);
+    unsigned char *disk = fs->disk;
+    struct ext2_super_block *sb = get_superblock_loc(disk);
+    double start = now_seconds();
+
+    // Data blocks of the files, so that metadata blocks are not reported
+    unsigned char *data_map = calloc(sb->s_blocks_count / 8 + 1, 1);
+    for (int i_num = EXT2_ROOT_INO; i_num <= sb->s_inodes_count; i_num++) {
+        if (owns_blocks(disk, i_num)) {
+            for_each_data_block(disk, i_num, mark_data_block, data_map);
+        }
+    }
+
+    // Every allocated block of the block bitmaps that holds file data
+    long long count = 0, cap = 1024;
+    struct block_hash *hashes = malloc(sizeof(struct block_hash) * cap);
+    for (int g = 0; g < get_groups_count(disk); g++) {
+        unsigned char *block_bitmap = get_group_block_bitmap_loc(disk, g);
+        unsigned int group_start = sb->s_first_data_block + g * sb->s_blocks_per_group;
+        for (unsigned int i = 0; i < sb->s_blocks_per_group && group_start + i < sb->s_blocks_count; i++) {
+            unsigned int block = group_start + i;
+            if ((1 & (block_bitmap[i / 8] >> (i % 8))) && (1 & (data_map[block / 8] >> (block % 8)))) {
+                if (count == cap) {
+                    cap *= 2;
+                    hashes = realloc(hashes, sizeof(struct block_hash) * cap);
+                    if (hashes == NULL) {
+                        perror("realloc");
+                        exit(1);
+                    }
+                }
+                hashes[count++].block = block;
+            }
+        }
+    }
+
+    // Hash in parallel, each thread a contiguous range of the image
+    double hash_start = now_seconds();
+    pthread_t tids[threads];
+    struct hash_job jobs[threads];
+    for (int t = 0; t < threads; t++) {
+        jobs[t].disk = disk;
+        jobs[t].hashes = hashes;
+        jobs[t].from = count * t / threads;
+        jobs[t].to = count * (t + 1) / threads;
+        pthread_create(&tids[t], NULL, hash_range, &jobs[t]);
+    }
+    for (int t = 0; t < threads; t++) {
+        pthread_join(tids[t], NULL);
+    }
+    double hash_seconds = now_seconds() - hash_start;
+
+    // Equal hashes end up next to each other; split runs by real content
+    qsort(hashes, count, sizeof(struct block_hash), compare_hash);
+    struct dup_group *groups = malloc(sizeof(struct dup_group) * (count / 2 + 1));
+    int groups_len = 0;
+    long long dup_blocks = 0;
+    for (long long i = 0; i < count; ) {
+        long long end = i + 1;
+        while (end < count && hashes[end].hash == hashes[i].hash) {
+            end++;
+        }
+        // Move the blocks identical to the first one of the run to its front
+        while (end - i > 1) {
+            unsigned char *first = disk + (size_t) hashes[i].block * EXT2_BLOCK_SIZE;
+            long long same = i + 1;
+            for (long long j = i + 1; j < end; j++) {
+                if (memcmp(first, disk + (size_t) hashes[j].block * EXT2_BLOCK_SIZE, EXT2_BLOCK_SIZE) == 0) {
+                    struct block_hash tmp = hashes[same];
+                    hashes[same++] = hashes[j];
+                    hashes[j] = tmp;
+                }
+            }
+            if (same - i > 1) {
+                groups[groups_len].first = (unsigned int) i;
+                groups[groups_len].count = (unsigned int) (same - i);
+                groups_len++;
+                dup_blocks += same - i - 1;
+            }
+            i = same;
+        }
+        i = end;
+    }
+
+    // Owners and paths, only for the groups that are shown
+    qsort(groups, groups_len, sizeof(struct dup_group), compare_group_size);
+    if (shown > groups_len) {
+        shown = groups_len;
+    }
+    struct owner_list list = {calloc(sb->s_blocks_count / 8 + 1, 1), NULL, 0, 0};
+    for (int gi = 0; gi < shown; gi++) {
+        for (unsigned int m = 0; m < groups[gi].count; m++) {
+            unsigned int block = hashes[groups[gi].first + m].block;
+            list.dup_map[block / 8] |= 1 << (block % 8);
+        }
+    }
+    // Path of every inode that owns a shown duplicate block
+    char **paths = calloc(sb->s_inodes_count, sizeof(char *));
+    if (shown > 0) {
+        for (int i_num = EXT2_ROOT_INO; i_num <= sb->s_inodes_count; i_num++) {
+            if (owns_blocks(disk, i_num)) {
+                for_each_data_block(disk, i_num, collect_owner, &list);
+            }
+        }
+        qsort(list.owners, list.len, sizeof(struct dup_owner), compare_owner_block);
+        for (int o = 0; o < list.len; o++) {
+            if (paths[list.owners[o].inode_num - 1] == NULL) {
+                paths[list.owners[o].inode_num - 1] = PATH_WANTED;
+            }
+        }
+        if (paths[EXT2_ROOT_INO - 1] == PATH_WANTED) {
+            paths[EXT2_ROOT_INO - 1] = "/";
+        }
+        find_paths(disk, get_inode(disk, EXT2_ROOT_INO), "/", paths);
+    }
+
+    for (int gi = 0; gi < shown; gi++) {
+        printf("group %d: %u identical blocks, %u bytes reclaimable\n", gi + 1, groups[gi].count,
+               (groups[gi].count - 1) * EXT2_BLOCK_SIZE);
+        for (unsigned int m = 0; m < groups[gi].count; m++) {
+            struct dup_owner key = {hashes[groups[gi].first + m].block, 0, 0};
+            struct dup_owner *owner = bsearch(&key, list.owners, list.len, sizeof(struct dup_owner),
+                                              compare_owner_block);
+            if (owner == NULL) {
+                continue;
+            }
+            char *path = paths[owner->inode_num - 1];
+            printf("  block %u: %s (inode %d, block %d)\n", owner->block,
+                   path != NULL && path != PATH_WANTED ? path : "?", owner->inode_num, owner->block_index);
+        }
+    }
+
+    double seconds = now_seconds() - start;
+    printf("{\"blocks_scanned\":%lld,\"dup_groups\":%d,\"dup_blocks\":%lld,\"reclaimable_bytes\":%lld,"
+           "\"threads\":%d,\"seconds\":%.3f,\"hash_mb_per_sec\":%.1f}\n",
+           count, groups_len, dup_blocks, dup_blocks * EXT2_BLOCK_SIZE, threads, seconds,
+           hash_seconds > 0 ? count * (double) EXT2_BLOCK_SIZE / (1 << 20) / hash_seconds : 0);
+    return 0;
+}
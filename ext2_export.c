@@ -0,0 +1,430 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "ext2.h"
+#include "helper.h"
+#include "mkfs.h"
+#include "csum.h"
+
+#define USAGE "Usage: ext2_export [-s] <virtual_disk> <output_file>\n" \
+              "  -s  shrink the copy. Inodes are not moved, so every group up to the\n" \
+              "      last one with an inode in use is kept.\n"
+
+#define COPY_BUFFER (1 << 20)
+
+/*
+ * Totals of one export.
+ */
+struct export_report {
+    long long runs;           /* Runs of blocks in use */
+    long long blocks;         /* Blocks in use */
+    long long bytes_copied;   /* Bytes of data in the runs, holes of the source left out */
+    int fallback;             /* copy_file_range() was not usable, pread()/pwrite() were */
+    unsigned int blocks_moved;
+};
+
+/*
+ * Copy len bytes at offset from in_fd to out_fd, with copy_file_range() and
+ * else through a buffer. Return 0, or -1 with errno set.
+ */
+static int copy_bytes(int in_fd, int out_fd, off_t offset, size_t len, struct export_report *report) {
+    while (len > 0 && !report->fallback) {
+        off_t in_off = offset, out_off = offset;
+        ssize_t n = copy_file_range(in_fd, &in_off, out_fd, &out_off, len, 0);
+        if (n < 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP)) {
+            report->fallback = 1;
+            break;
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            errno = n < 0 ? errno : EIO;
+            return -1;
+        }
+        offset += n;
+        len -= n;
+        report->bytes_copied += n;
+    }
+
+    static unsigned char *buf = NULL;
+    if (len > 0 && buf == NULL && (buf = malloc(COPY_BUFFER)) == NULL) {
+        return -1;
+    }
+    while (len > 0) {
+        ssize_t n = pread(in_fd, buf, len < COPY_BUFFER ? len : COPY_BUFFER, offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            errno = n < 0 ? errno : EIO;
+            return -1;
+        }
+        for (ssize_t done = 0; done < n; ) {
+            ssize_t w = pwrite(out_fd, buf + done, n - done, offset + done);
+            if (w < 0 && errno != EINTR) {
+                return -1;
+            }
+            done += w > 0 ? w : 0;
+        }
+        offset += n;
+        len -= n;
+        report->bytes_copied += n;
+    }
+    return 0;
+}
+
+/*
+ * Copy one run of blocks, only the parts that hold data in the source: the
+ * holes of a sparse source (such as inode tables mkfs never wrote) stay holes.
+ */
+static int copy_run(int in_fd, int out_fd, off_t offset, off_t end, struct export_report *report) {
+    while (offset < end) {
+        off_t data = lseek(in_fd, offset, SEEK_DATA);
+        if (data < 0 && errno == ENXIO) { // Only a hole is left
+            return 0;
+        } else if (data < 0) { // No hole support, copy it all
+            return copy_bytes(in_fd, out_fd, offset, end - offset, report);
+        } else if (data >= end) {
+            return 0;
+        }
+        off_t hole = lseek(in_fd, data, SEEK_HOLE);
+        if (hole < 0 || hole > end) {
+            hole = end;
+        }
+        if (copy_bytes(in_fd, out_fd, data, hole - data, report) < 0) {
+            return -1;
+        }
+        offset = hole;
+    }
+    return 0;
+}
+
+static int bit_set(unsigned char *bitmap, unsigned int bit) {
+    return 1 & (bitmap[bit / 8] >> (bit % 8));
+}
+
+static int count_zero_bits(unsigned char *bitmap, unsigned int bits) {
+    int zeros = 0;
+    for (unsigned int i = 0; i < bits; i++) {
+        zeros += !bit_set(bitmap, i);
+    }
+    return zeros;
+}
+
+/*
+ * Return the smallest blocks count the disk can shrink to, or its own
+ * blocks count if it cannot shrink. Inodes are not relocated, since that
+ * would renumber them and rewrite every directory entry naming them: every
+ * group up to the last one with an inode in use is kept. Every block owned
+ * past the new end needs a free block before it, and a partial last group
+ * needs room for some data, as in mkfs.
+ */
+static unsigned int shrink_target(unsigned char *disk, unsigned char *owned) {
+    struct ext2_super_block *sb = get_superblock_loc(disk);
+    struct ext2_group_desc *gd = get_group_descriptor_loc(disk);
+    unsigned int first = sb->s_first_data_block, bpg = sb->s_blocks_per_group;
+    int inode_size = sb->s_rev_level == 0 ? (int) sizeof(struct ext2_inode) : sb->s_inode_size;
+    unsigned int table_blocks = (sb->s_inodes_per_group * inode_size + EXT2_BLOCK_SIZE - 1) / EXT2_BLOCK_SIZE;
+
+    int min_groups = 1;
+    for (int i_num = (int) sb->s_inodes_count; i_num > 0; i_num--) {
+        if (inode_in_use(disk, i_num)) {
+            min_groups = (i_num - 1) / (int) sb->s_inodes_per_group + 1;
+            break;
+        }
+    }
+
+    long long owned_above = 0;
+    for (unsigned int b = first; b < sb->s_blocks_count; b++) {
+        owned_above += owned[b];
+    }
+    long long free_below = 0;
+    for (unsigned int t = first + 1; t < sb->s_blocks_count; t++) {
+        // Blocks [first, t) are kept
+        free_below += !block_in_use(disk, t - 1);
+        owned_above -= owned[t - 1];
+        unsigned int g = (t - 1 - first) / bpg;
+        unsigned int meta_end = gd[g].bg_inode_table + table_blocks;
+        if (g + 1 < min_groups || free_below < owned_above) {
+            continue;
+        }
+        if (t - first - g * bpg == bpg || t >= meta_end + MKFS_MIN_TAIL_DATA_BLOCKS) {
+            return t;
+        }
+    }
+    return sb->s_blocks_count;
+}
+
+/*
+ * Return a free block before end, marked used, or 0 if there is none.
+ */
+static unsigned int take_free_block(unsigned char *disk, unsigned int *cursor, unsigned int end) {
+    struct ext2_super_block *sb = get_superblock_loc(disk);
+    for (; *cursor < end; (*cursor)++) {
+        unsigned int index = *cursor - sb->s_first_data_block;
+        unsigned char *bitmap = get_group_block_bitmap_loc(disk, (int) (index / sb->s_blocks_per_group));
+        index %= sb->s_blocks_per_group;
+        if (!bit_set(bitmap, index)) {
+            bitmap[index / 8] |= 1 << (index % 8);
+            return (*cursor)++;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Move the block a pointer holds before end if it is past it.
+ */
+static void relocate(unsigned char *disk, unsigned int *pointer, unsigned int *cursor, unsigned int end,
+                     unsigned int *moved) {
+    if (*pointer < end) {
+        return;
+    }
+    unsigned int block = take_free_block(disk, cursor, end);
+    memcpy(disk + (size_t) block * EXT2_BLOCK_SIZE, disk + (size_t) *pointer * EXT2_BLOCK_SIZE, EXT2_BLOCK_SIZE);
+    *pointer = block;
+    (*moved)++;
+}
+
+/*
+ * Shrink the disk to the fewest blocks it fits in: the blocks owned past
+ * the new end are moved into free blocks before it, the groups past it are
+ * dropped, and the super block, the group descriptors and their backups
+ * are rewritten. Return the new blocks count, or 0 with errno set.
+ */
+static unsigned int shrink_image(unsigned char *disk, unsigned int *moved) {
+    struct ext2_super_block *sb = get_superblock_loc(disk);
+    struct ext2_group_desc *gd = get_group_descriptor_loc(disk);
+    unsigned int first = sb->s_first_data_block, bpg = sb->s_blocks_per_group;
+    if (sb->s_feature_compat & EXT2_FEATURE_COMPAT_RESIZE_INODE) {
+        errno = ENOTSUP;
+        return 0;
+    }
+
+    // Blocks owned by inodes; only direct and single indirect blocks are supported
+    unsigned char *owned = calloc(sb->s_blocks_count, 1);
+    if (owned == NULL) {
+        return 0;
+    }
+    for (int i_num = EXT2_ROOT_INO; i_num <= sb->s_inodes_count; i_num++) {
+        if (!owns_blocks(disk, i_num)) {
+            continue;
+        }
+        struct ext2_inode *inode = get_inode(disk, i_num);
+        if (inode->i_block[SINGLE_INDIRECT + 1] || inode->i_block[SINGLE_INDIRECT + 2]) {
+            free(owned);
+            errno = ENOTSUP;
+            return 0;
+        }
+        for (int k = 0; k <= SINGLE_INDIRECT; k++) {
+            if (inode->i_block[k] < sb->s_blocks_count) {
+                owned[inode->i_block[k]] = inode->i_block[k] != 0;
+            }
+        }
+        if (inode->i_block[SINGLE_INDIRECT]) {
+            unsigned int *indirect = get_indirect_block_loc(disk, inode);
+            for (int j = 0; j < INDIRECT_ENTRIES; j++) {
+                if (indirect[j] && indirect[j] < sb->s_blocks_count) {
+                    owned[indirect[j]] = 1;
+                }
+            }
+        }
+    }
+    unsigned int end = shrink_target(disk, owned);
+    free(owned);
+    if (end == sb->s_blocks_count) {
+        return end;
+    }
+
+    // Move the owned blocks past the end, the indirect block before its entries
+    unsigned int cursor = first;
+    for (int i_num = EXT2_ROOT_INO; i_num <= sb->s_inodes_count; i_num++) {
+        if (!owns_blocks(disk, i_num)) {
+            continue;
+        }
+        struct ext2_inode *inode = get_inode(disk, i_num);
+        for (int k = 0; k <= SINGLE_INDIRECT; k++) {
+            if (inode->i_block[k]) {
+                relocate(disk, &inode->i_block[k], &cursor, end, moved);
+            }
+        }
+        if (inode->i_block[SINGLE_INDIRECT]) {
+            unsigned int *indirect = get_indirect_block_loc(disk, inode);
+            for (int j = 0; j < INDIRECT_ENTRIES; j++) {
+                if (indirect[j]) {
+                    relocate(disk, &indirect[j], &cursor, end, moved);
+                }
+            }
+        }
+    }
+
+    // Fewer groups may need fewer group descriptor blocks in each copy
+    int old_groups = get_groups_count(disk);
+    int groups = (int) ((end - first + bpg - 1) / bpg);
+    unsigned int old_gdt_blocks = (old_groups * sizeof(struct ext2_group_desc) + EXT2_BLOCK_SIZE - 1) / EXT2_BLOCK_SIZE;
+    unsigned int gdt_blocks = (groups * sizeof(struct ext2_group_desc) + EXT2_BLOCK_SIZE - 1) / EXT2_BLOCK_SIZE;
+    for (int g = 0; g < groups; g++) {
+        unsigned int start = first + g * bpg;
+        if (group_has_super(g) && gd[g].bg_block_bitmap == start + 1 + old_gdt_blocks) {
+            unsigned char *bitmap = get_group_block_bitmap_loc(disk, g);
+            for (unsigned int b = 1 + gdt_blocks; b < 1 + old_gdt_blocks; b++) {
+                bitmap[b / 8] &= ~(1 << (b % 8));
+            }
+        }
+    }
+    memset(&gd[groups], 0, (old_groups - groups) * sizeof(struct ext2_group_desc));
+
+    // The bits past the end of the last group are set, as mkfs leaves them
+    unsigned int last_count = end - first - (groups - 1) * bpg;
+    unsigned char *last_bitmap = get_group_block_bitmap_loc(disk, groups - 1);
+    for (unsigned int b = last_count; b < 8 * EXT2_BLOCK_SIZE; b++) {
+        last_bitmap[b / 8] |= 1 << (b % 8);
+    }
+
+    unsigned int free_blocks = 0, free_inodes = 0;
+    for (int g = 0; g < groups; g++) {
+        gd[g].bg_free_blocks_count = (unsigned short) count_zero_bits(get_group_block_bitmap_loc(disk, g),
+                                                                      g == groups - 1 ? last_count : bpg);
+        gd[g].bg_free_inodes_count = (unsigned short) count_zero_bits(get_group_inode_bitmap_loc(disk, g),
+                                                                      sb->s_inodes_per_group);
+        free_blocks += gd[g].bg_free_blocks_count;
+        free_inodes += gd[g].bg_free_inodes_count;
+    }
+    sb->s_blocks_count = end;
+    sb->s_inodes_count = groups * sb->s_inodes_per_group;
+    sb->s_free_blocks_count = free_blocks;
+    sb->s_free_inodes_count = free_inodes;
+    if (sb->s_r_blocks_count > free_blocks) {
+        sb->s_r_blocks_count = free_blocks;
+    }
+
+    // Backups of the super block and group descriptors in the groups kept
+    for (int g = 1; g < groups; g++) {
+        if (!group_has_super(g)) {
+            continue;
+        }
+        unsigned char *copy = disk + (size_t) (first + g * bpg) * EXT2_BLOCK_SIZE;
+        memcpy(copy, sb, sizeof(struct ext2_super_block));
+        ((struct ext2_super_block *) copy)->s_block_group_nr = (unsigned short) g;
+        memcpy(copy + EXT2_BLOCK_SIZE, gd, (size_t) gdt_blocks * EXT2_BLOCK_SIZE);
+    }
+    return end;
+}
+
+/*
+ * This program copies the disk into a sparse output file, only the runs of
+ * blocks in use according to the block bitmaps, with copy_file_range() so
+ * the kernel can share or clone the data. The free blocks (and the holes
+ * of a sparse source) stay holes. With -s the copy is also shrunk to the
+ * fewest blocks that hold it. A JSON line reports the copy.
+ */
+int main(int argc, char **argv) {
+    int shrink = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "s")) != -1) {
+        switch (opt) {
+            case 's': shrink = 1; break;
+            default:
+                printf(USAGE);
+                exit(1);
+        }
+    }
+    if (argc - optind != 2) {
+        printf(USAGE);
+        exit(1);
+    }
+    char *disk_name = argv[optind], *out_name = argv[optind + 1];
+
+    // Map disk image file into memory, for its bitmaps
+    unsigned char *disk = get_disk_loc(disk_name);
+    unsigned int blocks_count = get_superblock_loc(disk)->s_blocks_count;
+    double start = now_seconds();
+
+    struct stat in_st, out_st;
+    int in_fd = open(disk_name, O_RDONLY);
+    if (in_fd < 0 || fstat(in_fd, &in_st) < 0) {
+        perror(disk_name);
+        return errno;
+    }
+    if (stat(out_name, &out_st) == 0 && out_st.st_dev == in_st.st_dev && out_st.st_ino == in_st.st_ino) {
+        printf("ext2_export: %s :Output is the disk itself.\n", out_name);
+        return EINVAL;
+    }
+    int out_fd = open(out_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out_fd < 0 || ftruncate(out_fd, (off_t) blocks_count * EXT2_BLOCK_SIZE) < 0) {
+        perror(out_name);
+        return errno;
+    }
+
+    // Checksums of an earlier image at the output no longer apply
+    char *csum_path = malloc(strlen(out_name) + sizeof(CSUM_SUFFIX));
+    if (csum_path != NULL) {
+        sprintf(csum_path, "%s%s", out_name, CSUM_SUFFIX);
+        unlink(csum_path);
+        free(csum_path);
+    }
+
+    // One copy per run of blocks in use
+    struct export_report report = {0, 0, 0, 0, 0};
+    unsigned int b = 0;
+    while (b < blocks_count) {
+        if (!block_in_use(disk, b)) {
+            b++;
+            continue;
+        }
+        unsigned int run = b;
+        while (run < blocks_count && block_in_use(disk, run)) {
+            run++;
+        }
+        if (copy_run(in_fd, out_fd, (off_t) b * EXT2_BLOCK_SIZE, (off_t) run * EXT2_BLOCK_SIZE, &report) < 0) {
+            perror(out_name);
+            return errno;
+        }
+        report.runs++;
+        report.blocks += run - b;
+        b = run;
+    }
+    close(in_fd);
+    if (getenv("EXT2_SYNC") != NULL && fsync(out_fd) < 0) {
+        perror(out_name);
+        return errno;
+    }
+    close(out_fd);
+
+    unsigned int new_count = blocks_count;
+    if (shrink) {
+        struct ext2_fs *fs = ext2_open(out_name, 0);
+        if (fs == NULL) {
+            perror(out_name);
+            return errno;
+        }
+        new_count = shrink_image(fs->disk, &report.blocks_moved);
+        if (new_count == 0) {
+            int err = errno;
+            printf("ext2_export: %s :Cannot shrink: %s.\n", out_name, strerror(err));
+            return err;
+        }
+        if (getenv("EXT2_SYNC") != NULL) {
+            msync(fs->disk, fs->size, MS_SYNC);
+        }
+        ext2_close(fs);
+        if (truncate(out_name, (off_t) new_count * EXT2_BLOCK_SIZE) < 0) {
+            perror(out_name);
+            return errno;
+        }
+    }
+
+    stat(out_name, &out_st);
+    double seconds = now_seconds() - start;
+    printf("{\"blocks_in_use\":%lld,\"runs\":%lld,\"bytes_copied\":%lld,\"copy_file_range\":%s,"
+           "\"blocks_count\":%u,\"new_blocks_count\":%u,\"blocks_moved\":%u,\"allocated_bytes\":%lld,"
+           "\"seconds\":%.3f}\n",
+           report.blocks, report.runs, report.bytes_copied, report.fallback ? "false" : "true",
+           blocks_count, new_count, report.blocks_moved, (long long) out_st.st_blocks * 512, seconds);
+    return 0;
+}
@@ -4,116 +4,68 @@
 #include <errno.h>
 #include "ext2.h"
 #include "helper.h"
+#include "libext2.h"
 
-unsigned char *disk;
+#define SORT_BATCH 4096
 
-void print_entries(unsigned char *, struct ext2_inode *, char *);
-void print_one_block_entries(struct ext2_dir_entry_2 *, char *);
+/*
+ * Print the name of a directory entry, skipping . and .. unless all is set.
+ */
+static int print_entry(const struct ext2_dirent *entry, void *all) {
+    if (*(int *) all || (strcmp(entry->name, ".") != 0 && strcmp(entry->name, "..") != 0)) {
+        printf("%s\n", entry->name);
+    }
+    return 0;
+}
 
 /*
  * This program takes two command line arguments. The first is the name
  * of an ext2 formatted virtual disk. The second is an absolute path on
  * the ext2 formatted disk. The program should work like ls -1, printing
  * each directory entry on a separate line. If the flag "a" is specified
- * , program should also print the . and .. entries.
+ * , program should also print the . and .. entries. With "s" the entries
+ * are printed in name order; the directory is sorted SORT_BATCH entries
+ * at a time and merged, so memory stays bounded however large it is.
  */
 int main(int argc, char **argv) {
     // Check valid user input
-    if (argc != 3 && argc != 4) {
-        printf("Usage: ext2_ls <virtual_disk> <absolute_path> <-a>\n");
-        exit(1);
-    } else if (argc == 4 && strcmp(argv[3], "-a") != 0) {
-        printf("Usage: ext2_ls <virtual_disk> <absolute_path> <-a>\n");
+    int all = 0;
+    int sorted = 0;
+    for (int i = 3; i < argc; i++) {
+        if (strcmp(argv[i], "-a") == 0) {
+            all = 1;
+        } else if (strcmp(argv[i], "-s") == 0) {
+            sorted = 1;
+        } else {
+            argc = 0;
+        }
+    }
+    if (argc < 3 || argc > 5) {
+        printf("Usage: ext2_ls <virtual_disk> <absolute_path> [-a] [-s]\n");
         exit(1);
     }
 
     // Map disk image file into memory
-    disk = get_disk_loc(argv[1]);
-
-    // Get the inode of the given path
-    struct ext2_inode *path_inode = trace_path(argv[2], disk);
+    struct ext2_fs *fs = open_disk(argv[1]);
 
-    char type = '\0';
-    if (path_inode != NULL) { // the given path exists
-        // Check the type of inode
-        if (path_inode->i_mode & EXT2_S_IFREG || path_inode->i_mode & EXT2_S_IFLNK) { // File or link
-            type = 'f';
-        } else if (path_inode->i_mode & EXT2_S_IFDIR) { // Directory
-            type = 'd';
-        }
-
-        if (argc == 3) {
-            if (type == 'f') { // Only print file or link name
-                printf("%s\n", get_file_name(argv[2]));
-            } else if (type == 'd') { // Print all entries in the directory
-                print_entries(disk, path_inode, NULL);
-            }
-
-        } else { // "-a" case
-            if (type == 'f') { // Refrain from printing the . and ..
-                printf("%s\n", get_file_name(argv[2]));
-            } else if (type == 'd') { // Print all entries in the directory as well as . and ..
-                print_entries(disk, path_inode, argv[3]);
-            }
-        }
-
-    } else { // The given path does not exist
+    // Get the type of the given path
+    struct ext2_stat st;
+    if (ext2_stat(fs, argv[2], &st) < 0) { // The given path does not exist
         printf("exts_ls: No such file or directory.\n");
         return ENOENT;
     }
 
-    return 0;
-}
-
-
-/*
- * Print all the entries of a given directory.
- */
-void print_entries(unsigned char *disk, struct ext2_inode *directory, char *flag) {
-    // Print all the entries of a given directory in the direct blocks.
-    for (int i = 0; i < SINGLE_INDIRECT; i++) {
-        if (directory->i_block[i]) {
-            print_one_block_entries(get_dir_entry(disk, directory->i_block[i]), flag);
+    if ((st.mode & EXT2_S_IFMT) == EXT2_S_IFDIR) { // Print all entries in the directory
+        if (sorted) {
+            ext2_readdir_sorted(fs, argv[2], SORT_BATCH, print_entry, &all);
+        } else {
+            ext2_readdir(fs, argv[2], print_entry, &all);
         }
+    } else { // Only print file or link name
+        char *name = get_file_name(argv[2]);
+        printf("%s\n", name);
+        free(name);
     }
 
-    // Print all the entries of given directory in the indirect blocks.
-    if (directory->i_block[SINGLE_INDIRECT]) {
-        unsigned int *indirect = get_indirect_block_loc(disk, directory);
-
-        for (int j = 0; j < EXT2_BLOCK_SIZE / sizeof(unsigned int); j++) {
-            if (indirect[j]) {
-                print_one_block_entries(get_dir_entry(disk, indirect[j]), flag);
-            }
-        }
-    }
-}
-
-/*
- * Print the entries in one block
- */
-void print_one_block_entries(struct ext2_dir_entry_2 *dir, char *flag) {
-    int curr_pos = 0; // used to keep track of the dir entries in each block
-    while (curr_pos < EXT2_BLOCK_SIZE) {
-        char *entry_name = malloc(sizeof(char) * dir->name_len + 1);
-
-        for (int u = 0; u < dir->name_len; u++) {
-            entry_name[u] = dir->name[u];
-        }
-        entry_name[dir->name_len] = '\0';
-
-        if (flag == NULL) { // Refrain from printing the . and ..
-            if (strcmp(entry_name, ".") != 0 && strcmp(entry_name, "..") != 0) {
-                printf("%s\n", entry_name);
-            }
-        } else if (strcmp(flag, "-a") == 0) {
-            printf("%s\n", entry_name);
-        }
-
-        free(entry_name);
-
-        /* Moving to the next directory */
-        curr_pos = curr_pos + dir->rec_len;
-        dir = (void*) dir + dir->rec_len;
-    }
+    return 0;
 }
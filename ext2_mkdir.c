@@ -2,76 +2,48 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <memory.h>
+#include <string.h>
 #include "ext2.h"
 #include "helper.h"
-
-unsigned char *disk;
+#include "libext2.h"
 
 
 /*
  * This program works like mkdir, creating the final directory on the
- * specified path on the disk.
+ * specified path on the disk. With -p every missing directory on the path
+ * is created too, and an existing directory is not an error.
  */
 int main (int argc, char **argv) {
 
     // Check valid user inputs
-    if (argc != 3) {
-        printf("Usage: ext2_mkdir <virtual_disk> <absolute_path>\n");
+    int parents = argc == 4 && strcmp(argv[3], "-p") == 0;
+    if (argc != 3 && !parents) {
+        printf("Usage: ext2_mkdir <virtual_disk> <absolute_path> [-p]\n");
         exit(1);
     }
 
-    // Map disk image file into memory， read superblock and group descriptor
-    unsigned char *disk = get_disk_loc(argv[1]);
-    struct ext2_group_desc *gd = get_group_descriptor_loc(disk);
-    struct ext2_super_block *sb = get_superblock_loc(disk);
-    struct ext2_inode *i_table = get_inode_table_loc(disk);
+    // Map disk image file into memory
+    struct ext2_fs *fs = open_disk(argv[1]);
 
-    // Check valid target absolute_path
-    struct ext2_inode *target_inode = trace_path(argv[2], disk);
-    if (target_inode != NULL) { // Target path exists
+    int ret = parents ? ext2_mkdir_p(fs, argv[2]) : ext2_mkdir(fs, argv[2]);
+    if (ret == -ENOTDIR) { // A part of the path is a file
+        printf("ext2_mkdir: %s :Not a directory.\n", argv[2]);
+        return ENOTDIR;
+    } else if (ret == -EEXIST) { // Target path exists
         printf("ext2_mkdir: %s :Directory exists.\n", argv[2]);
         return EEXIST;
-    }
-    char *parent_path = get_dir_parent_path(argv[2]);
-    struct ext2_inode *parent_inode = trace_path(parent_path, disk);
-    if (parent_inode == NULL) { //parent directory not exist
-        printf("ext2_mkdir: %s :Invalid path.\n", argv[2]);
+    } else if (ret == -ENAMETOOLONG) { // target name too long
+        char *name = get_file_name(argv[2]);
+        printf("ext2_mkdir: Target directory with name too long: %s\n", name);
+        free(name);
         return ENOENT;
-    }
-
-    if (strlen(get_file_name(argv[2])) > EXT2_NAME_LEN) { // target name too long
-        printf("ext2_mkdir: Target directory with name too long: %s\n", get_file_name(argv[2]));
-        return ENOENT;
-    }
-
-    // Check if there is enough inode (require 1) and free blocks
-    if (sb->s_free_inodes_count <= 0 || sb->s_free_blocks_count <= 0) {
+    } else if (ret == -ENOSPC) {
         printf("ext2_mkdir: File system does not have enough free inodes or blocks.\n");
         return ENOSPC;
+    } else if (ret < 0) { // parent directory not exist
+        printf("ext2_mkdir: %s :Invalid path.\n", argv[2]);
+        return ENOENT;
     }
 
-    int i_num = init_inode(disk, EXT2_BLOCK_SIZE, 'd');
-    struct ext2_inode *tar_inode = &(i_table[i_num - 1]);
-
-    // Create a new entry in directory
-    if (add_new_entry(disk, parent_inode, (unsigned int)i_num, get_file_name(argv[2]), 'd') == -1) {
-        printf("ext2_mkdir: Fail to add new directory entry in directory: %s\n", argv[3]);
-        exit(0);
-    }
-
-    // Add . and .. into block
-    if (add_new_entry(disk, tar_inode, (unsigned int)i_num, ".", 'd') == -1) {
-        printf("ext2_mkdir: Fail to add new directory entry in directory: %s\n", argv[3]);
-        exit(0);
-    }
-
-    if (add_new_entry(disk, tar_inode, (unsigned int)get_inode_num(disk, parent_inode), "..", 'd') == -1) {
-        printf("ext2_mkdir: Fail to add new directory entry in directory: %s\n", argv[3]);
-        exit(0);
-    }
-
-    //update directories count of blocks group descriptor
-    gd->bg_used_dirs_count ++;
-    return 0;
+    return sync_disk(fs->disk);
 }
-
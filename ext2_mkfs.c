@@ -0,0 +1,88 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "ext2.h"
+#include "mkfs.h"
+
+#define USAGE "Usage: ext2_mkfs [-b block_size] [-g blocks_per_group] [-i inodes_per_group] " \
+              "[-N inodes] [-L label] [-s] <virtual_disk> <blocks|size{K,M,G,T}>\n"
+
+/*
+ * Parse the size argument: a plain number is a blocks count, a number with
+ * a K, M, G or T suffix is a size in bytes. Return the blocks count or 0.
+ */
+static unsigned long long parse_size(char *arg, unsigned int block_size) {
+    char *end;
+    unsigned long long value = strtoull(arg, &end, 10);
+    int shift = 0;
+
+    switch (*end) {
+        case '\0': return value;
+        case 'K': case 'k': shift = 10; break;
+        case 'M': case 'm': shift = 20; break;
+        case 'G': case 'g': shift = 30; break;
+        case 'T': case 't': shift = 40; break;
+        default: return 0;
+    }
+    if (end[1] != '\0') {
+        return 0;
+    }
+    return (value << shift) / block_size;
+}
+
+/*
+ * This program works like mke2fs: it creates a new ext2 file system of the
+ * given size in the virtual disk file, with a root directory and a
+ * lost+found directory. Only metadata is written, so even huge images are
+ * formatted in a fraction of a second.
+ */
+int main(int argc, char **argv) {
+    struct mkfs_params params;
+    memset(&params, 0, sizeof(params));
+    params.block_size = EXT2_BLOCK_SIZE;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "b:g:i:N:L:s")) != -1) {
+        switch (opt) {
+            case 'b': params.block_size = (unsigned int) atoi(optarg); break;
+            case 'g': params.blocks_per_group = (unsigned int) atoi(optarg); break;
+            case 'i': params.inodes_per_group = (unsigned int) atoi(optarg); break;
+            case 'N': params.inodes_count = (unsigned int) atoi(optarg); break;
+            case 'L': params.label = optarg; break;
+            case 's': params.sparse = 1; break;
+            default:
+                printf(USAGE);
+                exit(1);
+        }
+    }
+    if (argc - optind != 2) {
+        printf(USAGE);
+        exit(1);
+    }
+
+    unsigned long long blocks = parse_size(argv[optind + 1], params.block_size);
+    if (blocks == 0 || blocks > 0xFFFFFFFFULL) {
+        printf("ext2_mkfs: %s :Invalid size.\n", argv[optind + 1]);
+        return EINVAL;
+    }
+    params.blocks_count = (unsigned int) blocks;
+
+    if (format_image(argv[optind], &params) < 0) {
+        int err = errno;
+        if (err == EINVAL) {
+            printf("ext2_mkfs: %s :Invalid geometry for %llu blocks of %u bytes.\n",
+                   argv[optind], blocks, params.block_size);
+        } else {
+            perror(argv[optind]);
+        }
+        return err;
+    }
+
+    if (params.block_size != EXT2_BLOCK_SIZE) {
+        printf("ext2_mkfs: Note that the other ext2 tools only handle %d byte blocks.\n",
+               EXT2_BLOCK_SIZE);
+    }
+    return 0;
+}
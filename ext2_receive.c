@@ -0,0 +1,113 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "ext2.h"
+#include "helper.h"
+#include "libext2.h"
+#include "stream.h"
+#include "csum.h"
+
+#define USAGE "Usage: ext2_receive <virtual_disk> < stream\n"
+
+/*
+ * Return the fingerprint of the disk as it is now, or exit if memory runs out.
+ */
+static unsigned long long fingerprint(unsigned char *disk) {
+    unsigned int blocks_count = get_superblock_loc(disk)->s_blocks_count;
+    unsigned long long *hashes = malloc(sizeof(unsigned long long) * blocks_count);
+    if (hashes == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    image_manifest(disk, hashes);
+    unsigned long long print = manifest_fingerprint(hashes, blocks_count);
+    free(hashes);
+    return print;
+}
+
+/*
+ * This program applies a stream of ext2_send read from standard input to
+ * the disk, which must be a copy of the base of the stream. The blocks are
+ * written into a session (see "Sessions"), and only committed once the
+ * whole stream has been read and the result matches the image sent, so a
+ * short or damaged stream leaves the disk as it was.
+ */
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        printf(USAGE);
+        exit(1);
+    }
+
+    // Map disk image file into memory, privately until the commit
+    struct ext2_fs *fs = ext2_open(argv[1], getenv("EXT2_DRY_RUN") != NULL ? EXT2_OPEN_DRY_RUN
+                                                                             : EXT2_OPEN_SESSION);
+    if (fs == NULL) {
+        perror(argv[1]);
+        exit(EXIT_FAILURE);
+    }
+    unsigned char *disk = fs->disk;
+    struct ext2_super_block *sb = get_superblock_loc(disk);
+    unsigned int blocks_count = sb->s_blocks_count;
+    double start = now_seconds();
+
+    struct stream_io io;
+    if (stream_open(&io, STDIN_FILENO) < 0) {
+        perror("malloc");
+        exit(1);
+    }
+    struct stream_header header;
+    if (stream_read(&io, &header, sizeof(header)) < 0
+        || header.magic != STREAM_MAGIC || header.version != STREAM_VERSION) {
+        printf("ext2_receive: Not a stream of ext2_send.\n");
+        return EINVAL;
+    }
+    if (header.blocks_count != blocks_count || header.blocks_per_group != sb->s_blocks_per_group
+        || header.inodes_count != sb->s_inodes_count) {
+        printf("ext2_receive: %s :Not the geometry of the stream.\n", argv[1]);
+        return EINVAL;
+    }
+    if (!(header.flags & STREAM_FULL) && fingerprint(disk) != header.base_print) {
+        printf("ext2_receive: %s :Not the base of the stream.\n", argv[1]);
+        return EINVAL;
+    }
+
+    long long received = 0;
+    struct stream_extent extent;
+    while (1) {
+        if (stream_read(&io, &extent, sizeof(extent)) < 0) {
+            printf("ext2_receive: Stream ends early.\n");
+            return EIO;
+        }
+        if (extent.count == 0) {
+            break;
+        }
+        if (extent.start >= blocks_count || extent.count > blocks_count - extent.start) {
+            printf("ext2_receive: Stream has blocks past the end of the disk.\n");
+            return EIO;
+        }
+        if (stream_read(&io, disk + (size_t) extent.start * EXT2_BLOCK_SIZE,
+                        (size_t) extent.count * EXT2_BLOCK_SIZE) < 0) {
+            printf("ext2_receive: Stream ends early.\n");
+            return EIO;
+        }
+        received += extent.count;
+    }
+    stream_close(&io);
+
+    if (fingerprint(disk) != header.new_print) {
+        printf("ext2_receive: %s :Result does not match the image sent.\n", argv[1]);
+        return EIO;
+    }
+    // The stream rewrote the image as a whole, so every checksum is redone
+    if (refresh_all_checksums(fs) < 0 || ext2_sync(fs) < 0) {
+        perror(argv[1]);
+        return EIO;
+    }
+
+    double seconds = now_seconds() - start;
+    printf("{\"blocks_received\":%lld,\"full\":%s,\"seconds\":%.3f}\n", received,
+           header.flags & STREAM_FULL ? "true" : "false", seconds);
+    return 0;
+}
@@ -0,0 +1,416 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include "ext2.h"
+#include "helper.h"
+#include "libext2.h"
+#include "mkfs.h"
+#include "record.h"
+
+#define USAGE "Usage: ext2_replay [-r ops_per_sec] [-b blocks] [-i inodes] [-o image] <record_file>\n"
+
+/* Batch of the sorted listings, as ext2_ls -s reads them */
+#define SORT_BATCH 4096
+
+/*
+ * The operations ext2_replay knows how to run. Lines of other tools are
+ * skipped.
+ */
+enum replay_kind {
+    OP_MKDIR,
+    OP_CP,
+    OP_LN,
+    OP_RM,
+    OP_RM_BONUS,
+    OP_LS,
+    OP_KINDS
+};
+
+static const char *op_tools[OP_KINDS] = {
+    "ext2_mkdir", "ext2_cp", "ext2_ln", "ext2_rm", "ext2_rm_bonus", "ext2_ls"
+};
+
+/*
+ * One recorded operation. args are the tool's arguments after the image.
+ */
+struct replay_op {
+    int kind;
+    long long start;          /* Wall clock start recorded */
+    int line;                 /* In the record file, orders equal starts */
+    int status;               /* Exit status recorded */
+    long long duration;       /* Of the recorded process */
+    long long file_size;      /* Of the @file argument, -1 if none */
+    char *file_name;
+    int argc;
+    char **args;
+    long long latency;        /* Measured by the replay */
+    int failed;
+};
+
+struct replay_config {
+    char *image_path;   /* Scratch image, formatted for the replay */
+    int blocks;
+    int inodes;         /* 0 for the mkfs default */
+    double rate;        /* Operations per second, 0 to run them back to back */
+};
+
+static struct replay_config config = {"/tmp/ext2_replay.img", 65536, 0, 0};
+
+/* Content of every file ext2_cp writes: random, so that no block is a hole */
+static char *file_data = NULL;
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int compare_ns(const void *a, const void *b) {
+    long long x = *(const long long *) a;
+    long long y = *(const long long *) b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Order operations by the time they started. Processes sharing a record
+ * file append their lines when they exit, so the file is in exit order.
+ */
+static int compare_start(const void *a, const void *b) {
+    const struct replay_op *x = a, *y = b;
+    if (x->start != y->start) {
+        return (x->start > y->start) - (x->start < y->start);
+    }
+    return (x->line > y->line) - (x->line < y->line);
+}
+
+/*
+ * Undo the escapes of a recorded argument in place.
+ */
+static void unescape(char *text) {
+    char *out = text;
+    for (char *in = text; *in != '\0'; in++) {
+        if (*in == '\\' && in[1] != '\0') {
+            in++;
+            *out++ = *in == 't' ? '\t' : *in == 'n' ? '\n' : *in;
+        } else {
+            *out++ = *in;
+        }
+    }
+    *out = '\0';
+}
+
+/*
+ * Parse one line of the record file into op. Return 1 if it is an
+ * operation to replay, 0 if it is skipped.
+ */
+static int parse_op(char *line, struct replay_op *op) {
+    line[strcspn(line, "\n")] = '\0';
+    int count = 1;
+    for (char *c = line; *c != '\0'; c++) {
+        count += *c == '\t';
+    }
+    char **fields = malloc(sizeof(char *) * count);
+    if (fields == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    count = 0;
+    char *field;
+    while ((field = strsep(&line, "\t")) != NULL) {
+        fields[count++] = field;
+    }
+    // start, duration, status, tool, then the image first
+    op->kind = -1;
+    if (count >= 6 && strcmp(fields[4], "@image") == 0) {
+        for (int k = 0; k < OP_KINDS; k++) {
+            if (strcmp(fields[3], op_tools[k]) == 0) {
+                op->kind = k;
+            }
+        }
+    }
+    if (op->kind < 0) {
+        free(fields);
+        return 0;
+    }
+
+    op->start = atoll(fields[0]);
+    op->duration = atoll(fields[1]);
+    op->status = atoi(fields[2]);
+    op->file_size = -1;
+    op->file_name = NULL;
+    op->argc = count - 5;
+    op->args = malloc(sizeof(char *) * op->argc);
+    if (op->args == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    for (int i = 0; i < op->argc; i++) {
+        char *arg = fields[5 + i];
+        if (strncmp(arg, "@file:", 6) == 0) {
+            char *name = strchr(arg + 6, ':');
+            op->file_size = atoll(arg + 6);
+            arg = name != NULL ? name + 1 : arg + strlen(arg);
+            op->file_name = strdup(arg);
+        }
+        unescape(arg);
+        op->args[i] = strdup(arg);
+        if (op->args[i] == NULL || (op->file_size >= 0 && op->file_name == NULL)) {
+            perror("strdup");
+            exit(1);
+        }
+    }
+    free(fields);
+    return 1;
+}
+
+static int has_flag(struct replay_op *op, const char *flag) {
+    for (int i = 1; i < op->argc; i++) {
+        if (strcmp(op->args[i], flag) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int count_entry(const struct ext2_dirent *entry, void *arg) {
+    (*(long long *) arg)++;
+    return 0;
+}
+
+/*
+ * Run one operation the way its tool does, through the library. Return 0,
+ * or a negative errno.
+ */
+static int run_op(struct ext2_fs *fs, struct replay_op *op) {
+    char **args = op->args;
+    int ret = 0;
+    switch (op->kind) {
+        case OP_MKDIR:
+            ret = has_flag(op, "-p") ? ext2_mkdir_p(fs, args[0]) : ext2_mkdir(fs, args[0]);
+            break;
+        case OP_CP: {
+            if (op->argc < 2 || op->file_size < 0 || op->file_size > EXT2_MAX_FILE_SIZE) {
+                return -EINVAL;
+            }
+            // Copying into a directory keeps the name of the source file
+            char *path = args[1];
+            struct ext2_stat target;
+            if (ext2_stat(fs, path, &target) == 0 && (target.mode & EXT2_S_IFMT) == EXT2_S_IFDIR) {
+                path = malloc(strlen(args[1]) + strlen(op->file_name) + 2);
+                if (path == NULL) {
+                    return -ENOMEM;
+                }
+                sprintf(path, "%s%s%s", args[1], args[1][strlen(args[1]) - 1] == '/' ? "" : "/", op->file_name);
+            }
+            int update = has_flag(op, "-u");
+            int existed = ext2_lookup(fs, path) >= 0;
+            int i_num = ext2_file_open(fs, path, EXT2_O_CREAT | (update ? 0 : EXT2_O_EXCL));
+            ret = i_num;
+            if (i_num >= 0 && ext2_file_write(fs, i_num, file_data, op->file_size, 0) < 0) {
+                if (!existed) {
+                    ext2_unlink(fs, path);
+                }
+                ret = -ENOSPC;
+            } else if (i_num >= 0 && existed) {
+                ret = ext2_file_truncate(fs, i_num, op->file_size);
+            }
+            if (path != args[1]) {
+                free(path);
+            }
+            break;
+        }
+        case OP_LN: {
+            if (op->argc < 2) {
+                return -EINVAL;
+            }
+            // The source must exist and not be a directory, even for -s
+            struct ext2_stat source;
+            ret = ext2_stat(fs, args[0], &source);
+            if (ret == 0 && (source.mode & EXT2_S_IFMT) == EXT2_S_IFDIR) {
+                ret = -EISDIR;
+            } else if (ret == 0 && has_flag(op, "-s")) {
+                ret = ext2_symlink(fs, args[0], args[1]);
+            } else if (ret == 0 && (source.mode & EXT2_S_IFMT) == EXT2_S_IFLNK) {
+                // A hard link to a symbolic link links the file it names
+                char target[EXT2_BLOCK_SIZE];
+                ret = ext2_readlink(fs, args[0], target, sizeof(target)) >= (int) sizeof(target)
+                      ? -ENOENT : ext2_link(fs, target, args[1]);
+            } else if (ret == 0) {
+                ret = ext2_link(fs, args[0], args[1]);
+            }
+            break;
+        }
+        case OP_RM:
+            ret = ext2_unlink(fs, args[0]);
+            break;
+        case OP_RM_BONUS:
+            ret = ext2_unlink(fs, args[0]);
+            if (ret == -EISDIR) {
+                ret = ext2_rmtree(fs, args[0]);
+            }
+            break;
+        case OP_LS: {
+            struct ext2_stat st;
+            long long entries = 0;
+            ret = ext2_stat(fs, args[0], &st);
+            if (ret == 0 && (st.mode & EXT2_S_IFMT) == EXT2_S_IFDIR) {
+                ret = has_flag(op, "-s") ? ext2_readdir_sorted(fs, args[0], SORT_BATCH, count_entry, &entries)
+                                         : ext2_readdir(fs, args[0], count_entry, &entries);
+            }
+            return ret < 0 ? ret : 0;
+        }
+    }
+    // The tools sync once their operation is done
+    if (ret >= 0 && ext2_sync(fs) < 0) {
+        return -EIO;
+    }
+    return ret < 0 ? ret : 0;
+}
+
+/*
+ * Print one JSON line of the latency percentiles of the given operations,
+ * all of them if kind is -1.
+ */
+static void report(const char *name, struct replay_op *ops, int n, int kind) {
+    long long *samples = malloc(sizeof(long long) * (n + 1));
+    long long *recorded = malloc(sizeof(long long) * (n + 1));
+    if (samples == NULL || recorded == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    int count = 0, failed = 0;
+    for (int i = 0; i < n; i++) {
+        if (kind < 0 || ops[i].kind == kind) {
+            recorded[count] = ops[i].duration;
+            samples[count++] = ops[i].latency;
+            failed += ops[i].failed;
+        }
+    }
+    if (count > 0) {
+        qsort(samples, count, sizeof(long long), compare_ns);
+        qsort(recorded, count, sizeof(long long), compare_ns);
+        printf("{\"op\":\"%s\",\"ops\":%d,\"failed\":%d,\"p50_ns\":%lld,\"p90_ns\":%lld,\"p99_ns\":%lld,"
+               "\"max_ns\":%lld,\"recorded_p50_ns\":%lld}\n",
+               name, count, failed, samples[count / 2], samples[(count * 90) / 100],
+               samples[(count * 99) / 100], samples[count - 1], recorded[count / 2]);
+    }
+    free(samples);
+    free(recorded);
+}
+
+/*
+ * This program replays the operations recorded with EXT2_RECORD (see
+ * record.h) against a freshly formatted image, through the library, and
+ * reports the throughput and the latency percentiles of each kind of
+ * operation as JSON lines. The operations run in the order they started,
+ * back to back or with -r at a fixed rate: then an operation's latency
+ * counts from the time it was due, so a slow operation also shows in the
+ * ones queued behind it.
+ */
+int main(int argc, char **argv) {
+    recording_enabled = 0; // Replays are not recorded themselves
+
+    int opt;
+    while ((opt = getopt(argc, argv, "r:b:i:o:")) != -1) {
+        switch (opt) {
+            case 'r': config.rate = atof(optarg); break;
+            case 'b': config.blocks = atoi(optarg); break;
+            case 'i': config.inodes = atoi(optarg); break;
+            case 'o': config.image_path = optarg; break;
+            default:
+                printf(USAGE);
+                exit(1);
+        }
+    }
+    if (argc - optind != 1 || config.rate < 0 || config.blocks < 512 || config.inodes < 0) {
+        printf(USAGE);
+        exit(1);
+    }
+
+    // Parse the whole record first, so that parsing is not timed
+    FILE *in = fopen(argv[optind], "r");
+    if (in == NULL) {
+        perror(argv[optind]);
+        return errno;
+    }
+    int n = 0, cap = 1024, skipped = 0;
+    struct replay_op *ops = malloc(sizeof(struct replay_op) * cap);
+    char *line = NULL;
+    size_t line_cap = 0;
+    while (ops != NULL && getline(&line, &line_cap, in) > 0) {
+        if (n == cap) {
+            cap *= 2;
+            ops = realloc(ops, sizeof(struct replay_op) * cap);
+            if (ops == NULL) {
+                break;
+            }
+        }
+        if (parse_op(line, &ops[n])) {
+            ops[n].line = n;
+            n++;
+        } else {
+            skipped++;
+        }
+    }
+    free(line);
+    fclose(in);
+    if (ops != NULL) {
+        qsort(ops, n, sizeof(struct replay_op), compare_start);
+    }
+    file_data = malloc(EXT2_MAX_FILE_SIZE);
+    if (ops == NULL || file_data == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    srand(1);
+    for (long i = 0; i < EXT2_MAX_FILE_SIZE; i++) {
+        file_data[i] = (char) (rand() | 1);
+    }
+
+    struct mkfs_params params;
+    memset(&params, 0, sizeof(params));
+    params.blocks_count = (unsigned int) config.blocks;
+    params.inodes_count = (unsigned int) config.inodes;
+    params.sparse = 1;
+    if (format_image(config.image_path, &params) < 0) {
+        perror(config.image_path);
+        exit(1);
+    }
+    struct ext2_fs *fs = ext2_open(config.image_path, 0);
+    if (fs == NULL) {
+        perror(config.image_path);
+        exit(1);
+    }
+
+    int mismatches = 0;
+    long long begin = now_ns();
+    for (int i = 0; i < n; i++) {
+        long long start = now_ns();
+        if (config.rate > 0) {
+            long long due = begin + (long long) (i * 1e9 / config.rate);
+            if (due > start) {
+                struct timespec ts = {due / 1000000000LL, due % 1000000000LL};
+                clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+            }
+            start = due;
+        }
+        int ret = run_op(fs, &ops[i]);
+        ops[i].latency = now_ns() - start;
+        ops[i].failed = ret < 0;
+        mismatches += (ret < 0) != (ops[i].status != 0);
+    }
+    double seconds = (now_ns() - begin) / 1e9;
+    ext2_close(fs);
+
+    for (int k = 0; k < OP_KINDS; k++) {
+        report(op_tools[k], ops, n, k);
+    }
+    report("all", ops, n, -1);
+    printf("{\"record\":\"%s\",\"ops\":%d,\"skipped\":%d,\"status_mismatches\":%d,\"target_rate\":%.1f,"
+           "\"seconds\":%.3f,\"ops_per_sec\":%.1f}\n",
+           argv[optind], n, skipped, mismatches, config.rate, seconds, seconds > 0 ? n / seconds : 0);
+    return 0;
+}
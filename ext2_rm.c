@@ -3,8 +3,7 @@
 #include <errno.h>
 #include "ext2.h"
 #include "helper.h"
-
-unsigned char *disk;
+#include "libext2.h"
 
 /*
  * This program takes two command line arguments. The first is the
@@ -21,26 +20,17 @@ int main(int argc, char **argv) {
     }
 
     // Map disk image file into memory
-    disk = get_disk_loc(argv[1]);
-
-    // Get the inode of the given path
-    struct ext2_inode *path_inode = trace_path(argv[2], disk);
-
-    // The file/lin do not exist
-    if (path_inode == NULL) {
-        printf("ext2_rm: The path %s do not exist.\n", argv[2]);
-        return ENOENT;
-    }
+    struct ext2_fs *fs = open_disk(argv[1]);
 
-    // Is a directory
-    if (path_inode->i_mode & EXT2_S_IFDIR) {
+    // Remove the file or link in their parent directory
+    int ret = ext2_unlink(fs, argv[2]);
+    if (ret == -EISDIR) {
         printf("ext2_rm: The path %s is a directory.\n", argv[2]);
         return EISDIR;
+    } else if (ret < 0) { // The file/link do not exist
+        printf("ext2_rm: The path %s do not exist.\n", argv[2]);
+        return ENOENT;
     }
 
-    // Remove the file or link in their parent directory
-    remove_file_or_link(disk, argv[2]);
-
-    return 0;
+    return sync_disk(fs->disk);
 }
-
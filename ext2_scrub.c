@@ -0,0 +1,165 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include "ext2.h"
+#include "helper.h"
+#include "csum.h"
+
+#define USAGE "Usage: ext2_scrub [-t threads] [-i] <virtual_disk>\n"
+
+struct scrub_job {
+    unsigned char *disk;
+    unsigned int *blocks;    /* Checksummed blocks, in order */
+    unsigned int *crcs;      /* Stored checksums, by block number */
+    long long from;
+    long long to;
+    unsigned int *bad;       /* Shared list of the blocks that do not match */
+    long long *bad_count;
+};
+
+/*
+ * Verify a range of the checksummed blocks against the stored checksums.
+ */
+static void *verify_range(void *arg) {
+    struct scrub_job *job = arg;
+    for (long long i = job->from; i < job->to; i++) {
+        unsigned int block = job->blocks[i];
+        if (block_crc(job->disk, block) != job->crcs[block]) {
+            long long slot = __atomic_fetch_add(job->bad_count, 1, __ATOMIC_RELAXED);
+            job->bad[slot] = block;
+        }
+    }
+    return NULL;
+}
+
+static int compare_block(const void *a, const void *b) {
+    unsigned int x = *(const unsigned int *) a;
+    unsigned int y = *(const unsigned int *) b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Print what a corrupted block holds, as the image describes it now.
+ */
+static void print_bad_block(unsigned int block, unsigned char kind, unsigned int owner) {
+    switch (kind) {
+        case META_SUPER: printf("block %u: super block\n", block); break;
+        case META_GROUP_DESC: printf("block %u: group descriptors\n", block); break;
+        case META_BLOCK_BITMAP: printf("block %u: block bitmap of group %u\n", block, owner); break;
+        case META_INODE_BITMAP: printf("block %u: inode bitmap of group %u\n", block, owner); break;
+        case META_INODE_TABLE: printf("block %u: inode table of group %u\n", block, owner); break;
+        case META_DIR: printf("block %u: directory block of inode %u\n", block, owner); break;
+        case META_DIR_INDIRECT: printf("block %u: indirect block of directory inode %u\n", block, owner); break;
+        default: printf("block %u: metadata block no longer referenced\n", block); break;
+    }
+}
+
+/*
+ * This program verifies the CRC32C checksums of the metadata blocks of the
+ * disk (see csum.h) with several threads and reports every block whose
+ * content no longer matches. With -i it creates the checksums instead;
+ * from then on every tool keeps them up to date.
+ */
+int main(int argc, char **argv) {
+    int threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    int init = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "t:i")) != -1) {
+        switch (opt) {
+            case 't': threads = atoi(optarg); break;
+            case 'i': init = 1; break;
+            default:
+                printf(USAGE);
+                exit(1);
+        }
+    }
+    if (argc - optind != 1 || threads < 1) {
+        printf(USAGE);
+        exit(1);
+    }
+
+    // Map disk image file into memory, with its checksums if it has them
+    struct ext2_fs *fs = open_disk(argv[optind]);
+    unsigned char *disk = fs->disk;
+    unsigned int blocks_count = get_superblock_loc(disk)->s_blocks_count;
+
+    if (init) {
+        if (create_checksums(fs, argv[optind]) < 0) {
+            perror(argv[optind]);
+            return errno;
+        }
+        long long tracked = 0;
+        for (unsigned int b = 0; b < blocks_count; b++) {
+            tracked += (csum_bitmap(fs)[b / 8] >> (b % 8)) & 1;
+        }
+        printf("ext2_scrub: %s: %lld metadata blocks checksummed.\n", argv[optind], tracked);
+        return 0;
+    }
+    if (fs->csum == NULL) {
+        printf("ext2_scrub: %s :No checksums, create them with -i.\n", argv[optind]);
+        return ENOENT;
+    }
+    double start = now_seconds();
+
+    // The blocks that had a checksum stored, whatever they are now
+    unsigned char *bitmap = csum_bitmap(fs);
+    unsigned int *blocks = malloc(sizeof(unsigned int) * blocks_count);
+    unsigned int *bad = malloc(sizeof(unsigned int) * blocks_count);
+    if (blocks == NULL || bad == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    long long count = 0;
+    for (unsigned int b = 0; b < blocks_count; b++) {
+        if ((bitmap[b / 8] >> (b % 8)) & 1) {
+            blocks[count++] = b;
+        }
+    }
+
+    // Verify in parallel, each thread a contiguous range of the blocks
+    long long bad_count = 0;
+    pthread_t tids[threads];
+    struct scrub_job jobs[threads];
+    for (int t = 0; t < threads; t++) {
+        jobs[t].disk = disk;
+        jobs[t].blocks = blocks;
+        jobs[t].crcs = csum_array(fs);
+        jobs[t].from = count * t / threads;
+        jobs[t].to = count * (t + 1) / threads;
+        jobs[t].bad = bad;
+        jobs[t].bad_count = &bad_count;
+        pthread_create(&tids[t], NULL, verify_range, &jobs[t]);
+    }
+    for (int t = 0; t < threads; t++) {
+        pthread_join(tids[t], NULL);
+    }
+    double seconds = now_seconds() - start;
+
+    // Name the corrupted blocks after what the image says they hold
+    if (bad_count > 0) {
+        unsigned char *kinds = calloc(blocks_count, 1);
+        unsigned int *owners = malloc(sizeof(unsigned int) * blocks_count);
+        if (kinds == NULL || owners == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        map_metadata(disk, kinds, owners);
+        qsort(bad, bad_count, sizeof(unsigned int), compare_block);
+        for (long long i = 0; i < bad_count; i++) {
+            print_bad_block(bad[i], kinds[bad[i]], owners[bad[i]]);
+        }
+        free(kinds);
+        free(owners);
+    }
+
+    printf("{\"blocks_checked\":%lld,\"corrupted\":%lld,\"threads\":%d,\"seconds\":%.3f,\"mb_per_sec\":%.1f}\n",
+           count, bad_count, threads, seconds,
+           seconds > 0 ? count * (double) EXT2_BLOCK_SIZE / (1 << 20) / seconds : 0);
+    free(blocks);
+    free(bad);
+    return bad_count > 0 ? EIO : 0;
+}
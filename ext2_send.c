@@ -0,0 +1,143 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "ext2.h"
+#include "helper.h"
+#include "stream.h"
+
+#define USAGE "Usage: ext2_send [-b base_disk | -m manifest] [-w manifest] <virtual_disk> > stream\n"
+
+/*
+ * This program writes to standard output a stream of the blocks in use in
+ * the disk that differ from a base: another image given with -b, or the
+ * manifest of one given with -m (see stream.h). Without a base every block
+ * in use is sent. -w saves the manifest of the disk, the base of the next
+ * incremental stream. ext2_receive applies the stream to a copy of the
+ * base. A JSON line on standard error gives what was sent.
+ */
+int main(int argc, char **argv) {
+    char *base_name = NULL, *manifest_in = NULL, *manifest_out = NULL;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "b:m:w:")) != -1) {
+        switch (opt) {
+            case 'b': base_name = optarg; break;
+            case 'm': manifest_in = optarg; break;
+            case 'w': manifest_out = optarg; break;
+            default:
+                printf(USAGE);
+                exit(1);
+        }
+    }
+    if (argc - optind != 1 || (base_name != NULL && manifest_in != NULL)) {
+        printf(USAGE);
+        exit(1);
+    }
+    if (isatty(STDOUT_FILENO)) {
+        fprintf(stderr, "ext2_send: Not writing a stream to a terminal.\n");
+        return EINVAL;
+    }
+
+    // Map disk image file into memory
+    unsigned char *disk = get_disk_loc(argv[optind]);
+    struct ext2_super_block *sb = get_superblock_loc(disk);
+    unsigned int blocks_count = sb->s_blocks_count;
+    double start = now_seconds();
+
+    unsigned long long *hashes = malloc(sizeof(unsigned long long) * blocks_count);
+    if (hashes == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    image_manifest(disk, hashes);
+
+    // The base, as a manifest, and as an image when there is one to compare with
+    unsigned char *base = NULL;
+    unsigned long long *base_hashes = NULL;
+    if (base_name != NULL) {
+        base = get_disk_loc(base_name);
+        struct ext2_super_block *base_sb = get_superblock_loc(base);
+        if (base_sb->s_blocks_count != blocks_count || base_sb->s_blocks_per_group != sb->s_blocks_per_group
+            || base_sb->s_inodes_count != sb->s_inodes_count) {
+            fprintf(stderr, "ext2_send: %s :Not the same geometry as %s.\n", base_name, argv[optind]);
+            return EINVAL;
+        }
+        base_hashes = malloc(sizeof(unsigned long long) * blocks_count);
+        if (base_hashes == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        image_manifest(base, base_hashes);
+    } else if (manifest_in != NULL) {
+        base_hashes = read_manifest(manifest_in, blocks_count);
+        if (base_hashes == NULL) {
+            fprintf(stderr, "ext2_send: %s: %s\n", manifest_in,
+                    errno == EINVAL ? "Not a manifest of an image of this size." : strerror(errno));
+            return errno;
+        }
+    }
+
+    struct stream_io io;
+    if (stream_open(&io, STDOUT_FILENO) < 0) {
+        perror("malloc");
+        exit(1);
+    }
+    struct stream_header header = {
+        STREAM_MAGIC, STREAM_VERSION, blocks_count, sb->s_blocks_per_group, sb->s_inodes_count,
+        base_hashes == NULL ? STREAM_FULL : 0,
+        base_hashes == NULL ? 0 : manifest_fingerprint(base_hashes, blocks_count),
+        manifest_fingerprint(hashes, blocks_count)
+    };
+    int ret = stream_write(&io, &header, sizeof(header));
+
+    // One extent per run of changed blocks, the data straight from the map
+    long long sent = 0, extents = 0;
+    unsigned int b = 0;
+    while (ret == 0 && b < blocks_count) {
+        unsigned int run = b;
+        while (run < blocks_count && hashes[run] != 0
+               && (base_hashes == NULL || base_hashes[run] != hashes[run]
+                   || (base != NULL && memcmp(base + (size_t) run * EXT2_BLOCK_SIZE,
+                                              disk + (size_t) run * EXT2_BLOCK_SIZE, EXT2_BLOCK_SIZE) != 0))) {
+            run++;
+        }
+        if (run == b) {
+            b++;
+            continue;
+        }
+        struct stream_extent extent = {b, run - b};
+        ret = stream_write(&io, &extent, sizeof(extent));
+        if (ret == 0) {
+            ret = stream_write(&io, disk + (size_t) b * EXT2_BLOCK_SIZE, (size_t) extent.count * EXT2_BLOCK_SIZE);
+        }
+        sent += extent.count;
+        extents++;
+        b = run;
+    }
+    struct stream_extent end = {0, 0};
+    if (ret == 0) {
+        ret = stream_write(&io, &end, sizeof(end));
+    }
+    if (ret == 0) {
+        ret = stream_flush(&io);
+    }
+    stream_close(&io);
+    if (ret < 0) {
+        perror("ext2_send");
+        return errno;
+    }
+
+    if (manifest_out != NULL && write_manifest(manifest_out, hashes, blocks_count) < 0) {
+        perror(manifest_out);
+        return errno;
+    }
+
+    double seconds = now_seconds() - start;
+    fprintf(stderr, "{\"blocks_sent\":%lld,\"extents\":%lld,\"stream_bytes\":%lld,\"full\":%s,\"seconds\":%.3f}\n",
+            sent, extents,
+            (long long) sizeof(header) + (extents + 1) * (long long) sizeof(end) + sent * EXT2_BLOCK_SIZE,
+            base_hashes == NULL ? "true" : "false", seconds);
+    return 0;
+}
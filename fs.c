@@ -0,0 +1,459 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <stdint.h>
+#include "ext2.h"
+#include "helper.h"
+#include "fs.h"
+#include "stats.h"
+#include "csum.h"
+#include "record.h"
+
+/*
+ * The open images. A thread remembers the last handle it looked up; the
+ * generation changes on every close, which tells it the handle may be gone.
+ */
+static struct ext2_fs *open_fs = NULL;
+static pthread_rwlock_t open_fs_lock = PTHREAD_RWLOCK_INITIALIZER;
+static unsigned long open_fs_gen = 0;
+static __thread struct ext2_fs *last_fs = NULL;
+static __thread unsigned long last_fs_gen = 0;
+
+/*
+ * The list is only read, so the lookups of discard_prealloc() can take the
+ * lock again.
+ */
+void discard_all_prealloc(void) {
+    pthread_rwlock_rdlock(&open_fs_lock);
+    for (struct ext2_fs *fs = open_fs; fs != NULL; fs = fs->next) {
+        discard_prealloc(fs->disk);
+    }
+    pthread_rwlock_unlock(&open_fs_lock);
+}
+
+/*
+ * Initialise the locks of the handle.
+ */
+static void init_locks(struct ext2_fs *fs) {
+    for (int i = 0; i < DIR_LOCKS; i++) {
+        pthread_rwlock_init(&fs->dir_locks[i], NULL);
+    }
+    pthread_mutex_init(&fs->prealloc_lock, NULL);
+    for (int i = 0; i < DIR_FILTERS; i++) {
+        pthread_mutex_init(&fs->filters[i].lock, NULL);
+    }
+    pthread_mutex_init(&fs->csum_lock, NULL);
+}
+
+struct ext2_fs *ext2_open(const char *disk_name, int flags) {
+    int private = (flags & (EXT2_OPEN_SESSION | EXT2_OPEN_DRY_RUN)) != 0;
+    int fd = open(disk_name, O_RDWR);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    // Map the whole disk image file into memory, whatever its size
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return NULL;
+    }
+    if (st.st_size < 2 * EXT2_BLOCK_SIZE) {
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    unsigned char *disk = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
+                               private ? MAP_PRIVATE : MAP_SHARED, fd, 0);
+    if (disk == MAP_FAILED) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return NULL;
+    }
+
+    // The helpers only understand ext2 with 1 KiB blocks
+    struct ext2_super_block *sb = get_superblock_loc(disk);
+    if (sb->s_magic != EXT2_SUPER_MAGIC || sb->s_log_block_size != 0 || sb->s_blocks_per_group == 0) {
+        munmap(disk, st.st_size);
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    struct ext2_fs *fs = calloc(1, sizeof(struct ext2_fs));
+    STAT_INC(heap_allocations);
+    if (fs == NULL) {
+        munmap(disk, st.st_size);
+        close(fd);
+        errno = ENOMEM;
+        return NULL;
+    }
+    fs->disk = disk;
+    fs->size = (size_t) st.st_size;
+    fs->flags = flags;
+    init_locks(fs);
+
+    // A session keeps the image file to write its dirty pages back
+    if (private) {
+        fs->fd = fd;
+    } else {
+        fs->fd = -1;
+        close(fd);
+    }
+
+    // A dry run leaves the checksums alone as well
+    if (!(flags & EXT2_OPEN_DRY_RUN)) {
+        open_checksums(fs, disk_name);
+    }
+    record_image(disk_name);
+
+    pthread_rwlock_wrlock(&open_fs_lock);
+    fs->next = open_fs;
+    open_fs = fs;
+    pthread_rwlock_unlock(&open_fs_lock);
+    return fs;
+}
+
+void ext2_close(struct ext2_fs *fs) {
+    if (fs == NULL) {
+        return;
+    }
+    discard_prealloc(fs->disk);
+
+    pthread_rwlock_wrlock(&open_fs_lock);
+    struct ext2_fs **link = &open_fs;
+    while (*link != NULL && *link != fs) {
+        link = &(*link)->next;
+    }
+    if (*link != NULL) {
+        *link = fs->next;
+    }
+    __atomic_add_fetch(&open_fs_gen, 1, __ATOMIC_RELEASE);
+    pthread_rwlock_unlock(&open_fs_lock);
+
+    close_checksums(fs);
+    munmap(fs->disk, fs->size);
+    if (fs->fd >= 0) {
+        close(fs->fd);
+    }
+    for (int i = 0; i < DIR_LOCKS; i++) {
+        pthread_rwlock_destroy(&fs->dir_locks[i]);
+    }
+    pthread_mutex_destroy(&fs->prealloc_lock);
+    for (int i = 0; i < DIR_FILTERS; i++) {
+        pthread_mutex_destroy(&fs->filters[i].lock);
+    }
+    pthread_mutex_destroy(&fs->csum_lock);
+    free(fs);
+}
+
+struct ext2_fs *get_fs(unsigned char *disk) {
+    unsigned long gen = __atomic_load_n(&open_fs_gen, __ATOMIC_ACQUIRE);
+    if (last_fs != NULL && last_fs_gen == gen && last_fs->disk == disk) {
+        return last_fs;
+    }
+
+    pthread_rwlock_rdlock(&open_fs_lock);
+    struct ext2_fs *fs = open_fs;
+    while (fs != NULL && fs->disk != disk) {
+        fs = fs->next;
+    }
+    last_fs = fs;
+    last_fs_gen = open_fs_gen;
+    pthread_rwlock_unlock(&open_fs_lock);
+    return fs;
+}
+
+/*
+ * Return the slot of the given inode number in a table of n. The numbers
+ * are hashed: the directories ext2_mkdir spreads over the groups sit at the
+ * same offset of every group's inode table, and would all share one slot.
+ */
+static int inode_slot(int inode_num, int n) {
+    return (int) ((((unsigned int) inode_num * 2654435761u) >> 16) % n);
+}
+
+/*
+ * The stripes the thread holds for writing, on one image at a time. Taking
+ * one of them again only counts, so a thread that keeps a directory locked
+ * (a dir_append cursor) can still look up any directory sharing its stripe.
+ */
+static __thread struct ext2_fs *held_fs = NULL;
+static __thread int held_total = 0;
+static __thread int held_depth[DIR_LOCKS];
+
+/*
+ * A lock call that fails means a caller broke the locking rules; running
+ * on unlocked would corrupt the directory, so stop right there.
+ */
+static void check_lock(int err, const char *what) {
+    if (err != 0) {
+        fprintf(stderr, "%s: %s\n", what, strerror(err));
+        abort();
+    }
+}
+
+void lock_dir(unsigned char *disk, int inode_num, int write) {
+    struct ext2_fs *fs = get_fs(disk);
+    if (fs == NULL) {
+        return;
+    }
+    int slot = inode_slot(inode_num, DIR_LOCKS);
+    if (held_total > 0 && held_fs == fs && held_depth[slot] > 0) {
+        held_depth[slot]++;
+        held_total++;
+        return;
+    }
+    if (write) {
+        check_lock(pthread_rwlock_wrlock(&fs->dir_locks[slot]), "lock_dir");
+        if (held_total == 0 || held_fs == fs) {
+            held_fs = fs;
+            held_depth[slot] = 1;
+            held_total++;
+        }
+    } else {
+        check_lock(pthread_rwlock_rdlock(&fs->dir_locks[slot]), "lock_dir");
+    }
+}
+
+void unlock_dir(unsigned char *disk, int inode_num) {
+    struct ext2_fs *fs = get_fs(disk);
+    if (fs == NULL) {
+        return;
+    }
+    int slot = inode_slot(inode_num, DIR_LOCKS);
+    if (held_total > 0 && held_fs == fs && held_depth[slot] > 0) {
+        held_total--;
+        if (--held_depth[slot] > 0) {
+            return;
+        }
+    }
+    check_lock(pthread_rwlock_unlock(&fs->dir_locks[slot]), "unlock_dir");
+}
+
+/*
+ * Return the filter slot of the directory of the given inode number, locked,
+ * or NULL if the disk was not opened by ext2_open().
+ */
+static struct dir_filter *lock_filter(unsigned char *disk, int inode_num) {
+    struct ext2_fs *fs = get_fs(disk);
+    if (fs == NULL) {
+        return NULL;
+    }
+    struct dir_filter *filter = &fs->filters[inode_slot(inode_num, DIR_FILTERS)];
+    pthread_mutex_lock(&filter->lock);
+    return filter;
+}
+
+/*
+ * Return the two halves of the 64-bit FNV-1a hash of a name; the probed bits
+ * are h1 + i * h2 (double hashing).
+ */
+static void filter_hash(const char *name, int name_len, unsigned int *h1, unsigned int *h2) {
+    unsigned long long hash = 14695981039346656037ULL;
+    for (int i = 0; i < name_len; i++) {
+        hash = (hash ^ (unsigned char) name[i]) * 1099511628211ULL;
+    }
+    *h1 = (unsigned int) hash;
+    *h2 = (unsigned int) (hash >> 32) | 1;
+}
+
+void set_filter_bits(unsigned long long *bits, const char *name, int name_len) {
+    unsigned int h1, h2;
+    filter_hash(name, name_len, &h1, &h2);
+    for (int i = 0; i < FILTER_HASHES; i++) {
+        unsigned int bit = (h1 + i * h2) % FILTER_BITS;
+        bits[bit / 64] |= 1ULL << (bit % 64);
+    }
+}
+
+int probe_dir_filter(unsigned char *disk, int inode_num, const char *name, int name_len) {
+    struct dir_filter *filter = lock_filter(disk, inode_num);
+    if (filter == NULL) {
+        return -1;
+    }
+    int found = -1;
+    if (filter->inode_num == inode_num) {
+        found = 1;
+        if (!filter->saturated) {
+            unsigned int h1, h2;
+            filter_hash(name, name_len, &h1, &h2);
+            for (int i = 0; i < FILTER_HASHES && found; i++) {
+                unsigned int bit = (h1 + i * h2) % FILTER_BITS;
+                found = (filter->bits[bit / 64] >> (bit % 64)) & 1;
+            }
+        }
+    }
+    pthread_mutex_unlock(&filter->lock);
+    return found;
+}
+
+void install_dir_filter(unsigned char *disk, int inode_num, const unsigned long long *bits, unsigned int entries) {
+    struct dir_filter *filter = lock_filter(disk, inode_num);
+    if (filter == NULL) {
+        return;
+    }
+    filter->inode_num = inode_num;
+    filter->saturated = bits == NULL;
+    filter->entries = entries;
+    filter->removed = 0;
+    if (bits != NULL) {
+        memcpy(filter->bits, bits, sizeof(filter->bits));
+    }
+    pthread_mutex_unlock(&filter->lock);
+}
+
+void filter_add_name(unsigned char *disk, int inode_num, const char *name, int name_len) {
+    struct dir_filter *filter = lock_filter(disk, inode_num);
+    if (filter == NULL) {
+        return;
+    }
+    if (filter->inode_num == inode_num && !filter->saturated) {
+        set_filter_bits(filter->bits, name, name_len);
+        if (++filter->entries > FILTER_MAX_ENTRIES) {
+            filter->saturated = 1;
+        }
+    }
+    pthread_mutex_unlock(&filter->lock);
+}
+
+void filter_remove_name(unsigned char *disk, int inode_num) {
+    struct dir_filter *filter = lock_filter(disk, inode_num);
+    if (filter == NULL) {
+        return;
+    }
+    // A saturated filter is rebuilt too, the directory may have shrunk
+    if (filter->inode_num == inode_num && ++filter->removed * 2 > filter->entries) {
+        filter->inode_num = 0;
+    }
+    pthread_mutex_unlock(&filter->lock);
+}
+
+void drop_dir_filter(unsigned char *disk, int inode_num) {
+    struct dir_filter *filter = lock_filter(disk, inode_num);
+    if (filter == NULL) {
+        return;
+    }
+    if (filter->inode_num == inode_num) {
+        filter->inode_num = 0;
+    }
+    pthread_mutex_unlock(&filter->lock);
+}
+
+/*
+ * Write one dirty range of the session image back to the image file.
+ * Return 0, or -1 on a write error.
+ */
+static int write_back(struct ext2_fs *fs, size_t offset, size_t len) {
+    if (offset + len > fs->size) {
+        len = fs->size - offset;
+    }
+    while (len > 0) {
+        ssize_t n = pwrite(fs->fd, fs->disk + offset, len, (off_t) offset);
+        if (n < 0) {
+            return -1;
+        }
+        offset += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * Write back the pages the session changed, found in /proc/self/pagemap: a
+ * page written to through a private file mapping becomes an anonymous copy,
+ * so it is present (or swapped out) without the file-page bit. Return the
+ * number of bytes written, -1 if the page map cannot be read, or -2 on a
+ * write error.
+ */
+static long long commit_from_pagemap(struct ext2_fs *fs) {
+    int pagemap = open("/proc/self/pagemap", O_RDONLY);
+    if (pagemap < 0) {
+        return -1;
+    }
+
+    size_t page_size = (size_t) sysconf(_SC_PAGESIZE);
+    size_t pages = (fs->size + page_size - 1) / page_size;
+    off_t first = (off_t) ((uintptr_t) fs->disk / page_size) * sizeof(unsigned long long);
+    unsigned long long entries[4096];
+    long long written = 0;
+
+    for (size_t p = 0; p < pages; p += 4096) {
+        size_t n = pages - p < 4096 ? pages - p : 4096;
+        if (pread(pagemap, entries, n * sizeof(unsigned long long),
+                  first + (off_t) (p * sizeof(unsigned long long))) != (ssize_t) (n * sizeof(unsigned long long))) {
+            close(pagemap);
+            return -1;
+        }
+        for (size_t i = 0; i < n; i++) {
+            int in_memory = (entries[i] >> 63) & 1;
+            int swapped = (entries[i] >> 62) & 1;
+            int file_page = (entries[i] >> 61) & 1;
+            if ((in_memory || swapped) && !file_page) {
+                if (write_back(fs, (p + i) * page_size, page_size) < 0) {
+                    close(pagemap);
+                    return -2;
+                }
+                written += page_size;
+            }
+        }
+    }
+    close(pagemap);
+    return written;
+}
+
+/*
+ * Write back the blocks of the session image that differ from the image
+ * file, comparing them chunk by chunk. Return the number of bytes written,
+ * or -2 on an I/O error.
+ */
+static long long commit_by_compare(struct ext2_fs *fs) {
+    size_t chunk = 256 * EXT2_BLOCK_SIZE;
+    unsigned char *file_data = malloc(chunk);
+    long long written = 0;
+    STAT_INC(heap_allocations);
+
+    for (size_t offset = 0; offset < fs->size; offset += chunk) {
+        size_t len = fs->size - offset < chunk ? fs->size - offset : chunk;
+        if (pread(fs->fd, file_data, len, (off_t) offset) != (ssize_t) len) {
+            free(file_data);
+            return -2;
+        }
+        for (size_t b = 0; b < len; b += EXT2_BLOCK_SIZE) {
+            size_t block_len = len - b < EXT2_BLOCK_SIZE ? len - b : EXT2_BLOCK_SIZE;
+            if (memcmp(file_data + b, fs->disk + offset + b, block_len) != 0) {
+                if (write_back(fs, offset + b, block_len) < 0) {
+                    free(file_data);
+                    return -2;
+                }
+                written += block_len;
+            }
+        }
+    }
+    free(file_data);
+    return written;
+}
+
+long long ext2_commit(struct ext2_fs *fs) {
+    if (fs == NULL || fs->fd < 0 || (fs->flags & EXT2_OPEN_DRY_RUN)) {
+        return 0;
+    }
+    long long written = commit_from_pagemap(fs);
+    if (written == -1) { // No page map, e.g. /proc is not mounted
+        written = commit_by_compare(fs);
+    }
+    if (written < 0 || (getenv("EXT2_SYNC") != NULL && fsync(fs->fd) < 0)) {
+        return -1;
+    }
+    return written;
+}
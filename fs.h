@@ -0,0 +1,156 @@
+#ifndef CSC369A3_FS_H
+#define CSC369A3_FS_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+/*
+ * An open disk image. Everything the helpers used to keep in process-global
+ * state lives here, so several images can be open at once and several
+ * threads can work on the same one:
+ *
+ *   - The bitmaps and the free counters take no lock: bits are claimed and
+ *     released with atomic operations on 64-bit words, see helper.c.
+ *   - dir_locks guard the entries of directories, striped by inode number:
+ *     lookups take the stripe of the directory for reading, inserts and
+ *     removals for writing.
+ *   - prealloc_lock guards the preallocation windows.
+ *   - Every directory filter has a mutex of its own: lookups holding only a
+ *     read lock of their directory may build and install one.
+ *
+ * A directory lock is never held while taking another one, so the stripes
+ * need no order among themselves. The one exception is a dir_append cursor
+ * (helper.h), which keeps its stripe for writing across other calls; the
+ * thread holding it takes that stripe again without blocking.
+ */
+
+#define EXT2_OPEN_SESSION 1  /* Map a private copy-on-write session */
+#define EXT2_OPEN_DRY_RUN 2  /* A session whose commits are dropped */
+
+#define DIR_LOCKS 64
+#define PREALLOC_WINDOWS 32
+
+#define DIR_FILTERS 64             /* Directories with a filter at once */
+#define FILTER_BITS 16384          /* 2 KiB per directory */
+#define FILTER_HASHES 4
+#define FILTER_MAX_ENTRIES 2048    /* Past this most probes would pass anyway */
+
+/*
+ * A run of blocks reserved ahead of a growing file or directory. The blocks
+ * from next to end are marked used in the bitmap but not yet mapped by the
+ * inode; they are handed out in order and released when the operation ends.
+ */
+struct prealloc_window {
+    int inode_num;      /* 0 for a free slot */
+    unsigned int next;  /* Next block to hand out */
+    unsigned int end;   /* One past the last reserved block */
+};
+
+/*
+ * A Bloom filter of the names in one directory: a name whose bits are not
+ * all set is certainly not there, so a lookup that misses skips the scan.
+ * Names cannot be taken out of it; removals are only counted, and once they
+ * are half the names the filter is dropped and built again by the next
+ * lookup that misses.
+ */
+struct dir_filter {
+    pthread_mutex_t lock;
+    int inode_num;          /* 0 for a free slot */
+    int saturated;          /* Too many names, every probe passes */
+    unsigned int entries;   /* Names added */
+    unsigned int removed;   /* Names removed since it was built */
+    unsigned long long bits[FILTER_BITS / 64];
+};
+
+struct ext2_fs {
+    unsigned char *disk;
+    size_t size;           /* Bytes mapped */
+    int fd;                /* Image file of a session, -1 otherwise */
+    int flags;             /* EXT2_OPEN_* */
+    pthread_rwlock_t dir_locks[DIR_LOCKS];
+    pthread_mutex_t prealloc_lock;
+    struct prealloc_window windows[PREALLOC_WINDOWS];
+    int windows_victim;    /* Slot to evict when all are taken */
+    struct dir_filter filters[DIR_FILTERS];  /* Hashed by inode number */
+    unsigned char *csum;   /* Mapped checksum sidecar, NULL without one (csum.h) */
+    size_t csum_size;
+    pthread_mutex_t csum_lock;           /* Orders the first touch of a block */
+    unsigned long long *csum_touched;    /* Blocks used since the last sync, one bit each */
+    unsigned long long *csum_moved;      /* Of those, the blocks allocated or freed */
+    unsigned long long *csum_bad;        /* Blocks that failed their checksum when touched */
+    struct ext2_fs *next;  /* Next open image */
+};
+
+/*
+ * Map the disk image of the given name, shared or as a session depending on
+ * flags. Return the handle, or NULL with errno set: EINVAL if the file is
+ * not an ext2 image with 1 KiB blocks.
+ */
+struct ext2_fs *ext2_open(const char *disk_name, int flags);
+
+/*
+ * Release the unused preallocated blocks and unmap the image. The changes of
+ * a session that were not committed are dropped.
+ */
+void ext2_close(struct ext2_fs *fs);
+
+/*
+ * Release the unused preallocated blocks of every open image. The tools
+ * run it when the process exits (tools.c), whichever way they leave.
+ */
+void discard_all_prealloc(void);
+
+/*
+ * Write the pages a session modified back to the image file. Return the
+ * number of bytes written, 0 for a shared mapping or a dry run, or -1 with
+ * errno set on an I/O error.
+ */
+long long ext2_commit(struct ext2_fs *fs);
+
+/*
+ * Return the handle the given disk location was opened with, or NULL if it
+ * was not mapped by ext2_open().
+ */
+struct ext2_fs *get_fs(unsigned char *disk);
+
+/*
+ * Lock and unlock the entries of the directory of the given inode number,
+ * shared for a lookup or exclusive (write set) to change them. The locks
+ * are striped, so other directories share them. A thread holding a stripe
+ * for writing takes it again without blocking. Disks not opened by
+ * ext2_open() are not locked.
+ */
+void lock_dir(unsigned char *disk, int inode_num, int write);
+void unlock_dir(unsigned char *disk, int inode_num);
+
+/*
+ * Probe the filter of the directory of the given inode number for a name.
+ * Return 0 if the name is certainly not in the directory, 1 if it may be,
+ * or -1 if the directory has no filter.
+ */
+int probe_dir_filter(unsigned char *disk, int inode_num, const char *name, int name_len);
+
+/*
+ * Install a filter built from every name of the directory, whose lock the
+ * caller holds. bits is NULL if there were more than FILTER_MAX_ENTRIES.
+ */
+void install_dir_filter(unsigned char *disk, int inode_num, const unsigned long long *bits, unsigned int entries);
+
+/*
+ * Set the bits of a name in a filter of FILTER_BITS bits.
+ */
+void set_filter_bits(unsigned long long *bits, const char *name, int name_len);
+
+/*
+ * Record a name added to or removed from the directory, whose lock the
+ * caller holds for writing. Nothing happens if the directory has no filter.
+ */
+void filter_add_name(unsigned char *disk, int inode_num, const char *name, int name_len);
+void filter_remove_name(unsigned char *disk, int inode_num);
+
+/*
+ * Forget the filter of the directory of the given inode number.
+ */
+void drop_dir_filter(unsigned char *disk, int inode_num);
+
+#endif
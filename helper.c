@@ -7,23 +7,90 @@
 #include <fcntl.h>
 #include <sys/mman.h>
 #include <time.h>
+#include <errno.h>
 #include "ext2.h"
 #include "helper.h"
+#include "fs.h"
+#include "csum.h"
+#include "libext2.h"
+#include "stats.h"
+#include "timer.h"
 
 /*
- * Return the disk location.
+ * Open the disk image and return its handle, or exit with a message. With
+ * EXT2_SESSION or EXT2_DRY_RUN set the disk is opened as a copy-on-write
+ * session, see begin_session().
+ */
+struct ext2_fs *open_disk(char *disk_name) {
+    int flags = 0;
+    if (getenv("EXT2_DRY_RUN") != NULL) {
+        flags = EXT2_OPEN_DRY_RUN;
+    } else if (getenv("EXT2_SESSION") != NULL) {
+        flags = EXT2_OPEN_SESSION;
+    }
+
+    struct ext2_fs *fs = ext2_open(disk_name, flags);
+    if (fs == NULL && errno == EINVAL) {
+        fprintf(stderr, "%s: Not an ext2 image with %d byte blocks.\n", disk_name, EXT2_BLOCK_SIZE);
+        exit(EXIT_FAILURE);
+    } else if (fs == NULL) {
+        perror(disk_name);
+        exit(EXIT_FAILURE);
+    }
+    return fs;
+}
+
+/*
+ * Map the disk image as open_disk() does and return the disk location.
  */
 unsigned char *get_disk_loc(char *disk_name) {
-    int fd = open(disk_name, O_RDWR);
+    return open_disk(disk_name)->disk;
+}
 
-    // Map disk image file into memory
-    unsigned char *disk = mmap(NULL, 128 * 1024, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    if(disk == MAP_FAILED) {
-        perror("mmap");
+/*
+ * Open the disk as a copy-on-write session and return the disk location.
+ */
+unsigned char *begin_session(char *disk_name) {
+    struct ext2_fs *fs = ext2_open(disk_name, EXT2_OPEN_SESSION);
+    if (fs == NULL) {
+        perror(disk_name);
         exit(EXIT_FAILURE);
     }
+    return fs->disk;
+}
+
+/*
+ * Write the changes of the session back to the image file, only the pages
+ * (or blocks) that were modified. The session stays open, so later changes
+ * can be committed again. In a dry run nothing is written. Return the
+ * number of bytes written, or -1 on an I/O error.
+ */
+long long commit_session(unsigned char *disk) {
+    return ext2_commit(get_fs(disk));
+}
+
+/*
+ * Close the session and drop every change not committed yet.
+ */
+void abort_session(unsigned char *disk) {
+    struct ext2_fs *fs = get_fs(disk);
+    if (fs != NULL && fs->fd >= 0) {
+        ext2_close(fs);
+    }
+}
 
-    return disk;
+/*
+ * End an operation with ext2_sync() and print why it failed, if it did.
+ */
+int sync_disk(unsigned char *disk) {
+    struct ext2_fs *fs = get_fs(disk);
+    int ret = fs != NULL ? ext2_sync(fs) : 0;
+    if (ret == -EBADMSG) {
+        fprintf(stderr, "sync: Metadata the operation used fails its checksums, see ext2_scrub.\n");
+    } else if (ret < 0) {
+        fprintf(stderr, "sync: %s\n", strerror(-ret));
+    }
+    return -ret;
 }
 
 /*
@@ -40,20 +107,45 @@ struct ext2_group_desc *get_group_descriptor_loc(unsigned char *disk) {
     return (struct ext2_group_desc *)(disk + 2 * EXT2_BLOCK_SIZE);
 }
 
+/*
+ * Return the number of block groups on the disk.
+ */
+int get_groups_count(unsigned char *disk) {
+    struct ext2_super_block *sb = get_superblock_loc(disk);
+    return (int) ((sb->s_blocks_count - sb->s_first_data_block + sb->s_blocks_per_group - 1)
+                  / sb->s_blocks_per_group);
+}
+
 /*
  * Return the block bitmap (16*8 bits) location.
  */
 unsigned char *get_block_bitmap_loc(unsigned char *disk) {
-    struct ext2_group_desc *gd = get_group_descriptor_loc(disk);
-    return disk + EXT2_BLOCK_SIZE * (gd->bg_block_bitmap);
+    return get_group_block_bitmap_loc(disk, 0);
 }
 
 /*
  * Return the inode bitmap (4*8 bits) location.
  */
 unsigned char *get_inode_bitmap_loc(unsigned char *disk) {
+    return get_group_inode_bitmap_loc(disk, 0);
+}
+
+/*
+ * Return the block bitmap location of the given block group.
+ */
+unsigned char *get_group_block_bitmap_loc(unsigned char *disk, int group) {
+    struct ext2_group_desc *gd = get_group_descriptor_loc(disk);
+    TOUCH_BLOCK(disk, gd[group].bg_block_bitmap);
+    return disk + (size_t) EXT2_BLOCK_SIZE * gd[group].bg_block_bitmap;
+}
+
+/*
+ * Return the inode bitmap location of the given block group.
+ */
+unsigned char *get_group_inode_bitmap_loc(unsigned char *disk, int group) {
     struct ext2_group_desc *gd = get_group_descriptor_loc(disk);
-    return disk + EXT2_BLOCK_SIZE * (gd->bg_inode_bitmap);
+    TOUCH_BLOCK(disk, gd[group].bg_inode_bitmap);
+    return disk + (size_t) EXT2_BLOCK_SIZE * gd[group].bg_inode_bitmap;
 }
 
 /*
@@ -61,21 +153,80 @@ unsigned char *get_inode_bitmap_loc(unsigned char *disk) {
  */
 struct ext2_inode *get_inode_table_loc(unsigned char *disk) {
     struct ext2_group_desc *gd = get_group_descriptor_loc(disk);
+    TOUCH_BLOCK(disk, gd->bg_inode_table);
     return (struct ext2_inode *)(disk + EXT2_BLOCK_SIZE * gd->bg_inode_table);
 }
 
+/*
+ * Return the on-disk size of one inode.
+ */
+static int get_inode_size(unsigned char *disk) {
+    struct ext2_super_block *sb = get_superblock_loc(disk);
+    return sb->s_rev_level == 0 ? (int) sizeof(struct ext2_inode) : sb->s_inode_size;
+}
+
+/*
+ * Return the inode of the given inode number, whichever group holds it.
+ */
+struct ext2_inode *get_inode(unsigned char *disk, int inode_num) {
+    struct ext2_super_block *sb = get_superblock_loc(disk);
+    struct ext2_group_desc *gd = get_group_descriptor_loc(disk);
+    int group = (inode_num - 1) / sb->s_inodes_per_group;
+    int index = (inode_num - 1) % sb->s_inodes_per_group;
+    size_t offset = (size_t) EXT2_BLOCK_SIZE * gd[group].bg_inode_table + (size_t) index * get_inode_size(disk);
+
+    TOUCH_BLOCK(disk, (unsigned int) (offset / EXT2_BLOCK_SIZE));
+    return (struct ext2_inode *) (disk + offset);
+}
+
+/*
+ * Return 1 if the given inode number is marked used in its inode bitmap.
+ */
+int inode_in_use(unsigned char *disk, int inode_num) {
+    struct ext2_super_block *sb = get_superblock_loc(disk);
+    int group = (inode_num - 1) / sb->s_inodes_per_group;
+    int index = (inode_num - 1) % sb->s_inodes_per_group;
+    unsigned char *inode_bitmap = get_group_inode_bitmap_loc(disk, group);
+    return 1 & (inode_bitmap[index / 8] >> (index % 8));
+}
+
+/*
+ * Return 1 if the given block is marked used in its block bitmap. Blocks
+ * before the first data block belong to no group and are always used.
+ */
+int block_in_use(unsigned char *disk, unsigned int block) {
+    struct ext2_super_block *sb = get_superblock_loc(disk);
+    if (block < sb->s_first_data_block) {
+        return 1;
+    }
+    unsigned int index = block - sb->s_first_data_block;
+    unsigned char *block_bitmap = get_group_block_bitmap_loc(disk, (int) (index / sb->s_blocks_per_group));
+    index %= sb->s_blocks_per_group;
+    return 1 & (block_bitmap[index / 8] >> (index % 8));
+}
+
+/*
+ * Return the group descriptor of the group holding the given inode.
+ */
+struct ext2_group_desc *get_inode_group_desc(unsigned char *disk, int inode_num) {
+    struct ext2_super_block *sb = get_superblock_loc(disk);
+    return &(get_group_descriptor_loc(disk)[(inode_num - 1) / sb->s_inodes_per_group]);
+}
+
 /*
  * Return the indirect block location.
  */
 unsigned int *get_indirect_block_loc(unsigned char *disk, struct ext2_inode  *inode) {
-    return (unsigned int *) (disk + EXT2_BLOCK_SIZE * inode->i_block[SINGLE_INDIRECT]);
+    TOUCH_BLOCK(disk, inode->i_block[SINGLE_INDIRECT]);
+    return (unsigned int *) (disk + (size_t) EXT2_BLOCK_SIZE * inode->i_block[SINGLE_INDIRECT]);
 }
 
 /*
  * Return the directory location.
  */
 struct ext2_dir_entry_2 *get_dir_entry(unsigned char *disk, int block_num) {
-    return (struct ext2_dir_entry_2 *) (disk + EXT2_BLOCK_SIZE * block_num);
+    TOUCH_BLOCK(disk, (unsigned int) block_num);
+    return (struct ext2_dir_entry_2 *) (disk + (size_t) EXT2_BLOCK_SIZE * block_num);
 }
 
 /*
@@ -93,12 +244,14 @@ char *get_file_name(char *path) {
     char *file_name = malloc(sizeof(char) * (strlen(path) + 1));;
 
     char *full_path = malloc(sizeof(char) * (strlen(path) + 1));
+    STAT_ADD(heap_allocations, 2);
     strncpy(full_path, path, strlen(path) + 1);
 
-    char *token = strtok(full_path, filter);
+    char *save = NULL;
+    char *token = strtok_r(full_path, filter, &save);
     while (token != NULL) {
         strncpy(file_name, token, strlen(token) + 1);
-        token = strtok(NULL, filter);
+        token = strtok_r(NULL, filter, &save);
     }
 
     return file_name;
@@ -117,6 +270,7 @@ char *get_dir_path(char *path) {
     char *parent = NULL;
     file_name = strrchr(path, '/');
     parent = strndup(path, strlen(path) - strlen(file_name) + 1);
+    STAT_INC(heap_allocations);
     return parent;
 }
 
@@ -124,6 +278,7 @@ char *get_dir_path(char *path) {
  * Trace the given path. Return the inode of the given path.
  */
 struct ext2_inode *trace_path(char *path, unsigned char *disk) {
+    TIMED_SCOPE(PHASE_PATH);
     char *filter = "/";
 
     struct ext2_inode  *inode_table = get_inode_table_loc(disk);
@@ -133,16 +288,18 @@ struct ext2_inode *trace_path(char *path, unsigned char *disk) {
 
     // Get the copy of the path
     char *full_path = malloc(sizeof(char) * (strlen(path) + 1));
+    STAT_INC(heap_allocations);
     strncpy(full_path, path, strlen(path) + 1);
 
-    char *token = strtok(full_path, filter);
+    char *save = NULL;
+    char *token = strtok_r(full_path, filter, &save);
 
     while (token != NULL) {
         if (current_inode != NULL && (current_inode->i_mode & EXT2_S_IFDIR)) {
             current_inode = get_entry_with_name(disk, token, current_inode);
         }
 
-        token = strtok(NULL, filter);
+        token = strtok_r(NULL, filter, &save);
 
         // Handle case: in the middle of the path is not a directory
         if (current_inode != NULL && token != NULL
@@ -161,15 +318,54 @@ struct ext2_inode *trace_path(char *path, unsigned char *disk) {
     return current_inode;
 }
 
+/*
+ * Build the name filter of a directory, whose lock the caller holds, from
+ * every entry in use.
+ */
+static void build_dir_filter(unsigned char *disk, struct ext2_inode *dir_inode, int dir_num) {
+    unsigned long long bits[FILTER_BITS / 64];
+    unsigned int entries = 0;
+    memset(bits, 0, sizeof(bits));
+
+    for (int b = 0; b < SINGLE_INDIRECT + EXT2_BLOCK_SIZE / sizeof(unsigned int); b++) {
+        int block_num = get_file_block(disk, dir_inode, b);
+        if (block_num == 0) {
+            continue;
+        }
+        struct ext2_dir_entry_2 *dir = get_dir_entry(disk, block_num);
+        int curr_pos = 0;
+        STAT_INC(dir_blocks_visited);
+        while (curr_pos < EXT2_BLOCK_SIZE && dir->rec_len > 0) {
+            if (dir->inode != 0) {
+                set_filter_bits(bits, dir->name, dir->name_len);
+                entries++;
+            }
+            curr_pos = curr_pos + dir->rec_len;
+            dir = (void *) dir + dir->rec_len;
+        }
+    }
+    install_dir_filter(disk, dir_num, entries > FILTER_MAX_ENTRIES ? NULL : bits, entries);
+}
+
 /*
  * Return the inode of the directory/file/link with a particular name if it is in the given
  * parent directory, otherwise, return NULL.
  */
 struct ext2_inode *get_entry_with_name(unsigned char *disk, char *name, struct ext2_inode *parent) {
     struct ext2_inode *target = NULL;
+    int parent_num = get_inode_num(disk, parent);
+    lock_dir(disk, parent_num, 0);
+
+    // Most names looked up before a create are not there
+    int probe = probe_dir_filter(disk, parent_num, name, (int) strlen(name));
+    if (probe == 0) {
+        STAT_INC(filter_negatives);
+        unlock_dir(disk, parent_num);
+        return NULL;
+    }
 
-    // Search through the direct blocks
-    for (int i = 0; i < SINGLE_INDIRECT; i++) {
+    // Search through the direct blocks, stop at the first block holding the name
+    for (int i = 0; i < SINGLE_INDIRECT && target == NULL; i++) {
         if (parent->i_block[i]) {
             target = get_entry_in_block(disk, name, parent->i_block[i]);
         }
@@ -179,13 +375,19 @@ struct ext2_inode *get_entry_with_name(unsigned char *disk, char *name, struct e
     if (target == NULL && parent->i_block[SINGLE_INDIRECT]) {
         unsigned int *indirect = get_indirect_block_loc(disk, parent);
 
-        for (int i = 0; i < EXT2_BLOCK_SIZE / sizeof(unsigned int); i++) {
+        for (int i = 0; i < EXT2_BLOCK_SIZE / sizeof(unsigned int) && target == NULL; i++) {
             if (indirect[i]) {
                 target = get_entry_in_block(disk, name, indirect[i]);
             }
         }
     }
 
+    // The whole directory was scanned for nothing, filter it from now on
+    if (target == NULL && probe == -1) {
+        build_dir_filter(disk, parent, parent_num);
+    }
+
+    unlock_dir(disk, parent_num);
     return target;
 }
 
@@ -196,11 +398,13 @@ struct ext2_inode *get_entry_with_name(unsigned char *disk, char *name, struct e
 struct ext2_inode *get_entry_in_block(unsigned char *disk, char *name, int block_num) {
     struct ext2_dir_entry_2 *dir = get_dir_entry(disk, block_num);
     struct ext2_inode *target = NULL;
-    struct ext2_inode  *inode_table = get_inode_table_loc(disk);
 
     int curr_pos = 0; // Used to keep track of the dir entry in each block
+    STAT_INC(dir_blocks_visited);
     while (curr_pos < EXT2_BLOCK_SIZE) {
         char *entry_name = malloc(sizeof(char) * dir->name_len + 1);
+        STAT_INC(heap_allocations);
+        STAT_INC(dirents_compared);
 
         for (int u = 0; u < dir->name_len; u++) {
             entry_name[u] = dir->name[u];
@@ -208,7 +412,7 @@ struct ext2_inode *get_entry_in_block(unsigned char *disk, char *name, int block
         entry_name[dir->name_len] = '\0';
 
         if (strcmp(entry_name, name) == 0) {
-            target = &(inode_table[dir->inode - 1]);
+            target = get_inode(disk, dir->inode);
         }
 
         free(entry_name);
@@ -234,6 +438,117 @@ void zero_bitmap(unsigned char *block, int block_num) {
     }
 }
 
+/*
+ * The bitmaps are claimed and released with atomic operations on their
+ * 64-bit words, and the free counters are updated atomically, so allocation
+ * takes no lock. Bit i of a bitmap is bit i % 64 of word i / 64 on the
+ * little-endian hosts the tools run on; a bitmap block is always 8 byte
+ * aligned in the mapping.
+ */
+
+/*
+ * Add n (possibly negative) to the free blocks counts of group g and of the
+ * super block.
+ */
+static void add_free_blocks(unsigned char *disk, int g, int n) {
+    __atomic_add_fetch(&get_group_descriptor_loc(disk)[g].bg_free_blocks_count, (unsigned short) n,
+                       __ATOMIC_RELAXED);
+    __atomic_add_fetch(&get_superblock_loc(disk)->s_free_blocks_count, (unsigned int) n, __ATOMIC_RELAXED);
+}
+
+/*
+ * Add n (possibly negative) to the free inodes counts of group g and of the
+ * super block.
+ */
+static void add_free_inodes(unsigned char *disk, int g, int n) {
+    __atomic_add_fetch(&get_group_descriptor_loc(disk)[g].bg_free_inodes_count, (unsigned short) n,
+                       __ATOMIC_RELAXED);
+    __atomic_add_fetch(&get_superblock_loc(disk)->s_free_inodes_count, (unsigned int) n, __ATOMIC_RELAXED);
+}
+
+/*
+ * Set bit index of the bitmap. Return 1 if this call set it, 0 if it was
+ * set already.
+ */
+static int set_bit(unsigned char *bitmap, int index) {
+    unsigned long long bit = 1ULL << (index % 64);
+    return !(__atomic_fetch_or((unsigned long long *) bitmap + index / 64, bit, __ATOMIC_ACQ_REL) & bit);
+}
+
+/*
+ * Clear bit index of the bitmap.
+ */
+static void clear_bit(unsigned char *bitmap, int index) {
+    __atomic_fetch_and((unsigned long long *) bitmap + index / 64, ~(1ULL << (index % 64)), __ATOMIC_RELEASE);
+}
+
+/*
+ * Set the first clear bit at or after index from and before index end of
+ * the bitmap. A word is loaded once and its clear bits are tried with
+ * fetch_or until one is won or another thread took them all. Return the
+ * index of the bit set, or -1 if the range is full.
+ */
+static int set_first_clear_bit(unsigned char *bitmap, int from, int end) {
+    unsigned long long *words = (unsigned long long *) bitmap;
+    unsigned long long mask = ~0ULL << (from % 64);
+    for (int w = from / 64; w * 64 < end; w++, mask = ~0ULL) {
+        if (end - w * 64 < 64) {
+            mask &= (1ULL << (end - w * 64)) - 1;
+        }
+        STAT_INC(bitmap_words_scanned);
+        unsigned long long word = __atomic_load_n(&words[w], __ATOMIC_RELAXED);
+        while (~word & mask) {
+            int bit = __builtin_ctzll(~word & mask);
+            word = __atomic_fetch_or(&words[w], 1ULL << bit, __ATOMIC_ACQ_REL);
+            if (!(word & (1ULL << bit))) {
+                STAT_ADD(bitmap_bits_scanned, w * 64 + bit - from + 1);
+                return w * 64 + bit;
+            }
+        }
+    }
+    STAT_ADD(bitmap_bits_scanned, end > from ? end - from : 0);
+    return -1;
+}
+
+/*
+ * Release the given block in the block bitmap of its group and update the
+ * free blocks counters.
+ */
+void free_block(unsigned char *disk, int block_num) {
+    struct ext2_super_block *sb = get_superblock_loc(disk);
+    int group = (block_num - sb->s_first_data_block) / sb->s_blocks_per_group;
+    int index = (block_num - sb->s_first_data_block) % sb->s_blocks_per_group;
+
+    clear_bit(get_group_block_bitmap_loc(disk, group), index);
+    add_free_blocks(disk, group, 1);
+    TOUCH_MOVED_BLOCK(disk, (unsigned int) block_num);
+    STAT_INC(blocks_freed);
+}
+
+/*
+ * Release the given inode in the inode bitmap of its group and update the
+ * free inodes counters.
+ */
+void free_inode(unsigned char *disk, int inode_num) {
+    struct ext2_super_block *sb = get_superblock_loc(disk);
+    int group = (inode_num - 1) / sb->s_inodes_per_group;
+    int index = (inode_num - 1) % sb->s_inodes_per_group;
+
+    clear_bit(get_group_inode_bitmap_loc(disk, group), index);
+    add_free_inodes(disk, group, 1);
+    STAT_INC(inodes_freed);
+}
+
+/*
+ * Add n to the count of directories in the group of the given inode, 1 for
+ * a directory created or -1 for one removed.
+ */
+void count_used_dirs(unsigned char *disk, int inode_num, int n) {
+    int group = (inode_num - 1) / get_superblock_loc(disk)->s_inodes_per_group;
+    __atomic_add_fetch(&get_group_descriptor_loc(disk)[group].bg_used_dirs_count, (unsigned short) n,
+                       __ATOMIC_RELAXED);
+}
+
 /*
  * Clear all the entries in the blocks of given inode and
  * zero the block bitmap of given inode.
@@ -242,19 +557,19 @@ void zero_bitmap(unsigned char *block, int block_num) {
  */
 void clear_block_bitmap(unsigned char *disk, char *path) {
     struct ext2_inode *remove = trace_path(path, disk);
-    struct ext2_super_block *sb = get_superblock_loc(disk);
-    struct ext2_group_desc *gd = get_group_descriptor_loc(disk);
-    unsigned char *block_bitmap = get_block_bitmap_loc(disk);
+
+    // The i_block[] of a fast symlink holds its target, not block numbers
+    if (is_fast_symlink(remove)) {
+        memset(remove->i_block, 0, sizeof(remove->i_block));
+        return;
+    }
 
     // Zero through the blocks on the first level
     for (int i = 0; i < SINGLE_INDIRECT; i++) {
         if (remove->i_block[i]) { // Check has data, not points to 0
-            zero_bitmap(block_bitmap, remove->i_block[i]);
+            free_block(disk, remove->i_block[i]);
             remove->i_block[i] = 0; // Points to "boot" block
 
-            sb->s_free_blocks_count++;
-            gd->bg_free_blocks_count++;
-
             remove->i_blocks -= NUM_BLOCKS;
         }
     }
@@ -265,19 +580,14 @@ void clear_block_bitmap(unsigned char *disk, char *path) {
 
         for (int j = 0; j < EXT2_BLOCK_SIZE / sizeof(unsigned int); j++) {
             if (indirect[j]) {
-                zero_bitmap(block_bitmap, indirect[j]);
+                free_block(disk, indirect[j]);
                 indirect[j] = 0; // Each indirect block points to "boot" block
 
-                sb->s_free_blocks_count++;
-                gd->bg_free_blocks_count++;
-
                 remove->i_blocks -= NUM_BLOCKS;
             }
         }
-        zero_bitmap(block_bitmap, remove->i_block[SINGLE_INDIRECT]);
-
-        sb->s_free_blocks_count++;
-        gd->bg_free_blocks_count++;
+        free_block(disk, remove->i_block[SINGLE_INDIRECT]);
+        remove->i_block[SINGLE_INDIRECT] = 0;
 
         remove->i_blocks -= NUM_BLOCKS;
     }
@@ -287,15 +597,7 @@ void clear_block_bitmap(unsigned char *disk, char *path) {
  * Zero the given inode from the inode bitmap.
  */
 void clear_inode_bitmap(unsigned char *disk, struct ext2_inode *remove) {
-    struct ext2_super_block *sb = get_superblock_loc(disk);
-    struct ext2_group_desc *gd = get_group_descriptor_loc(disk);
-    unsigned char *inode_bitmap = get_inode_bitmap_loc(disk);
-
-    int inode_number = get_inode_num(disk, remove);
-    zero_bitmap(inode_bitmap, inode_number);
-
-    sb->s_free_inodes_count++;
-    gd->bg_free_inodes_count++;
+    free_inode(disk, get_inode_num(disk, remove));
 }
 
 /*
@@ -303,30 +605,37 @@ void clear_inode_bitmap(unsigned char *disk, struct ext2_inode *remove) {
  */
 int get_inode_num(unsigned char *disk, struct ext2_inode *target) {
     struct ext2_super_block *sb = get_superblock_loc(disk);
-    struct ext2_inode  *inode_table = get_inode_table_loc(disk);
-
-    int inode_num = 0;
-
-    for (int i = 0; i < sb->s_inodes_count; i++) {
-        if (inode_table[i].i_size && (&(inode_table[i]) == target)) { // There is data
-            inode_num = i + 1;
+    struct ext2_group_desc *gd = get_group_descriptor_loc(disk);
+    int groups = get_groups_count(disk);
+    size_t table_size = (size_t) sb->s_inodes_per_group * get_inode_size(disk);
+
+    // Find the inode table the target lives in
+    for (int g = 0; g < groups; g++) {
+        STAT_INC(inode_table_scans);
+        unsigned char *table = disk + (size_t) EXT2_BLOCK_SIZE * gd[g].bg_inode_table;
+        if ((unsigned char *) target >= table && (unsigned char *) target < table + table_size) {
+            return (int) (g * sb->s_inodes_per_group
+                          + ((unsigned char *) target - table) / get_inode_size(disk) + 1);
         }
     }
 
-    return inode_num;
+    return 0;
 }
 
 /*
  * Remove the file's or directory's name of the given path.
  */
 void remove_name(unsigned char *disk, char *path) {
+    TIMED_SCOPE(PHASE_DIR_UPDATE);
     char *file_name = get_file_name(path);
     char *parent_path = get_dir_parent_path(path);
     struct ext2_inode *parent_dir = trace_path(parent_path, disk);
+    int parent_num = get_inode_num(disk, parent_dir);
     int remove = 0;
+    lock_dir(disk, parent_num, 1);
 
     // Check through the direct blocks
-    for (int i = 0; i < SINGLE_INDIRECT; i++) {
+    for (int i = 0; i < SINGLE_INDIRECT && remove == 0; i++) {
         if (parent_dir->i_block[i]) { // check has data, not points to 0
             remove = remove_name_in_block(disk, file_name, parent_dir->i_block[i]);
         }
@@ -336,12 +645,19 @@ void remove_name(unsigned char *disk, char *path) {
     if (parent_dir->i_block[SINGLE_INDIRECT] && (remove == 0)) {
         unsigned int *indirect = get_indirect_block_loc(disk, parent_dir);
 
-        for (int j = 0; j < EXT2_BLOCK_SIZE / sizeof(unsigned int); j++) {
+        for (int j = 0; j < EXT2_BLOCK_SIZE / sizeof(unsigned int) && remove == 0; j++) {
             if (indirect[j]) {
-                remove_name_in_block(disk, file_name, indirect[j]);
+                remove = remove_name_in_block(disk, file_name, indirect[j]);
             }
         }
     }
+    if (remove) {
+        filter_remove_name(disk, parent_num);
+    }
+    unlock_dir(disk, parent_num);
+
+    free(file_name);
+    free(parent_path);
 }
 
 /*
@@ -354,8 +670,11 @@ int remove_name_in_block(unsigned char *disk, char *file_name, int block_num) {
     int curr_pos = 0; // Used to keep track of the dir entry in each block
     struct ext2_dir_entry_2 *prev_dir = NULL;
 
+    STAT_INC(dir_blocks_visited);
     while (curr_pos < EXT2_BLOCK_SIZE) {
         char *entry_name = malloc(sizeof(char) * dir->name_len + 1);
+        STAT_INC(heap_allocations);
+        STAT_INC(dirents_compared);
 
         for (int u = 0; u < dir->name_len; u++) {
             entry_name[u] = dir->name[u];
@@ -369,8 +688,10 @@ int remove_name_in_block(unsigned char *disk, char *file_name, int block_num) {
 
             if (prev_dir != NULL) { // Need to update of the rec_len of the previous dir entry
                 prev_dir->rec_len += dir->rec_len;
+                dir->rec_len = 0;
+            } else { // First entry of the block keeps its rec_len, only unused
+                dir->inode = 0;
             }
-            dir->rec_len = 0;
             free(entry_name);
             return 1;
         }
@@ -383,11 +704,6 @@ int remove_name_in_block(unsigned char *disk, char *file_name, int block_num) {
         dir = (void*) dir + dir->rec_len;
     }
 
-    for (int i = 0; i < dir->name_len; i++) {
-        dir->name[i] = '\0';
-    }
-    dir->rec_len = 0;
-
     return 0;
 }
 
@@ -407,8 +723,6 @@ void remove_file_or_link(unsigned char *disk, char *path) {
     } else { // links_count == 1, need to remove the actual file/link
         // Clear and zero the block bitmap
         clear_block_bitmap(disk, path);
-        // Clear and zero the inode bitmap
-        clear_inode_bitmap(disk, path_inode);
 
         // Remove current file's name but keep the inode
         remove_name(disk, path);
@@ -416,6 +730,92 @@ void remove_file_or_link(unsigned char *disk, char *path) {
         // Set delete time, in order to reuse inode
         path_inode->i_dtime = (unsigned int) time(NULL);
         path_inode->i_size = 0;
+        path_inode->i_links_count = 0;
+
+        // Clear and zero the inode bitmap last: from then on another thread
+        // may allocate the inode
+        clear_inode_bitmap(disk, path_inode);
+    }
+}
+
+/*
+ * Remove the directory of given path, together with everything inside it.
+ */
+void remove_dir(unsigned char *disk, char *path) {
+    struct ext2_inode *path_inode = trace_path(path, disk);
+    int path_num = get_inode_num(disk, path_inode);
+
+    // Remove all the contents inside the dir, avoid . and ..
+    for (int i = 0; i < SINGLE_INDIRECT; i++) {
+        if (path_inode->i_block[i]) { // Has data in the block
+            clear_directory_content(disk, path_inode->i_block[i], path);
+        }
+    }
+
+    if (path_inode->i_block[SINGLE_INDIRECT]) {
+        unsigned int *indirect = get_indirect_block_loc(disk, path_inode);
+
+        for (int j = 0; j < EXT2_BLOCK_SIZE / sizeof(unsigned int); j++) {
+            if (indirect[j]) {
+                clear_directory_content(disk, indirect[j], path);
+            }
+        }
+    }
+
+    // Zero the block bitmap of the now empty directory
+    clear_block_bitmap(disk, path);
+
+    // Get the parent directory
+    char *parent_path = get_dir_parent_path(path);
+    struct ext2_inode *parent_dir = trace_path(parent_path, disk);
+    int parent_num = get_inode_num(disk, parent_dir);
+    lock_dir(disk, parent_num, 1);
+    parent_dir->i_links_count--;
+    unlock_dir(disk, parent_num);
+    // Remove current directory's name but keep the inode
+    remove_name(disk, path);
+    count_used_dirs(disk, path_num, -1);
+    drop_dir_filter(disk, path_num);
+    free(parent_path);
+
+    // Update the field of removed dir inode
+    for (int i = 0; i < 15; i++) {
+        path_inode->i_block[i] = 0;
+    }
+    path_inode->i_dtime = (unsigned int) time(NULL);
+    path_inode->i_size = 0;
+    path_inode->i_blocks = 0;
+    path_inode->i_links_count = 0;
+    clear_inode_bitmap(disk, path_inode);
+}
+
+/*
+ * Remove every entry except . and .. in one block of the directory of
+ * given path.
+ */
+void clear_directory_content(unsigned char *disk, int block_num, char *path) {
+    struct ext2_dir_entry_2 *curr_dir = get_dir_entry(disk, block_num);
+    int curr_pos = 0;
+
+    while (curr_pos < EXT2_BLOCK_SIZE && curr_dir->rec_len > 0) {
+        // Removing an entry merges it into the previous one, remember where the next is
+        int rec_len = curr_dir->rec_len;
+        int is_dot = (curr_dir->name_len == 1 && curr_dir->name[0] == '.')
+                     || (curr_dir->name_len == 2 && strncmp(curr_dir->name, "..", 2) == 0);
+
+        if (curr_dir->inode && !is_dot) {
+            char *child_path = combine_name(path, curr_dir);
+            if ((curr_dir->file_type == EXT2_FT_REG_FILE)
+                || (curr_dir->file_type == EXT2_FT_SYMLINK)) {
+                remove_file_or_link(disk, child_path);
+            } else if (curr_dir->file_type == EXT2_FT_DIR) {
+                remove_dir(disk, child_path);
+            }
+            free(child_path);
+        }
+
+        curr_pos += rec_len;
+        curr_dir = (void*) curr_dir + rec_len;
     }
 }
 
@@ -426,6 +826,7 @@ char *get_dir_parent_path(char *path) {
     char *file_name = NULL;
     char *parent = NULL;
     char *full_path = malloc(sizeof(char) * (strlen(path) + 1));
+    STAT_ADD(heap_allocations, 2); // With the strndup below
 
     if (path[strlen(path) - 1] == '/') { // remove last '/'
         for (int i = 0; i < strlen(path) - 1; i++) {
@@ -449,40 +850,139 @@ char *get_dir_parent_path(char *path) {
  */
 char *combine_name(char *parent_path, struct ext2_dir_entry_2 *dir_entry) {
     char *full_path = malloc(sizeof(char) * (strlen(parent_path) + 1 + dir_entry->name_len + 1));
+    STAT_INC(heap_allocations);
 
     if (parent_path[strlen(parent_path) - 1] == '/') {
         strncpy(full_path, parent_path, strlen(parent_path) + 1);
-        strncat(full_path, dir_entry->name, dir_entry->name_len + 1);
+        strncat(full_path, dir_entry->name, dir_entry->name_len);
     } else {
         strncpy(full_path, parent_path, strlen(parent_path) + 1);
         strncat(full_path, "/", 2);
-        strncat(full_path, dir_entry->name, dir_entry->name_len + 1);
+        strncat(full_path, dir_entry->name, dir_entry->name_len);
     }
 
     return full_path;
 }
 
 /*
- * Add new entry into the directory.
+ * Record the path of every inode wanted under the directory of the given
+ * path, depth first.
  */
-int add_new_entry(unsigned char *disk, struct ext2_inode *dir_inode, unsigned int new_inode, char *f_name, char type) {
-    // Recalls that there are 12 direct blocks.
-    struct ext2_group_desc *gd = get_group_descriptor_loc(disk);
+void find_paths(unsigned char *disk, struct ext2_inode *dir_inode, char *path, char **paths) {
+    for (int b = 0; b < SINGLE_INDIRECT + INDIRECT_ENTRIES; b++) {
+        int block_num = get_file_block(disk, dir_inode, b);
+        if (block_num == 0) {
+            if (b >= SINGLE_INDIRECT && dir_inode->i_block[SINGLE_INDIRECT] == 0) {
+                break;
+            }
+            continue;
+        }
+        int pos = 0;
+        while (pos < EXT2_BLOCK_SIZE) {
+            struct ext2_dir_entry_2 *entry = get_dir_entry(disk, block_num);
+            entry = (void *) entry + pos;
+            if (entry->rec_len == 0) {
+                break;
+            }
+            pos += entry->rec_len;
+            if (entry->inode == 0 || (entry->name_len == 1 && entry->name[0] == '.')
+                || (entry->name_len == 2 && entry->name[0] == '.' && entry->name[1] == '.')) {
+                continue;
+            }
+
+            char *child = combine_name(path, entry);
+            if (entry->file_type == EXT2_FT_DIR) {
+                find_paths(disk, get_inode(disk, entry->inode), child, paths);
+            }
+            if (paths[entry->inode - 1] == PATH_WANTED) {
+                paths[entry->inode - 1] = child;
+            } else {
+                free(child);
+            }
+        }
+    }
+}
+
+#define DIR_MAX_BLOCKS (SINGLE_INDIRECT + EXT2_BLOCK_SIZE / sizeof(unsigned int))
+
+/*
+ * Map a new block at logical index k of the directory, whose lock the caller
+ * holds, allocating the indirect block first when k is past the direct
+ * blocks. Return the block number, or -1 if the disk is full.
+ */
+static int grow_dir(unsigned char *disk, struct ext2_inode *dir_inode, int k, int goal) {
+    int dir_num = get_inode_num(disk, dir_inode);
+    unsigned int *indirect = NULL;
+    if (k >= SINGLE_INDIRECT) {
+        if (dir_inode->i_block[SINGLE_INDIRECT] == 0) {
+            int indirect_num = get_prealloc_block(disk, dir_num, goal, 1);
+            if (indirect_num == -1) {
+                return -1;
+            }
+            memset(disk + (size_t) indirect_num * EXT2_BLOCK_SIZE, 0, EXT2_BLOCK_SIZE);
+            dir_inode->i_block[SINGLE_INDIRECT] = (unsigned int) indirect_num;
+            dir_inode->i_blocks += NUM_BLOCKS;
+            goal = indirect_num + 1;
+        }
+        indirect = get_indirect_block_loc(disk, dir_inode);
+    }
+
+    int block_num = get_prealloc_block(disk, dir_num, goal, 1);
+    if (block_num == -1) {
+        return -1;
+    }
+    if (indirect != NULL) {
+        indirect[k - SINGLE_INDIRECT] = (unsigned int) block_num;
+    } else {
+        dir_inode->i_block[k] = (unsigned int) block_num;
+    }
+    dir_inode->i_blocks += NUM_BLOCKS;
+    if (dir_inode->i_size < (unsigned int) (k + 1) * EXT2_BLOCK_SIZE) {
+        dir_inode->i_size = (unsigned int) (k + 1) * EXT2_BLOCK_SIZE;
+    }
+    return block_num;
+}
+
+/*
+ * Fill in a new directory entry of the given record length, and account
+ * for it in the directory's links and name filter.
+ */
+static void fill_entry(unsigned char *disk, struct ext2_inode *dir_inode, struct ext2_dir_entry_2 *dir,
+                       unsigned int new_inode, char *f_name, char type, int rec_len) {
+    dir->inode = new_inode;
+    dir->name_len = (unsigned char) strlen(f_name);
+    memcpy(dir->name, f_name, dir->name_len);
+    filter_add_name(disk, get_inode_num(disk, dir_inode), f_name, dir->name_len);
+    if (type == 'd') {
+        dir->file_type = EXT2_FT_DIR;
+        dir_inode->i_links_count ++;
+    } else if (type == 'f') {
+        dir->file_type = EXT2_FT_REG_FILE;
+    } else if (type == 'l') {
+        dir->file_type = EXT2_FT_SYMLINK;
+    } else {
+        dir->file_type = EXT2_FT_UNKNOWN;
+    }
+    dir->rec_len = (unsigned short) rec_len;
+}
 
-    unsigned char *b_bitmap =  disk + EXT2_BLOCK_SIZE * (gd->bg_block_bitmap);
+/*
+ * Add new entry into the directory, whose lock the caller holds, in the
+ * first gap large enough, or else in a new block.
+ */
+static int insert_entry(unsigned char *disk, struct ext2_inode *dir_inode, unsigned int new_inode, char *f_name,
+                        char type) {
     int block_num;
     int length = (int)(strlen(f_name) + sizeof(struct ext2_dir_entry_2 *));
     struct ext2_dir_entry_2 *dir = NULL;
-    for (int k = 0; k < 12; k++) {
+    for (int k = 0; k < DIR_MAX_BLOCKS; k++) {
         // If the block does not exist yet i.e. block number = 0
-        if ((block_num = dir_inode->i_block[k]) == 0) {
-            int free_block_num = get_free_block(disk, b_bitmap);
+        if ((block_num = get_file_block(disk, dir_inode, k)) == 0) {
+            int goal = k > 0 ? get_file_block(disk, dir_inode, k - 1) + 1 : get_inode_goal(disk, dir_inode);
+            int free_block_num = grow_dir(disk, dir_inode, k, goal);
             if (free_block_num == -1) { // No extra free blocks for new entry
                 return -1;
             }
-            dir_inode->i_block[k] = (unsigned int)free_block_num;
-            dir_inode->i_blocks += 2;
-            dir_inode->i_size += EXT2_BLOCK_SIZE;
             dir = get_dir_entry(disk, free_block_num);
             length = EXT2_BLOCK_SIZE;
             break;
@@ -490,6 +990,7 @@ int add_new_entry(unsigned char *disk, struct ext2_inode *dir_inode, unsigned in
 
         dir = get_dir_entry(disk, block_num);
         int curr_pos = 0;
+        STAT_INC(dir_blocks_visited);
 
         /* Total size of the directories in a block cannot exceed a block size */
         while (curr_pos < EXT2_BLOCK_SIZE) {
@@ -499,102 +1000,727 @@ int add_new_entry(unsigned char *disk, struct ext2_inode *dir_inode, unsigned in
             }
             if ((dir->rec_len - true_len) >= length) {
                 int orig_rec_len = dir->rec_len;
-                dir->rec_len = (unsigned char) true_len;
+                dir->rec_len = (unsigned short) true_len;
                 dir = (void *) dir + true_len;
                 length = orig_rec_len - true_len;
-                k = 12; // Also terminate the for loop
+                k = DIR_MAX_BLOCKS; // Also terminate the for loop
                 break;
             }
             // Moving to the next directory
             curr_pos = curr_pos + dir->rec_len;
             dir = (void *) dir + dir->rec_len;
         }
+        if (k < DIR_MAX_BLOCKS) {
+            dir = NULL;
+        }
     }
     if (dir == NULL) {
         return -1;
     }
-    dir->inode = new_inode;
-    dir->name_len = (unsigned char) strlen(f_name);
-    memcpy(dir->name, f_name, dir->name_len);
-    if (type == 'd') {
-        dir->file_type = EXT2_FT_DIR;
-        dir_inode->i_links_count ++;
-    } else if (type == 'f') {
-        dir->file_type = EXT2_FT_REG_FILE;
-    } else if (type == 'l') {
-        dir->file_type = EXT2_FT_SYMLINK;
-    } else {
-        dir->file_type = EXT2_FT_UNKNOWN;
-    }
-    dir->rec_len = (unsigned short)length;
+    fill_entry(disk, dir_inode, dir, new_inode, f_name, type, length);
     return 0;
 }
 
 /*
- * Return the first inode number that is free.
+ * Add new entry into the directory.
  */
-int get_free_inode(unsigned char *disk, unsigned char *inode_bitmap) {
-    // Loop over the inodes that are not reserved, index i
-    struct ext2_group_desc *gd = get_group_descriptor_loc(disk);
-    struct ext2_super_block *sb = get_superblock_loc(disk);
-    for (int i = EXT2_GOOD_OLD_FIRST_INO; i < sb->s_inodes_count; i++) {
-        int bitmap_byte = i / 8;
-        int bit_order = i % 8;
-        if (!(1 & (inode_bitmap[bitmap_byte] >> bit_order))) {
-            // Such bit is 0, which is a free inode
-            if ((i + 1) % 8 == 0) {
-                inode_bitmap[((i + 1) / 8) - 1] |= 1 << bit_order;
-            } else {
-                inode_bitmap[(i + 1) / 8] |= 1 << bit_order;
-            }
-            sb->s_free_inodes_count --;
-            gd->bg_free_inodes_count --;
-            return i + 1;
-        }
-    }
+int add_new_entry(unsigned char *disk, struct ext2_inode *dir_inode, unsigned int new_inode, char *f_name, char type) {
+    TIMED_SCOPE(PHASE_DIR_UPDATE);
+    int dir_num = get_inode_num(disk, dir_inode);
+    lock_dir(disk, dir_num, 1);
+    int ret = insert_entry(disk, dir_inode, new_inode, f_name, type);
+    unlock_dir(disk, dir_num);
+    return ret;
+}
+
+void begin_dir_append(unsigned char *disk, struct ext2_inode *dir_inode, struct dir_append *cursor) {
+    cursor->dir_inode = dir_inode;
+    cursor->dir_num = get_inode_num(disk, dir_inode);
+    cursor->block_index = -1;
+    cursor->last_offset = 0;
+    lock_dir(disk, cursor->dir_num, 1);
+
+    // The tail is the last block mapped; its last entry reaches the end
+    for (int k = DIR_MAX_BLOCKS - 1; k >= 0 && cursor->block_index == -1; k--) {
+        int block_num = get_file_block(disk, dir_inode, k);
+        if (block_num == 0) {
+            continue;
+        }
+        cursor->block_index = k;
+        struct ext2_dir_entry_2 *dir = get_dir_entry(disk, block_num);
+        int curr_pos = 0;
+        STAT_INC(dir_blocks_visited);
+        while (dir->rec_len > 0 && curr_pos + dir->rec_len < EXT2_BLOCK_SIZE) {
+            curr_pos = curr_pos + dir->rec_len;
+            dir = (void *) dir + dir->rec_len;
+        }
+        cursor->last_offset = curr_pos;
+    }
+}
+
+int dir_append(unsigned char *disk, struct dir_append *cursor, unsigned int new_inode, char *f_name, char type) {
+    struct ext2_inode *dir_inode = cursor->dir_inode;
+    int length = (int) (sizeof(struct ext2_dir_entry_2) + strlen(f_name) + 3) & ~3;
+
+    struct ext2_dir_entry_2 *dir = NULL;
+    if (cursor->block_index >= 0) {
+        struct ext2_dir_entry_2 *last = (void *) get_dir_entry(disk, get_file_block(disk, dir_inode, cursor->block_index))
+                                        + cursor->last_offset;
+        // An unused entry at the start of a block is taken over whole
+        int true_len = last->inode == 0 && cursor->last_offset == 0
+                       ? 0 : (int) (sizeof(struct ext2_dir_entry_2) + last->name_len + 3) & ~3;
+        if (last->rec_len - true_len >= length) {
+            int rec_len = last->rec_len - true_len;
+            if (true_len > 0) {
+                last->rec_len = (unsigned short) true_len;
+            }
+            cursor->last_offset += true_len;
+            dir = (void *) last + true_len;
+            fill_entry(disk, dir_inode, dir, new_inode, f_name, type, rec_len);
+            return 0;
+        }
+    }
+
+    // The tail block is full: start a new one after it
+    int k = cursor->block_index + 1;
+    if (k >= DIR_MAX_BLOCKS) {
+        return -1;
+    }
+    int goal = k > 0 ? get_file_block(disk, dir_inode, k - 1) + 1 : get_inode_goal(disk, dir_inode);
+    int block_num = grow_dir(disk, dir_inode, k, goal);
+    if (block_num == -1) {
+        return -1;
+    }
+    cursor->block_index = k;
+    cursor->last_offset = 0;
+    fill_entry(disk, dir_inode, get_dir_entry(disk, block_num), new_inode, f_name, type, EXT2_BLOCK_SIZE);
+    return 0;
+}
+
+void end_dir_append(unsigned char *disk, struct dir_append *cursor) {
+    unlock_dir(disk, cursor->dir_num);
+}
+
+/*
+ * Return the FNV-1a hash of a name of the given length.
+ */
+unsigned int name_hash(char *name, int name_len) {
+    unsigned int hash = 2166136261u;
+    for (int i = 0; i < name_len; i++) {
+        hash = (hash ^ (unsigned char) name[i]) * 16777619u;
+    }
+    return hash;
+}
+
+/*
+ * A live directory entry copied out of its block during compaction.
+ */
+struct packed_entry {
+    unsigned int inode;
+    unsigned int hash;
+    unsigned char name_len;
+    unsigned char file_type;
+    char name[EXT2_NAME_LEN];
+};
+
+/*
+ * Order . and .. first, then by name hash (and name, for equal hashes).
+ */
+static int compare_packed_entries(const void *a, const void *b) {
+    const struct packed_entry *x = a;
+    const struct packed_entry *y = b;
+    int x_dot = (x->name[0] == '.' && (x->name_len == 1 || (x->name_len == 2 && x->name[1] == '.')));
+    int y_dot = (y->name[0] == '.' && (y->name_len == 1 || (y->name_len == 2 && y->name[1] == '.')));
+
+    if (x_dot || y_dot) {
+        return x_dot && y_dot ? x->name_len - y->name_len : y_dot - x_dot;
+    }
+    if (x->hash != y->hash) {
+        return x->hash < y->hash ? -1 : 1;
+    }
+    int len = x->name_len < y->name_len ? x->name_len : y->name_len;
+    int order = memcmp(x->name, y->name, len);
+    return order ? order : x->name_len - y->name_len;
+}
+
+/*
+ * Repack the entries of a directory whose lock the caller holds, see
+ * compact_dir().
+ */
+static int pack_dir(unsigned char *disk, struct ext2_inode *dir_inode, int sort) {
+    int max_blocks = SINGLE_INDIRECT + EXT2_BLOCK_SIZE / sizeof(unsigned int);
+    unsigned int blocks[max_blocks];
+    int blocks_count = 0;
+
+    // Directory blocks in logical order, skipping unused pointers
+    for (int i = 0; i < SINGLE_INDIRECT; i++) {
+        if (dir_inode->i_block[i]) {
+            blocks[blocks_count++] = dir_inode->i_block[i];
+        }
+    }
+    unsigned int *indirect = NULL;
+    if (dir_inode->i_block[SINGLE_INDIRECT]) {
+        indirect = get_indirect_block_loc(disk, dir_inode);
+        for (int j = 0; j < EXT2_BLOCK_SIZE / sizeof(unsigned int); j++) {
+            if (indirect[j]) {
+                blocks[blocks_count++] = indirect[j];
+            }
+        }
+    }
+    if (blocks_count == 0) {
+        return 0;
+    }
+
+    // Copy every live entry out, the blocks are rewritten in place below
+    int capacity = blocks_count * (EXT2_BLOCK_SIZE / 12);
+    struct packed_entry *entries = malloc(sizeof(struct packed_entry) * capacity);
+    STAT_INC(heap_allocations);
+    if (entries == NULL) {
+        return -1;
+    }
+    int entries_count = 0;
+    for (int b = 0; b < blocks_count; b++) {
+        struct ext2_dir_entry_2 *dir = get_dir_entry(disk, blocks[b]);
+        int curr_pos = 0;
+        STAT_INC(dir_blocks_visited);
+        while (curr_pos < EXT2_BLOCK_SIZE && dir->rec_len > 0) {
+            if (dir->inode != 0 && dir->name_len > 0) {
+                struct packed_entry *entry = &(entries[entries_count++]);
+                entry->inode = dir->inode;
+                entry->name_len = dir->name_len;
+                entry->file_type = dir->file_type;
+                memcpy(entry->name, dir->name, dir->name_len);
+                entry->hash = name_hash(dir->name, dir->name_len);
+            }
+            curr_pos = curr_pos + dir->rec_len;
+            dir = (void *) dir + dir->rec_len;
+        }
+    }
+    if (sort) {
+        qsort(entries, entries_count, sizeof(struct packed_entry), compare_packed_entries);
+    }
+
+    // Pack the entries; an entry never straddles two blocks
+    int used_blocks = 1;
+    int curr_pos = 0;
+    struct ext2_dir_entry_2 *prev_dir = NULL;
+    memset(get_dir_entry(disk, blocks[0]), 0, EXT2_BLOCK_SIZE);
+    for (int e = 0; e < entries_count; e++) {
+        int true_len = (8 + entries[e].name_len + 3) & ~3;
+        if (curr_pos + true_len > EXT2_BLOCK_SIZE) {
+            prev_dir->rec_len += EXT2_BLOCK_SIZE - curr_pos;
+            memset(get_dir_entry(disk, blocks[used_blocks]), 0, EXT2_BLOCK_SIZE);
+            used_blocks++;
+            curr_pos = 0;
+        }
+        struct ext2_dir_entry_2 *dir = (void *) get_dir_entry(disk, blocks[used_blocks - 1]) + curr_pos;
+        dir->inode = entries[e].inode;
+        dir->rec_len = (unsigned short) true_len;
+        dir->name_len = entries[e].name_len;
+        dir->file_type = entries[e].file_type;
+        memcpy(dir->name, entries[e].name, entries[e].name_len);
+        curr_pos += true_len;
+        prev_dir = dir;
+    }
+    if (prev_dir == NULL) { // No live entry at all: one empty, unused entry
+        get_dir_entry(disk, blocks[0])->rec_len = EXT2_BLOCK_SIZE;
+    } else {
+        prev_dir->rec_len += EXT2_BLOCK_SIZE - curr_pos;
+    }
+    free(entries);
+
+    // Free the emptied blocks and renumber the rest without holes
+    for (int b = used_blocks; b < blocks_count; b++) {
+        free_block(disk, blocks[b]);
+        dir_inode->i_blocks -= NUM_BLOCKS;
+    }
+    for (int i = 0; i < SINGLE_INDIRECT; i++) {
+        dir_inode->i_block[i] = i < used_blocks ? blocks[i] : 0;
+    }
+    if (indirect != NULL) {
+        for (int j = 0; j < EXT2_BLOCK_SIZE / sizeof(unsigned int); j++) {
+            indirect[j] = SINGLE_INDIRECT + j < used_blocks ? blocks[SINGLE_INDIRECT + j] : 0;
+        }
+        if (used_blocks <= SINGLE_INDIRECT) {
+            free_block(disk, dir_inode->i_block[SINGLE_INDIRECT]);
+            dir_inode->i_block[SINGLE_INDIRECT] = 0;
+            dir_inode->i_blocks -= NUM_BLOCKS;
+            blocks_count++; // The indirect block counts as freed too
+        }
+    }
+    dir_inode->i_size = (unsigned int) used_blocks * EXT2_BLOCK_SIZE;
+
+    return blocks_count - used_blocks;
+}
+
+/*
+ * Repack the live entries of a directory densely into its first blocks and
+ * free the blocks left empty (and the indirect block once unused). If sort
+ * is set, the entries after . and .. are ordered by name hash. Return the
+ * number of blocks freed, or -1 if memory ran out.
+ */
+int compact_dir(unsigned char *disk, struct ext2_inode *dir_inode, int sort) {
+    TIMED_SCOPE(PHASE_DIR_UPDATE);
+    int dir_num = get_inode_num(disk, dir_inode);
+    lock_dir(disk, dir_num, 1);
+    int ret = pack_dir(disk, dir_inode, sort);
+    unlock_dir(disk, dir_num);
+    return ret;
+}
+
+/*
+ * Placement policy of new inodes and blocks, see helper.h. EXT2_ALLOC=first
+ * selects first fit, anything else keeps the locality policy.
+ */
+int alloc_policy = ALLOC_LOCALITY;
+
+__attribute__((constructor))
+static void init_alloc_policy(void) {
+    char *policy = getenv("EXT2_ALLOC");
+    if (policy != NULL && strcmp(policy, "first") == 0) {
+        alloc_policy = ALLOC_FIRST_FIT;
+    }
+}
+
+/*
+ * Mark the first free inode at or after index from of group g as used.
+ * Return its inode number, or -1 if there is none.
+ */
+static int alloc_inode_in_group(unsigned char *disk, int g, int from) {
+    struct ext2_group_desc *gd = get_group_descriptor_loc(disk);
+    struct ext2_super_block *sb = get_superblock_loc(disk);
+    if (__atomic_load_n(&gd[g].bg_free_inodes_count, __ATOMIC_RELAXED) == 0) {
+        return -1;
+    }
+
+    // Skip the reserved inodes
+    int first = (g == 0) ? EXT2_GOOD_OLD_FIRST_INO : 0;
+    int i = set_first_clear_bit(get_group_inode_bitmap_loc(disk, g), from > first ? from : first,
+                                (int) sb->s_inodes_per_group);
+    if (i == -1) {
+        return -1;
+    }
+    add_free_inodes(disk, g, -1);
+    STAT_INC(inodes_allocated);
+    return g * sb->s_inodes_per_group + i + 1;
+}
+
+/*
+ * Threads take a slot in the order they first allocate. A thread's first
+ * fit scans start from its own cursor, spread over the groups and then
+ * over the eighths of a group, so parallel allocations claim different
+ * bitmap words instead of fighting over the first free bit. The first
+ * thread starts from the beginning, which keeps a single threaded tool
+ * plain first fit.
+ */
+static int next_alloc_slot = 0;
+static __thread int alloc_slot = -1;
+
+/*
+ * Set group and index to the cursor of the calling thread in a bitmap of
+ * per_group bits per group.
+ */
+static void get_alloc_cursor(unsigned char *disk, int per_group, int *group, int *index) {
+    if (alloc_slot == -1) {
+        alloc_slot = __atomic_fetch_add(&next_alloc_slot, 1, __ATOMIC_RELAXED);
+    }
+    int groups = get_groups_count(disk);
+    *group = alloc_slot % groups;
+    *index = (alloc_slot / groups) % 8 * (per_group / 8) & ~63;
+}
+
+/*
+ * Return the first inode number that is free.
+ */
+int get_free_inode(unsigned char *disk) {
+    TIMED_SCOPE(PHASE_ALLOC);
+    int groups = get_groups_count(disk);
+    int first, from;
+    get_alloc_cursor(disk, (int) get_superblock_loc(disk)->s_inodes_per_group, &first, &from);
+
+    // The cursor's group is scanned again from its start last
+    for (int i = 0; i <= groups; i++) {
+        if (i == groups && from == 0) {
+            break;
+        }
+        int inode_num = alloc_inode_in_group(disk, (first + i) % groups, i == 0 ? from : 0);
+        if (inode_num != -1) {
+            return inode_num;
+        }
+    }
 
     return -1;
 }
 
+/*
+ * Return the group a new top level directory goes to: among the groups with
+ * at least the average free inodes and free blocks, the one holding the
+ * fewest directories, so that unrelated trees are spread over the disk.
+ * Return -1 if no group qualifies.
+ */
+static int find_group_orlov(unsigned char *disk) {
+    struct ext2_group_desc *gd = get_group_descriptor_loc(disk);
+    struct ext2_super_block *sb = get_superblock_loc(disk);
+    int groups = get_groups_count(disk);
+    unsigned int avg_free_inodes = sb->s_free_inodes_count / groups;
+    unsigned int avg_free_blocks = sb->s_free_blocks_count / groups;
+
+    int best = -1;
+    for (int g = 0; g < groups; g++) {
+        if (gd[g].bg_free_inodes_count == 0 || gd[g].bg_free_inodes_count < avg_free_inodes
+            || gd[g].bg_free_blocks_count < avg_free_blocks) {
+            continue;
+        }
+        if (best == -1 || gd[g].bg_used_dirs_count < gd[best].bg_used_dirs_count
+            || (gd[g].bg_used_dirs_count == gd[best].bg_used_dirs_count
+                && gd[g].bg_free_blocks_count > gd[best].bg_free_blocks_count)) {
+            best = g;
+        }
+    }
+    return best;
+}
+
+/*
+ * Return the group a new inode under the given parent directory goes to:
+ * the parent's group unless it is (nearly) full, then the next group with
+ * room for both the inode and its data.
+ */
+static int find_group_near(unsigned char *disk, int parent_group, char type) {
+    struct ext2_group_desc *gd = get_group_descriptor_loc(disk);
+    struct ext2_super_block *sb = get_superblock_loc(disk);
+    int groups = get_groups_count(disk);
+
+    // A sub directory stays with its parent only while the group is not
+    // starved, otherwise the parent's files would have no room left
+    unsigned int min_free_inodes = type == 'd' ? sb->s_free_inodes_count / groups / 4 : 0;
+    unsigned int min_free_blocks = type == 'd' ? sb->s_free_blocks_count / groups / 4 : 0;
+
+    for (int i = 0; i < groups; i++) {
+        int g = (parent_group + i) % groups;
+        if (gd[g].bg_free_inodes_count > min_free_inodes
+            && gd[g].bg_free_blocks_count > min_free_blocks) {
+            return g;
+        }
+    }
+    return type == 'd' ? find_group_orlov(disk) : -1;
+}
+
+/*
+ * Return a free inode number for a new inode of the given type ('f', 'd' or
+ * 'l') in the directory of inode number parent_num, chosen by alloc_policy.
+ */
+int get_free_inode_near(unsigned char *disk, int parent_num, char type) {
+    if (alloc_policy == ALLOC_FIRST_FIT || get_groups_count(disk) == 1) {
+        return get_free_inode(disk);
+    }
+
+    TIMED_SCOPE(PHASE_ALLOC);
+    struct ext2_super_block *sb = get_superblock_loc(disk);
+    int g = -1;
+    if (type == 'd' && parent_num == EXT2_ROOT_INO) {
+        g = find_group_orlov(disk);
+    }
+    if (g == -1) {
+        g = find_group_near(disk, (parent_num - 1) / sb->s_inodes_per_group, type);
+    }
+
+    int inode_num = g != -1 ? alloc_inode_in_group(disk, g, 0) : -1;
+    for (g = 0; g < get_groups_count(disk) && inode_num == -1; g++) {
+        inode_num = alloc_inode_in_group(disk, g, 0);
+    }
+    return inode_num;
+}
+
+/*
+ * Mark the first free block at or after index from of group g as used.
+ * Return its block number, or -1 if there is none.
+ */
+static int alloc_block_in_group(unsigned char *disk, int g, int from) {
+    struct ext2_group_desc *gd = get_group_descriptor_loc(disk);
+    struct ext2_super_block *sb = get_superblock_loc(disk);
+    if (__atomic_load_n(&gd[g].bg_free_blocks_count, __ATOMIC_RELAXED) == 0) {
+        return -1;
+    }
+
+    // The last group may be shorter than the others
+    unsigned int group_start = sb->s_first_data_block + g * sb->s_blocks_per_group;
+    unsigned int group_blocks = sb->s_blocks_count - group_start;
+    if (group_blocks > sb->s_blocks_per_group) {
+        group_blocks = sb->s_blocks_per_group;
+    }
+
+    int i = set_first_clear_bit(get_group_block_bitmap_loc(disk, g), from, (int) group_blocks);
+    if (i == -1) {
+        return -1;
+    }
+    add_free_blocks(disk, g, -1);
+    STAT_INC(blocks_allocated);
+    TOUCH_MOVED_BLOCK(disk, group_start + i);
+    return (int) (group_start + i);
+}
+
 /*
  * Return the first block number that is free.
  */
-int get_free_block(unsigned char *disk, unsigned char *block_bitmap) {
-    // Loop over the inodes that are not reserved
+int get_free_block(unsigned char *disk) {
+    TIMED_SCOPE(PHASE_ALLOC);
+    int groups = get_groups_count(disk);
+    int first, from;
+    get_alloc_cursor(disk, (int) get_superblock_loc(disk)->s_blocks_per_group, &first, &from);
+
+    // The cursor's group is scanned again from its start last
+    for (int i = 0; i <= groups; i++) {
+        if (i == groups && from == 0) {
+            break;
+        }
+        int block_num = alloc_block_in_group(disk, (first + i) % groups, i == 0 ? from : 0);
+        if (block_num != -1) {
+            return block_num;
+        }
+    }
+
+    return -1;
+}
+
+/*
+ * Return a free block number as close after the goal block as possible:
+ * the goal itself, a later block of its group, an earlier one, then the
+ * following groups. Under the first fit policy the goal is ignored.
+ */
+int get_free_block_near(unsigned char *disk, int goal) {
+    struct ext2_super_block *sb = get_superblock_loc(disk);
+    if (alloc_policy == ALLOC_FIRST_FIT || goal < (int) sb->s_first_data_block
+        || goal >= (int) sb->s_blocks_count) {
+        return get_free_block(disk);
+    }
+
+    TIMED_SCOPE(PHASE_ALLOC);
+    int groups = get_groups_count(disk);
+    int goal_group = (goal - sb->s_first_data_block) / sb->s_blocks_per_group;
+    int from = (goal - sb->s_first_data_block) % sb->s_blocks_per_group;
+
+    int block_num = alloc_block_in_group(disk, goal_group, from);
+    if (block_num == -1 && from > 0) {
+        block_num = alloc_block_in_group(disk, goal_group, 0);
+    }
+    for (int i = 1; i < groups && block_num == -1; i++) {
+        block_num = alloc_block_in_group(disk, (goal_group + i) % groups, 0);
+    }
+    return block_num;
+}
+
+/*
+ * Return the block to start the data of the given inode from: the first
+ * block of the group holding it.
+ */
+int get_inode_goal(unsigned char *disk, struct ext2_inode *inode) {
+    struct ext2_super_block *sb = get_superblock_loc(disk);
+    int inode_num = get_inode_num(disk, inode);
+    if (inode_num == 0) {
+        return -1;
+    }
+    return (int) (sb->s_first_data_block
+                  + (inode_num - 1) / sb->s_inodes_per_group * sb->s_blocks_per_group);
+}
+
+#define PREALLOC_BLOCKS 8     /* Used when the super block gives no hint */
+#define PREALLOC_DIR_BLOCKS 4
+
+/*
+ * Give the unused blocks of a window back to the bitmap and free its slot.
+ */
+static void release_window(unsigned char *disk, struct prealloc_window *w) {
+    STAT_ADD(prealloc_released, w->end - w->next);
+    for (unsigned int b = w->next; b < w->end; b++) {
+        free_block(disk, (int) b);
+    }
+    w->inode_num = 0;
+}
+
+/*
+ * Release every preallocation window, at the end of an operation or when
+ * the disk runs short of free blocks.
+ */
+void discard_prealloc(unsigned char *disk) {
+    struct ext2_fs *fs = get_fs(disk);
+    if (fs == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&fs->prealloc_lock);
+    for (int i = 0; i < PREALLOC_WINDOWS; i++) {
+        if (fs->windows[i].inode_num) {
+            release_window(disk, &fs->windows[i]);
+        }
+    }
+    pthread_mutex_unlock(&fs->prealloc_lock);
+}
+
+/*
+ * Mark the given block as used if it is free. Return 1 if it was.
+ */
+static int claim_block(unsigned char *disk, unsigned int block_num) {
+    struct ext2_super_block *sb = get_superblock_loc(disk);
+    int group = (block_num - sb->s_first_data_block) / sb->s_blocks_per_group;
+    int index = (block_num - sb->s_first_data_block) % sb->s_blocks_per_group;
+
+    if (!set_bit(get_group_block_bitmap_loc(disk, group), index)) {
+        return 0;
+    }
+    add_free_blocks(disk, group, -1);
+    STAT_INC(blocks_allocated);
+    TOUCH_MOVED_BLOCK(disk, block_num);
+    return 1;
+}
+
+/*
+ * Return a free block for the next block of the given inode, out of its
+ * preallocation window when it has one left. Otherwise allocate one near
+ * the goal and reserve the free blocks right after it as the new window,
+ * s_prealloc_blocks of them for a file or s_prealloc_dir_blocks for a
+ * directory. Return -1 if the disk is full.
+ */
+int get_prealloc_block(unsigned char *disk, int inode_num, int goal, int is_dir) {
+    struct ext2_super_block *sb = get_superblock_loc(disk);
+    struct ext2_fs *fs = get_fs(disk);
+    if (fs == NULL) {
+        return get_free_block_near(disk, goal);
+    }
+
+    // The window of an inode is only used by the thread writing the inode,
+    // the lock guards the slots
+    pthread_mutex_lock(&fs->prealloc_lock);
+    struct prealloc_window *w = NULL;
+    for (int i = 0; i < PREALLOC_WINDOWS; i++) {
+        if (fs->windows[i].inode_num == inode_num) {
+            w = &fs->windows[i];
+            break;
+        }
+    }
+    if (w != NULL && w->next < w->end) {
+        int block_num = (int) w->next++;
+        pthread_mutex_unlock(&fs->prealloc_lock);
+        STAT_INC(prealloc_hits);
+        return block_num;
+    }
+    pthread_mutex_unlock(&fs->prealloc_lock);
+
+    int block_num = get_free_block_near(disk, goal);
+    if (block_num == -1) { // The windows may hold the last free blocks
+        discard_prealloc(disk);
+        return get_free_block_near(disk, goal);
+    }
+
+    pthread_mutex_lock(&fs->prealloc_lock);
+    w = NULL;
+    for (int i = 0; i < PREALLOC_WINDOWS && w == NULL; i++) {
+        if (fs->windows[i].inode_num == inode_num) {
+            w = &fs->windows[i];
+            release_window(disk, w);
+        }
+    }
+    for (int i = 0; i < PREALLOC_WINDOWS && w == NULL; i++) {
+        if (fs->windows[i].inode_num == 0) {
+            w = &fs->windows[i];
+        }
+    }
+    if (w == NULL) {
+        w = &fs->windows[fs->windows_victim];
+        fs->windows_victim = (fs->windows_victim + 1) % PREALLOC_WINDOWS;
+        release_window(disk, w);
+    }
+
+    // Stop at the first used block and at the end of the group
+    int size = is_dir ? sb->s_prealloc_dir_blocks : sb->s_prealloc_blocks;
+    if (size == 0) {
+        size = is_dir ? PREALLOC_DIR_BLOCKS : PREALLOC_BLOCKS;
+    }
+    unsigned int group_end = sb->s_first_data_block
+                             + ((block_num - sb->s_first_data_block) / sb->s_blocks_per_group + 1)
+                               * sb->s_blocks_per_group;
+    w->inode_num = inode_num;
+    w->next = w->end = (unsigned int) block_num + 1;
+    while (w->end - w->next < size && w->end < group_end && w->end < sb->s_blocks_count
+           && claim_block(disk, w->end)) {
+        w->end++;
+    }
+    pthread_mutex_unlock(&fs->prealloc_lock);
+    return block_num;
+}
+
+/*
+ * Return the first block of count contiguous free blocks, all marked as
+ * used, or -1 if no group has such a run.
+ */
+int get_free_run(unsigned char *disk, int count) {
+    TIMED_SCOPE(PHASE_ALLOC);
     struct ext2_group_desc *gd = get_group_descriptor_loc(disk);
     struct ext2_super_block *sb = get_superblock_loc(disk);
-    for (int i = 0; i < sb->s_blocks_count; i++) {
-        int bitmap_byte = i / 8;
-        int bit_order = i % 8;
-        if (!(1 & (block_bitmap[bitmap_byte] >> bit_order))) {
-            // Such bit is 0, which is a free block
-            if ((i + 1) % 8 == 0) {
-                block_bitmap[((i + 1) / 8) - 1] |= 1 << bit_order;
-            } else {
-                block_bitmap[(i + 1) / 8] |= 1 << bit_order;
+    int groups = get_groups_count(disk);
+
+    for (int g = 0; g < groups; g++) {
+        if (gd[g].bg_free_blocks_count < count) {
+            continue;
+        }
+
+        unsigned int group_start = sb->s_first_data_block + g * sb->s_blocks_per_group;
+        unsigned int group_blocks = sb->s_blocks_count - group_start;
+        if (group_blocks > sb->s_blocks_per_group) {
+            group_blocks = sb->s_blocks_per_group;
+        }
+
+        unsigned char *block_bitmap = get_group_block_bitmap_loc(disk, g);
+        int run = 0;
+        for (int i = 0; i < group_blocks; i++) {
+            if (i % 8 == 0 && block_bitmap[i / 8] == 0xFF) { // Skip a full byte at once
+                run = 0;
+                i += 7;
+                continue;
+            }
+            if (1 & (block_bitmap[i / 8] >> (i % 8))) {
+                run = 0;
+                continue;
+            }
+            if (++run == count) {
+                // Another thread may take a block of the run first: give
+                // the ones already set back and keep looking after it
+                int j = i - count + 1;
+                while (j <= i && set_bit(block_bitmap, j)) {
+                    j++;
+                }
+                if (j <= i) {
+                    while (--j >= i - count + 1) {
+                        clear_bit(block_bitmap, j);
+                    }
+                    run = 0;
+                    continue;
+                }
+                add_free_blocks(disk, g, -count);
+                STAT_ADD(bitmap_bits_scanned, i + 1);
+                STAT_ADD(blocks_allocated, count);
+                for (j = i - count + 1; j <= i; j++) {
+                    TOUCH_MOVED_BLOCK(disk, group_start + j);
+                }
+                return (int) (group_start + i - count + 1);
             }
-            sb->s_free_blocks_count --;
-            gd->bg_free_blocks_count --;
-            return i + 1;
         }
+        STAT_ADD(bitmap_bits_scanned, group_blocks);
     }
 
     return -1;
 }
 
 /*
- * Find a new unused inode and initialize. Return inode number. Return -1 if
- * could not find such inode.
+ * Find a new unused inode for an entry of the directory of inode number
+ * parent_num and initialize. Return inode number. Return -1 if could not
+ * find such inode.
  */
-int init_inode(unsigned char *disk, int size, char type) {
+int init_inode(unsigned char *disk, int parent_num, int size, char type) {
     int inode_num;
-    unsigned char *i_bitmap = get_inode_bitmap_loc(disk);
-    struct ext2_inode *i_table = get_inode_table_loc(disk);
-    if ((inode_num = get_free_inode(disk, i_bitmap)) == -1) {
+    if ((inode_num = get_free_inode_near(disk, parent_num, type)) == -1) {
         return -1;
     }
 
-    struct ext2_inode *tar_inode = &(i_table[inode_num - 1]);
+    struct ext2_inode *tar_inode = get_inode(disk, inode_num);
 
     // Init the inode
     if (type == 'f') {
@@ -615,33 +1741,462 @@ int init_inode(unsigned char *disk, int size, char type) {
 }
 
 /*
- * Write buf into blocks of the target inode.
+ * Write a directory entry of a directory at the given offset of a
+ * directory block. Return the offset right after its name.
+ */
+static int put_dir_entry(unsigned char *block, int offset, int inode_num, char *name, int rec_len) {
+    struct ext2_dir_entry_2 *dir = (struct ext2_dir_entry_2 *) (block + offset);
+    dir->inode = (unsigned int) inode_num;
+    dir->name_len = (unsigned char) strlen(name);
+    dir->file_type = EXT2_FT_DIR;
+    memcpy(dir->name, name, dir->name_len);
+    int true_len = (int) (sizeof(struct ext2_dir_entry_2) + dir->name_len + 3) & ~3;
+    dir->rec_len = (unsigned short) (rec_len ? rec_len : true_len);
+    return offset + true_len;
+}
+
+int make_dir_chain(unsigned char *disk, int parent_num, char **names, int count) {
+    TIMED_SCOPE(PHASE_DIR_UPDATE);
+    int inode_nums[count];
+    int block_nums[count];
+    int taken_inodes = 0;
+    int taken_blocks = 0;
+
+    // All the inodes, in the group the first one goes to, then all the
+    // blocks, one after the other from the start of that group
+    inode_nums[0] = get_free_inode_near(disk, parent_num, 'd');
+    taken_inodes = inode_nums[0] != -1;
+    while (taken_inodes > 0 && taken_inodes < count
+           && (inode_nums[taken_inodes] = get_free_inode_near(disk, inode_nums[0], 'f')) != -1) {
+        taken_inodes++;
+    }
+    int goal = taken_inodes > 0 ? get_inode_goal(disk, get_inode(disk, inode_nums[0])) : 0;
+    while (taken_inodes == count && taken_blocks < count
+           && (block_nums[taken_blocks] = get_free_block_near(disk, goal)) != -1) {
+        goal = block_nums[taken_blocks++] + 1;
+    }
+    if (taken_blocks < count) {
+        while (taken_blocks > 0) {
+            free_block(disk, block_nums[--taken_blocks]);
+        }
+        while (taken_inodes > 0) {
+            free_inode(disk, inode_nums[--taken_inodes]);
+        }
+        return -1;
+    }
+
+    // Nobody can reach the new directories yet: fill them without locks
+    for (int i = 0; i < count; i++) {
+        struct ext2_inode *inode = get_inode(disk, inode_nums[i]);
+        memset(inode->i_block, 0, sizeof(inode->i_block));
+        inode->i_mode = EXT2_S_IFDIR;
+        inode->i_links_count = i < count - 1 ? 3 : 2;
+        inode->i_size = EXT2_BLOCK_SIZE;
+        inode->i_blocks = NUM_BLOCKS;
+        inode->i_dtime = 0;
+        inode->i_block[0] = (unsigned int) block_nums[i];
+
+        unsigned char *block = disk + (size_t) block_nums[i] * EXT2_BLOCK_SIZE;
+        memset(block, 0, EXT2_BLOCK_SIZE);
+        int offset = put_dir_entry(block, 0, inode_nums[i], ".", 0);
+        int parent = i > 0 ? inode_nums[i - 1] : parent_num;
+        if (i == count - 1) {
+            put_dir_entry(block, offset, parent, "..", EXT2_BLOCK_SIZE - offset);
+        } else {
+            int child = put_dir_entry(block, offset, parent, "..", 0);
+            put_dir_entry(block, child, inode_nums[i + 1], names[i + 1], EXT2_BLOCK_SIZE - child);
+        }
+    }
+
+    // Link the chain in last, complete
+    if (add_new_entry(disk, get_inode(disk, parent_num), (unsigned int) inode_nums[0], names[0], 'd') == -1) {
+        for (int i = 0; i < count; i++) {
+            struct ext2_inode *inode = get_inode(disk, inode_nums[i]);
+            inode->i_links_count = 0;
+            inode->i_block[0] = 0;
+            inode->i_blocks = 0;
+            inode->i_size = 0;
+            free_block(disk, block_nums[i]);
+            free_inode(disk, inode_nums[i]);
+        }
+        return -1;
+    }
+
+    // One update of the used directories per group, normally just one group
+    int inodes_per_group = (int) get_superblock_loc(disk)->s_inodes_per_group;
+    for (int i = 0, run = 1; i < count; i++, run++) {
+        if (i == count - 1 || (inode_nums[i + 1] - 1) / inodes_per_group != (inode_nums[i] - 1) / inodes_per_group) {
+            count_used_dirs(disk, inode_nums[i], run);
+            run = 0;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Return 1 if the size bytes at data are all zero. Once the first 16 bytes
+ * are known to be zero, the rest is compared against the data itself, which
+ * lets the vectorized memcmp of the C library do the scan.
+ */
+int is_zero_block(const unsigned char *data, int size) {
+    int head = size < 16 ? size : 16;
+    for (int i = 0; i < head; i++) {
+        if (data[i]) {
+            return 0;
+        }
+    }
+    return size <= 16 || memcmp(data, data + 16, size - 16) == 0;
+}
+
+/*
+ * Write buf into blocks of the target inode. Blocks of buf that are all zero
+ * are left unmapped (a hole) and read back as zeros. Return 0, or -1 if the
+ * disk ran out of blocks.
  */
 int write_into_block(unsigned char *disk, struct ext2_inode *tar_inode, char *buf, int buf_size) {
+    TIMED_SCOPE(PHASE_COPY);
     // Write path into target file
     int block_index = 0;
     int indirect_b = -1;
-    unsigned char *b_bitmap = get_block_bitmap_loc(disk);
+    int inode_num = get_inode_num(disk, tar_inode);
+    int goal = get_inode_goal(disk, tar_inode); // Keep the data next to the inode
     while (block_index * EXT2_BLOCK_SIZE < buf_size) { // While not write all into blocks
+        char *data = &buf[block_index * EXT2_BLOCK_SIZE];
+        int len = buf_size - block_index * EXT2_BLOCK_SIZE;
+        if (len > EXT2_BLOCK_SIZE) {
+            len = EXT2_BLOCK_SIZE;
+        }
+        if (is_zero_block((unsigned char *) data, len)) {
+            STAT_INC(zero_blocks_skipped);
+            block_index++;
+            continue;
+        }
+
         int b_num;
         if (block_index < SINGLE_INDIRECT) {
-            b_num = get_free_block(disk, b_bitmap);
-            tar_inode->i_block[block_index] = (unsigned int) b_num;
+            b_num = get_prealloc_block(disk, inode_num, goal, 0);
+            tar_inode->i_block[block_index] = (unsigned int) (b_num == -1 ? 0 : b_num);
         } else {
-            if (block_index == SINGLE_INDIRECT) { // First time access indirect blocks
-                indirect_b = get_free_block(disk, b_bitmap);
+            if (indirect_b == -1) { // First time access indirect blocks
+                if ((indirect_b = get_prealloc_block(disk, inode_num, goal, 0)) == -1) {
+                    return -1;
+                }
                 tar_inode->i_block[SINGLE_INDIRECT] = (unsigned int) indirect_b;
+                memset(disk + (size_t) indirect_b * EXT2_BLOCK_SIZE, 0, EXT2_BLOCK_SIZE);
                 tar_inode->i_blocks += 2;
+                goal = indirect_b + 1;
             }
-            b_num = get_free_block(disk, b_bitmap);
-            unsigned int *indirect_block = (unsigned int *) (disk + indirect_b * EXT2_BLOCK_SIZE);
-            indirect_block[block_index - SINGLE_INDIRECT] = (unsigned int) b_num;
+            b_num = get_prealloc_block(disk, inode_num, goal, 0);
+            unsigned int *indirect_block = (unsigned int *) (disk + (size_t) indirect_b * EXT2_BLOCK_SIZE);
+            indirect_block[block_index - SINGLE_INDIRECT] = (unsigned int) (b_num == -1 ? 0 : b_num);
         }
-        unsigned char *block = disk + b_num * EXT2_BLOCK_SIZE;
-        strncpy((char *) block, &buf[block_index * EXT2_BLOCK_SIZE], EXT2_BLOCK_SIZE);
+        if (b_num == -1) {
+            return -1;
+        }
+        goal = b_num + 1;
+        unsigned char *block = disk + (size_t) b_num * EXT2_BLOCK_SIZE;
+        memcpy(block, data, len);
+        memset(block + len, 0, EXT2_BLOCK_SIZE - len);
+        STAT_ADD(bytes_copied, len);
         tar_inode->i_blocks += 2;
         block_index++;
     }
     return 0;
 }
 
+/*
+ * Return the block number holding the given logical block of the inode, or
+ * 0 if that block is a hole.
+ */
+int get_file_block(unsigned char *disk, struct ext2_inode *inode, int block_index) {
+    if (block_index < SINGLE_INDIRECT) {
+        return (int) inode->i_block[block_index];
+    }
+    if (block_index >= SINGLE_INDIRECT + EXT2_BLOCK_SIZE / sizeof(unsigned int)
+        || inode->i_block[SINGLE_INDIRECT] == 0) {
+        return 0;
+    }
+    return (int) get_indirect_block_loc(disk, inode)[block_index - SINGLE_INDIRECT];
+}
+
+/*
+ * Read the first buf_size bytes of the file of the given inode into buf,
+ * with zeros for its holes. Return the number of bytes read.
+ */
+int read_from_block(unsigned char *disk, struct ext2_inode *inode, char *buf, int buf_size) {
+    TIMED_SCOPE(PHASE_COPY);
+    if (buf_size > (int) inode->i_size) {
+        buf_size = (int) inode->i_size;
+    }
+    for (int offset = 0; offset < buf_size; offset += EXT2_BLOCK_SIZE) {
+        int len = buf_size - offset < EXT2_BLOCK_SIZE ? buf_size - offset : EXT2_BLOCK_SIZE;
+        int b_num = get_file_block(disk, inode, offset / EXT2_BLOCK_SIZE);
+        if (b_num) {
+            memcpy(buf + offset, disk + (size_t) b_num * EXT2_BLOCK_SIZE, len);
+        } else {
+            memset(buf + offset, 0, len);
+        }
+    }
+    return buf_size;
+}
+
+/*
+ * Point the given logical block of the inode at b_num (0 for a hole),
+ * allocating the indirect block if needed. Return 0, or -1 if the disk
+ * ran out of blocks.
+ */
+static int set_file_block(unsigned char *disk, struct ext2_inode *inode, int inode_num,
+                          int block_index, int b_num) {
+    if (block_index < SINGLE_INDIRECT) {
+        inode->i_block[block_index] = (unsigned int) b_num;
+        return 0;
+    }
+    if (inode->i_block[SINGLE_INDIRECT] == 0) {
+        if (b_num == 0) {
+            return 0;
+        }
+        int indirect_b = get_prealloc_block(disk, inode_num, b_num + 1, 0);
+        if (indirect_b == -1) {
+            return -1;
+        }
+        memset(disk + (size_t) indirect_b * EXT2_BLOCK_SIZE, 0, EXT2_BLOCK_SIZE);
+        inode->i_block[SINGLE_INDIRECT] = (unsigned int) indirect_b;
+        inode->i_blocks += 2;
+    }
+    get_indirect_block_loc(disk, inode)[block_index - SINGLE_INDIRECT] = (unsigned int) b_num;
+    return 0;
+}
+
+/*
+ * Free the indirect block of the inode once it maps nothing.
+ */
+static void drop_empty_indirect(unsigned char *disk, struct ext2_inode *inode) {
+    if (inode->i_block[SINGLE_INDIRECT]
+        && is_zero_block((unsigned char *) get_indirect_block_loc(disk, inode), EXT2_BLOCK_SIZE)) {
+        free_block(disk, inode->i_block[SINGLE_INDIRECT]);
+        inode->i_block[SINGLE_INDIRECT] = 0;
+        inode->i_blocks -= 2;
+    }
+}
+
+/*
+ * Make the file of the target inode hold buf, reusing its block map: only
+ * blocks whose content differs from buf are rewritten, blocks that became
+ * all zero or lie past the new end are freed, and missing blocks are
+ * allocated. Return the number of blocks written, or -1 if the disk ran
+ * out of blocks.
+ */
+int update_into_block(unsigned char *disk, struct ext2_inode *tar_inode, char *buf, int buf_size) {
+    TIMED_SCOPE(PHASE_COPY);
+    int inode_num = get_inode_num(disk, tar_inode);
+    int old_blocks = ((int) tar_inode->i_size + EXT2_BLOCK_SIZE - 1) / EXT2_BLOCK_SIZE;
+    int new_blocks = (buf_size + EXT2_BLOCK_SIZE - 1) / EXT2_BLOCK_SIZE;
+    int max_blocks = SINGLE_INDIRECT + EXT2_BLOCK_SIZE / sizeof(unsigned int);
+    if (old_blocks > max_blocks) {
+        old_blocks = max_blocks;
+    }
+    int goal = get_inode_goal(disk, tar_inode);
+    int written = 0;
+
+    for (int block_index = 0; block_index < old_blocks || block_index < new_blocks; block_index++) {
+        int b_num = get_file_block(disk, tar_inode, block_index);
+        char *data = &buf[block_index * EXT2_BLOCK_SIZE];
+        int len = block_index < new_blocks ? buf_size - block_index * EXT2_BLOCK_SIZE : 0;
+        if (len > EXT2_BLOCK_SIZE) {
+            len = EXT2_BLOCK_SIZE;
+        }
+
+        if (len == 0 || is_zero_block((unsigned char *) data, len)) { // Past the end or a hole
+            if (b_num) {
+                free_block(disk, b_num);
+                set_file_block(disk, tar_inode, inode_num, block_index, 0);
+                tar_inode->i_blocks -= 2;
+            }
+            STAT_INC(zero_blocks_skipped);
+            continue;
+        }
+
+        unsigned char *block;
+        if (b_num) {
+            block = disk + (size_t) b_num * EXT2_BLOCK_SIZE;
+            if (memcmp(block, data, len) == 0 && is_zero_block(block + len, EXT2_BLOCK_SIZE - len)) {
+                STAT_INC(blocks_unchanged);
+                goal = b_num + 1;
+                continue;
+            }
+        } else {
+            if ((b_num = get_prealloc_block(disk, inode_num, goal, 0)) == -1) {
+                return -1;
+            }
+            if (set_file_block(disk, tar_inode, inode_num, block_index, b_num) == -1) {
+                free_block(disk, b_num);
+                return -1;
+            }
+            tar_inode->i_blocks += 2;
+            block = disk + (size_t) b_num * EXT2_BLOCK_SIZE;
+        }
+        goal = b_num + 1;
+        memcpy(block, data, len);
+        memset(block + len, 0, EXT2_BLOCK_SIZE - len);
+        STAT_ADD(bytes_copied, len);
+        written++;
+    }
+
+    drop_empty_indirect(disk, tar_inode);
+    tar_inode->i_size = (unsigned int) buf_size;
+    return written;
+}
+
+/*
+ * Unmap and free the given logical block of the inode if it is mapped.
+ */
+static void free_file_block(unsigned char *disk, struct ext2_inode *inode, int inode_num, int block_index) {
+    int b_num = get_file_block(disk, inode, block_index);
+    if (b_num) {
+        free_block(disk, b_num);
+        set_file_block(disk, inode, inode_num, block_index, 0);
+        inode->i_blocks -= 2;
+    }
+}
+
+int update_file_range(unsigned char *disk, struct ext2_inode *tar_inode, const char *buf, long offset, long size) {
+    TIMED_SCOPE(PHASE_COPY);
+    int inode_num = get_inode_num(disk, tar_inode);
+    int first = (int) (offset / EXT2_BLOCK_SIZE);
+    int end = (int) ((offset + size + EXT2_BLOCK_SIZE - 1) / EXT2_BLOCK_SIZE);
+    int goal = first > 0 ? get_file_block(disk, tar_inode, first - 1) : 0;
+    goal = goal ? goal + 1 : get_inode_goal(disk, tar_inode);
+    unsigned char data[EXT2_BLOCK_SIZE];
+    int written = 0;
+
+    for (int block_index = first; block_index < end; block_index++) {
+        // The part of this block the range covers, merged into its content
+        long start = (long) block_index * EXT2_BLOCK_SIZE;
+        long from = offset > start ? offset - start : 0;
+        long to = offset + size < start + EXT2_BLOCK_SIZE ? offset + size - start : EXT2_BLOCK_SIZE;
+        int b_num = get_file_block(disk, tar_inode, block_index);
+        unsigned char *block = b_num ? disk + (size_t) b_num * EXT2_BLOCK_SIZE : NULL;
+        if (block != NULL && memcmp(block + from, buf + start + from - offset, to - from) == 0) {
+            STAT_INC(blocks_unchanged);
+            goal = b_num + 1;
+            continue;
+        }
+        if (block != NULL) {
+            memcpy(data, block, EXT2_BLOCK_SIZE);
+        } else {
+            memset(data, 0, EXT2_BLOCK_SIZE);
+        }
+        memcpy(data + from, buf + start + from - offset, to - from);
+
+        if (is_zero_block(data, EXT2_BLOCK_SIZE)) { // A hole
+            free_file_block(disk, tar_inode, inode_num, block_index);
+            STAT_INC(zero_blocks_skipped);
+            continue;
+        }
+        if (block == NULL) {
+            if ((b_num = get_prealloc_block(disk, inode_num, goal, 0)) == -1) {
+                return -1;
+            }
+            if (set_file_block(disk, tar_inode, inode_num, block_index, b_num) == -1) {
+                free_block(disk, b_num);
+                return -1;
+            }
+            tar_inode->i_blocks += 2;
+            block = disk + (size_t) b_num * EXT2_BLOCK_SIZE;
+        }
+        goal = b_num + 1;
+        memcpy(block, data, EXT2_BLOCK_SIZE);
+        STAT_ADD(bytes_copied, to - from);
+        written++;
+    }
+
+    drop_empty_indirect(disk, tar_inode);
+    if (offset + size > (long) tar_inode->i_size) {
+        tar_inode->i_size = (unsigned int) (offset + size);
+    }
+    return written;
+}
+
+void truncate_file(unsigned char *disk, struct ext2_inode *tar_inode, long size) {
+    if (size >= (long) tar_inode->i_size) { // The new part is a hole
+        tar_inode->i_size = (unsigned int) size;
+        return;
+    }
+    int inode_num = get_inode_num(disk, tar_inode);
+    int keep = (int) ((size + EXT2_BLOCK_SIZE - 1) / EXT2_BLOCK_SIZE);
+    int old_blocks = ((int) tar_inode->i_size + EXT2_BLOCK_SIZE - 1) / EXT2_BLOCK_SIZE;
+    int max_blocks = SINGLE_INDIRECT + EXT2_BLOCK_SIZE / sizeof(unsigned int);
+    for (int block_index = keep; block_index < old_blocks && block_index < max_blocks; block_index++) {
+        free_file_block(disk, tar_inode, inode_num, block_index);
+    }
+
+    // The rest of the last block reads as zeros if the file grows again
+    int b_num = size % EXT2_BLOCK_SIZE ? get_file_block(disk, tar_inode, keep - 1) : 0;
+    if (b_num) {
+        unsigned char *block = disk + (size_t) b_num * EXT2_BLOCK_SIZE;
+        memset(block + size % EXT2_BLOCK_SIZE, 0, EXT2_BLOCK_SIZE - size % EXT2_BLOCK_SIZE);
+        if (is_zero_block(block, EXT2_BLOCK_SIZE)) {
+            free_file_block(disk, tar_inode, inode_num, keep - 1);
+        }
+    }
+    drop_empty_indirect(disk, tar_inode);
+    tar_inode->i_size = (unsigned int) size;
+}
+
+/*
+ * Return 1 if the inode is a symlink with its target stored inline. Such a
+ * link owns no block, which is how ext2 tells the two kinds apart.
+ */
+int is_fast_symlink(struct ext2_inode *inode) {
+    return (inode->i_mode & EXT2_S_IFMT) == EXT2_S_IFLNK && inode->i_blocks == 0;
+}
+
+/*
+ * The block pointers of a fast symlink hold its target, not block numbers.
+ */
+int owns_blocks(unsigned char *disk, int inode_num) {
+    struct ext2_inode *inode = get_inode(disk, inode_num);
+    int type = inode->i_mode & EXT2_S_IFMT;
+    return inode_in_use(disk, inode_num) && inode->i_links_count > 0
+           && (type == EXT2_S_IFREG || type == EXT2_S_IFDIR
+               || (type == EXT2_S_IFLNK && !is_fast_symlink(inode)));
+}
+
+/*
+ * Store the target path of a new symlink inode. A target shorter than
+ * FAST_SYMLINK_LEN goes into i_block[] itself, which saves the block and
+ * the extra read of following the link. Return 0, or -1 if the disk ran
+ * out of blocks.
+ */
+int write_symlink(unsigned char *disk, struct ext2_inode *link_inode, char *target) {
+    int len = (int) strlen(target);
+    link_inode->i_size = (unsigned int) len;
+    if (len < FAST_SYMLINK_LEN) {
+        memset(link_inode->i_block, 0, sizeof(link_inode->i_block));
+        memcpy(link_inode->i_block, target, len);
+        link_inode->i_blocks = 0;
+        return 0;
+    }
+    return write_into_block(disk, link_inode, target, len);
+}
+
+/*
+ * Return the target path of the symlink inode as a new string.
+ */
+char *read_symlink(unsigned char *disk, struct ext2_inode *link_inode) {
+    char *target = malloc(link_inode->i_size + 1);
+    STAT_INC(heap_allocations);
+    if (is_fast_symlink(link_inode)) {
+        memcpy(target, link_inode->i_block, link_inode->i_size);
+    } else {
+        read_from_block(disk, link_inode, target, (int) link_inode->i_size);
+    }
+    target[link_inode->i_size] = '\0';
+    return target;
+}
+
+double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
@@ -5,15 +5,57 @@
 #define CSC369A3_HELPER_H
 
 #include "ext2.h"
+#include "fs.h"
 
 #define SINGLE_INDIRECT 12
 #define NUM_BLOCKS 2
 
+/* Block numbers in an indirect block */
+#define INDIRECT_ENTRIES (EXT2_BLOCK_SIZE / sizeof(unsigned int))
+
+/* Symlink targets shorter than this are stored inline in i_block[] */
+#define FAST_SYMLINK_LEN 60
+
+/*
+ * Map the whole disk image into memory and return its handle, or exit with a
+ * message if it cannot be opened. With
+ * EXT2_SESSION set the disk is opened as a session (see begin_session), and
+ * with EXT2_DRY_RUN set as a session whose commits are dropped.
+ */
+struct ext2_fs *open_disk(char *disk_name);
+
 /*
- * Return the disk location.
+ * Map the disk image as open_disk() does and return the disk location.
  */
 unsigned char *get_disk_loc(char *disk_name);
 
+/*
+ * Map the whole disk image as a private copy-on-write session and return the
+ * disk location. Changes reach the image file only on commit_session(); if
+ * the process exits or aborts first, the image is left untouched.
+ */
+unsigned char *begin_session(char *disk_name);
+
+/*
+ * Write the pages the session modified back to the image file. The session
+ * stays open. Return the number of bytes written, or -1 on an I/O error.
+ */
+long long commit_session(unsigned char *disk);
+
+/*
+ * Close the session, dropping the changes that were not committed.
+ */
+void abort_session(unsigned char *disk);
+
+/*
+ * End an operation: release unused preallocated blocks and write the changes
+ * made through the mapping back to the disk image, committing the session if
+ * one is open (waits for the writeback only when EXT2_SYNC is set). This is
+ * ext2_sync() for the tools: a failure is printed. Return 0, or the errno
+ * code to exit with.
+ */
+int sync_disk(unsigned char *disk);
+
 /*
  * Return the super block location.
  */
@@ -24,6 +66,11 @@ struct ext2_super_block *get_superblock_loc(unsigned char *disk);
  */
 struct ext2_group_desc *get_group_descriptor_loc(unsigned char *disk);
 
+/*
+ * Return the number of block groups on the disk.
+ */
+int get_groups_count(unsigned char *disk);
+
 /*
  * Return the block bitmap (16*8 bits) location.
  */
@@ -34,11 +81,42 @@ unsigned char *get_block_bitmap_loc(unsigned char *disk);
  */
 unsigned char *get_inode_bitmap_loc(unsigned char *disk);
 
+/*
+ * Return the block bitmap location of the given block group.
+ */
+unsigned char *get_group_block_bitmap_loc(unsigned char *disk, int group);
+
+/*
+ * Return the inode bitmap location of the given block group.
+ */
+unsigned char *get_group_inode_bitmap_loc(unsigned char *disk, int group);
+
 /*
  * Return the inode table location.
  */
 struct ext2_inode *get_inode_table_loc(unsigned char *disk);
 
+/*
+ * Return the inode of the given inode number, whichever group holds it.
+ */
+struct ext2_inode *get_inode(unsigned char *disk, int inode_num);
+
+/*
+ * Return 1 if the given inode number is marked used in its inode bitmap.
+ */
+int inode_in_use(unsigned char *disk, int inode_num);
+
+/*
+ * Return 1 if the given block is marked used in its block bitmap. Blocks
+ * before the first data block belong to no group and are always used.
+ */
+int block_in_use(unsigned char *disk, unsigned int block);
+
+/*
+ * Return the group descriptor of the group holding the given inode.
+ */
+struct ext2_group_desc *get_inode_group_desc(unsigned char *disk, int inode_num);
+
 /*
  * Return the indirect block location.
  */
@@ -87,6 +165,24 @@ struct ext2_inode *get_entry_in_block(unsigned char *disk, char *name, int block
  */
 void zero_bitmap(unsigned char *block, int block_num);
 
+/*
+ * Release the given block in the block bitmap of its group and update the
+ * free blocks counters.
+ */
+void free_block(unsigned char *disk, int block_num);
+
+/*
+ * Release the given inode in the inode bitmap of its group and update the
+ * free inodes counters.
+ */
+void free_inode(unsigned char *disk, int inode_num);
+
+/*
+ * Add n to the directories count of the group of the given inode: 1 for a
+ * directory created, -1 for one removed.
+ */
+void count_used_dirs(unsigned char *disk, int inode_num, int n);
+
 /*
  * Clear all the entries in the blocks of given inode and
  * zero the block bitmap of given inode.
@@ -119,6 +215,17 @@ int remove_name_in_block(unsigned char *disk, char *file_name, int block_num);
  */
 void remove_file_or_link(unsigned char *disk, char *path);
 
+/*
+ * Remove the directory of given path, together with everything inside it.
+ */
+void remove_dir(unsigned char *disk, char *path);
+
+/*
+ * Remove every entry except . and .. in one block of the directory of
+ * given path.
+ */
+void clear_directory_content(unsigned char *disk, int block_num, char *path);
+
 /*
  * Get parent dir of a directory, exclude root dir.
  */
@@ -130,31 +237,218 @@ char *get_dir_parent_path(char *path);
  */
 char *combine_name(char *parent_path, struct ext2_dir_entry_2 *dir_entry);
 
+/* Marks the paths find_paths() should fill in */
+#define PATH_WANTED ((char *) 1)
+
+/*
+ * Walk the tree under the directory of the given path, depth first, and
+ * give every inode whose slot in paths (by inode number - 1) is PATH_WANTED
+ * its path, as a new string. Inodes not found keep PATH_WANTED. The
+ * directories are not locked.
+ */
+void find_paths(unsigned char *disk, struct ext2_inode *dir_inode, char *path, char **paths);
+
 /*
  * Add new entry into the directory.
  */
 int add_new_entry(unsigned char *disk, struct ext2_inode *dir_inode, unsigned int new_inode, char *f_name, char type);
 
+/*
+ * Where dir_append() puts the next entry: right after the last entry of the
+ * last block of the directory.
+ */
+struct dir_append {
+    struct ext2_inode *dir_inode;
+    int dir_num;
+    int block_index;   /* Logical index of the tail block, -1 if there is none */
+    int last_offset;   /* Offset of the last entry in the tail block */
+};
+
+/*
+ * Lock the directory for a batch of appends and find its tail. The lock is
+ * that of the directory's stripe (fs.h), held for writing until
+ * end_dir_append(). Meanwhile the thread may look up any directory,
+ * including those sharing the stripe, but must change this one only
+ * through dir_append(). Other threads wait for the stripe, so two threads
+ * holding cursors must not look up each other's directories.
+ */
+void begin_dir_append(unsigned char *disk, struct ext2_inode *dir_inode, struct dir_append *cursor);
+
+/*
+ * Append an entry at the tail of the directory, or in a new block after it,
+ * without looking at the gaps in front: n appends cost O(n), where n calls
+ * of add_new_entry() cost O(n^2). Return 0, or -1 if the directory has no
+ * room left for a block or the disk is full.
+ */
+int dir_append(unsigned char *disk, struct dir_append *cursor, unsigned int new_inode, char *f_name, char type);
+
+/*
+ * End a batch of appends and unlock the directory.
+ */
+void end_dir_append(unsigned char *disk, struct dir_append *cursor);
+
+/*
+ * Return the FNV-1a hash of a name of the given length.
+ */
+unsigned int name_hash(char *name, int name_len);
+
+/*
+ * Repack the live entries of a directory densely into its first blocks and
+ * free the blocks left empty. If sort is set, the entries after . and ..
+ * are ordered by name hash. Return the number of blocks freed, or -1.
+ */
+int compact_dir(unsigned char *disk, struct ext2_inode *dir_inode, int sort);
+
+/*
+ * Placement policies of new inodes and blocks. First fit takes the lowest
+ * free number. Locality (the default) keeps a file's inode and data in the
+ * group of its parent directory and spreads new top level directories over
+ * the groups with the most room, like the Orlov allocator.
+ */
+#define ALLOC_FIRST_FIT 0
+#define ALLOC_LOCALITY 1
+
+/*
+ * The policy in use, ALLOC_LOCALITY unless EXT2_ALLOC=first is set.
+ */
+extern int alloc_policy;
+
 /*
  * Return the first inode number that is free.
  */
-int get_free_inode(unsigned char *disk, unsigned char *inode_bitmap);
+int get_free_inode(unsigned char *disk);
+
+/*
+ * Return a free inode number for a new inode of the given type ('f', 'd' or
+ * 'l') in the directory of inode number parent_num, chosen by alloc_policy.
+ */
+int get_free_inode_near(unsigned char *disk, int parent_num, char type);
 
 /*
  * Return the first block number that is free.
  */
-int get_free_block(unsigned char *disk, unsigned char *block_bitmap);
+int get_free_block(unsigned char *disk);
+
+/*
+ * Return a free block number as close after the goal block as possible,
+ * or the first free one under the first fit policy.
+ */
+int get_free_block_near(unsigned char *disk, int goal);
+
+/*
+ * Return the block to start the data of the given inode from: the first
+ * block of the group holding it.
+ */
+int get_inode_goal(unsigned char *disk, struct ext2_inode *inode);
+
+/*
+ * Return a free block for the next block of the given inode, out of the run
+ * of blocks preallocated ahead of it (s_prealloc_blocks for a file,
+ * s_prealloc_dir_blocks for a directory). A new run is reserved near the
+ * goal when the inode has none left. Return -1 if the disk is full.
+ */
+int get_prealloc_block(unsigned char *disk, int inode_num, int goal, int is_dir);
+
+/*
+ * Release the unused preallocated blocks of every inode. sync_disk() and
+ * process exit do this on their own.
+ */
+void discard_prealloc(unsigned char *disk);
+
+/*
+ * Return the first block of count contiguous free blocks, all marked as
+ * used, or -1 if no group has such a run.
+ */
+int get_free_run(unsigned char *disk, int count);
+
+/*
+ * Find a new unused inode for an entry of the directory of inode number
+ * parent_num and initialize. Return inode number. Return -1 if could not
+ * find such inode.
+ */
+int init_inode(unsigned char *disk, int parent_num, int size, char type);
 
 /*
- * Find a new unused inode and initialize. Return inode number. Return -1 if
- * could not find such inode.
+ * Create count new directories, the first named names[0] in the directory
+ * of parent_num and each next one inside the one before. Their inodes and
+ * blocks are allocated in one batch and the chain is linked into the parent
+ * only once complete. Return 0, or -1 if the disk ran out of inodes or
+ * blocks, in which case nothing was created.
  */
-int init_inode(unsigned char *disk, int size, char type);
+int make_dir_chain(unsigned char *disk, int parent_num, char **names, int count);
 
 /*
- * Write buf into blocks of the target inode.
+ * Return 1 if the size bytes at data are all zero.
+ */
+int is_zero_block(const unsigned char *data, int size);
+
+/*
+ * Write buf into blocks of the target inode, leaving all-zero blocks as
+ * holes. Return 0, or -1 if the disk ran out of blocks.
  */
 int write_into_block(unsigned char *disk, struct ext2_inode *tar_inode, char *buf, int buf_size);
 
+/*
+ * Return the block number of the given logical block of the inode, or 0 for
+ * a hole.
+ */
+int get_file_block(unsigned char *disk, struct ext2_inode *inode, int block_index);
+
+/*
+ * Read the first buf_size bytes of the file of the given inode into buf,
+ * with zeros for its holes. Return the number of bytes read.
+ */
+int read_from_block(unsigned char *disk, struct ext2_inode *inode, char *buf, int buf_size);
+
+/*
+ * Make the file of the target inode hold buf, rewriting only the blocks that
+ * changed and growing or shrinking its block map. Return the number of
+ * blocks written, or -1 if the disk ran out of blocks.
+ */
+int update_into_block(unsigned char *disk, struct ext2_inode *tar_inode, char *buf, int buf_size);
+
+/*
+ * Write size bytes of buf at offset of the file of the target inode, as
+ * update_into_block() does but only over the blocks the range covers: the
+ * unchanged ones are left alone, the ones that become all zero are freed,
+ * and only the missing ones are allocated. The file grows to cover the
+ * range. Return the number of blocks written, or -1 if the disk ran out of
+ * blocks.
+ */
+int update_file_range(unsigned char *disk, struct ext2_inode *tar_inode, const char *buf, long offset, long size);
+
+/*
+ * Cut the file of the target inode to size bytes, freeing the blocks past
+ * the new end, or extend it with a hole.
+ */
+void truncate_file(unsigned char *disk, struct ext2_inode *tar_inode, long size);
+
+/*
+ * Return 1 if the inode is a symlink with its target stored inline.
+ */
+int is_fast_symlink(struct ext2_inode *inode);
+
+/*
+ * Return 1 if the inode is in use and owns blocks through its block
+ * pointers: a linked regular file, directory or slow symlink.
+ */
+int owns_blocks(unsigned char *disk, int inode_num);
+
+/*
+ * Store the target path of a new symlink inode, inline if it is shorter
+ * than FAST_SYMLINK_LEN. Return 0, or -1 if the disk ran out of blocks.
+ */
+int write_symlink(unsigned char *disk, struct ext2_inode *link_inode, char *target);
+
+/*
+ * Return the target path of the symlink inode as a new string.
+ */
+char *read_symlink(unsigned char *disk, struct ext2_inode *link_inode);
+
+/*
+ * Return the monotonic clock in seconds, for the throughput the tools report.
+ */
+double now_seconds(void);
+
 #endif
 
@@ -0,0 +1,600 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include "ext2.h"
+#include "helper.h"
+#include "libext2.h"
+#include "csum.h"
+#include "timer.h"
+
+#define MAX_FILE_BLOCKS (SINGLE_INDIRECT + EXT2_BLOCK_SIZE / sizeof(unsigned int))
+
+/*
+ * Resolve the parent directory of a path to be created and the name of its
+ * last part, which the caller frees. A trailing '/' is only accepted if
+ * dir is set. Return the parent's inode number, or -EEXIST if the path
+ * exists, -ENOENT if its parent does not, or -ENAMETOOLONG.
+ */
+static int resolve_new(struct ext2_fs *fs, const char *path, int dir, char **name) {
+    if (trace_path((char *) path, fs->disk) != NULL) {
+        return -EEXIST;
+    }
+    if (!dir && path[strlen(path) - 1] == '/') {
+        return -ENOENT;
+    }
+
+    char *parent_path = get_dir_parent_path((char *) path);
+    struct ext2_inode *parent = trace_path(parent_path, fs->disk);
+    free(parent_path);
+    if (parent == NULL || !(parent->i_mode & EXT2_S_IFDIR)) {
+        return -ENOENT;
+    }
+
+    *name = get_file_name((char *) path);
+    if (strlen(*name) > EXT2_NAME_LEN) {
+        free(*name);
+        return -ENAMETOOLONG;
+    }
+    return get_inode_num(fs->disk, parent);
+}
+
+/*
+ * Return 0 if the free blocks and the blocks the file maps already cover a
+ * file of the given size, otherwise -ENOSPC.
+ */
+static int check_space(struct ext2_fs *fs, struct ext2_inode *inode, long size) {
+    long blocks = (size + EXT2_BLOCK_SIZE - 1) / EXT2_BLOCK_SIZE;
+    if (blocks > SINGLE_INDIRECT) {
+        blocks++; // The indirect block
+    }
+    long have = get_superblock_loc(fs->disk)->s_free_blocks_count + inode->i_blocks / NUM_BLOCKS;
+    return blocks > have ? -ENOSPC : 0;
+}
+
+int ext2_sync(struct ext2_fs *fs) {
+    TIMED_SCOPE(PHASE_WRITEBACK);
+    discard_prealloc(fs->disk);
+
+    // A session is not committed on top of a failed block, and its
+    // checksums are only stored once its blocks are in the image
+    int bad = failed_checksums(fs);
+    if (fs->fd >= 0 && (bad > 0 || ext2_commit(fs) < 0)) {
+        return bad > 0 ? -EBADMSG : -EIO;
+    }
+    if (refresh_checksums(fs) < 0) {
+        return -ENOMEM;
+    }
+    if (fs->csum != NULL && getenv("EXT2_SYNC") != NULL && msync(fs->csum, fs->csum_size, MS_SYNC) < 0) {
+        return -EIO;
+    }
+    if (fs->fd < 0 && getenv("EXT2_SYNC") != NULL && msync(fs->disk, fs->size, MS_SYNC) < 0) {
+        return -EIO;
+    }
+    return bad > 0 ? -EBADMSG : 0;
+}
+
+int ext2_lookup(struct ext2_fs *fs, const char *path) {
+    if (path[0] != '/') {
+        return -EINVAL;
+    }
+    struct ext2_inode *inode = trace_path((char *) path, fs->disk);
+    return inode == NULL ? -ENOENT : get_inode_num(fs->disk, inode);
+}
+
+int ext2_stat(struct ext2_fs *fs, const char *path, struct ext2_stat *st) {
+    int inode_num = ext2_lookup(fs, path);
+    if (inode_num < 0) {
+        return inode_num;
+    }
+    struct ext2_inode *inode = get_inode(fs->disk, inode_num);
+    st->inode_num = inode_num;
+    st->mode = inode->i_mode;
+    st->links_count = inode->i_links_count;
+    st->size = inode->i_size;
+    st->blocks = inode->i_blocks;
+    return 0;
+}
+
+int ext2_file_open(struct ext2_fs *fs, const char *path, int flags) {
+    if (path[0] != '/') {
+        return -EINVAL;
+    }
+    struct ext2_inode *inode = trace_path((char *) path, fs->disk);
+    if (inode != NULL) {
+        if ((flags & EXT2_O_CREAT) && (flags & EXT2_O_EXCL)) {
+            return -EEXIST;
+        }
+        if ((inode->i_mode & EXT2_S_IFMT) == EXT2_S_IFDIR) {
+            return -EISDIR;
+        }
+        if ((inode->i_mode & EXT2_S_IFMT) != EXT2_S_IFREG) {
+            return -EINVAL;
+        }
+        int inode_num = get_inode_num(fs->disk, inode);
+        if (flags & EXT2_O_TRUNC) {
+            int ret = ext2_file_truncate(fs, inode_num, 0);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+        return inode_num;
+    }
+    if (!(flags & EXT2_O_CREAT)) {
+        return -ENOENT;
+    }
+
+    char *name;
+    int parent_num = resolve_new(fs, path, 0, &name);
+    if (parent_num < 0) {
+        return parent_num;
+    }
+    int inode_num = init_inode(fs->disk, parent_num, 0, 'f');
+    if (inode_num == -1) {
+        free(name);
+        return -ENOSPC;
+    }
+    if (add_new_entry(fs->disk, get_inode(fs->disk, parent_num), (unsigned int) inode_num, name, 'f') == -1) {
+        free_inode(fs->disk, inode_num);
+        free(name);
+        return -ENOSPC;
+    }
+    free(name);
+    return inode_num;
+}
+
+long ext2_file_read(struct ext2_fs *fs, int inode_num, void *buf, size_t size, long offset) {
+    struct ext2_inode *inode = get_inode(fs->disk, inode_num);
+    if (offset < 0) {
+        return -EINVAL;
+    }
+    if (offset >= inode->i_size) {
+        return 0;
+    }
+    if (size > inode->i_size - offset) {
+        size = inode->i_size - offset;
+    }
+
+    // Block by block; holes read as zeros
+    size_t done = 0;
+    while (done < size) {
+        long pos = offset + (long) done;
+        size_t len = EXT2_BLOCK_SIZE - pos % EXT2_BLOCK_SIZE;
+        if (len > size - done) {
+            len = size - done;
+        }
+        int b_num = get_file_block(fs->disk, inode, (int) (pos / EXT2_BLOCK_SIZE));
+        if (b_num) {
+            memcpy((char *) buf + done, fs->disk + (size_t) b_num * EXT2_BLOCK_SIZE + pos % EXT2_BLOCK_SIZE, len);
+        } else {
+            memset((char *) buf + done, 0, len);
+        }
+        done += len;
+    }
+    return (long) size;
+}
+
+long ext2_file_write(struct ext2_fs *fs, int inode_num, const void *buf, size_t size, long offset) {
+    struct ext2_inode *inode = get_inode(fs->disk, inode_num);
+    if (offset < 0) {
+        return -EINVAL;
+    }
+    if (offset + (long) size > EXT2_MAX_FILE_SIZE) {
+        return -EFBIG;
+    }
+
+    // Only the blocks the range covers are read and written
+    long new_size = offset + (long) size > inode->i_size ? offset + (long) size : inode->i_size;
+    int ret = check_space(fs, inode, new_size);
+    if (ret == 0 && update_file_range(fs->disk, inode, buf, offset, (long) size) == -1) {
+        ret = -ENOSPC;
+    }
+    return ret < 0 ? ret : (long) size;
+}
+
+int ext2_file_truncate(struct ext2_fs *fs, int inode_num, long size) {
+    struct ext2_inode *inode = get_inode(fs->disk, inode_num);
+    if (size < 0) {
+        return -EINVAL;
+    }
+    if (size > EXT2_MAX_FILE_SIZE) {
+        return -EFBIG;
+    }
+    truncate_file(fs->disk, inode, size);
+    return 0;
+}
+
+int ext2_readdir_batch(struct ext2_fs *fs, const char *path, struct ext2_dir_cursor *cursor,
+                       struct ext2_dirent *entries, int max) {
+    int dir_num = ext2_lookup(fs, path);
+    if (dir_num < 0) {
+        return dir_num;
+    }
+    struct ext2_inode *dir_inode = get_inode(fs->disk, dir_num);
+    if ((dir_inode->i_mode & EXT2_S_IFMT) != EXT2_S_IFDIR) {
+        return -ENOTDIR;
+    }
+
+    int n = 0;
+    lock_dir(fs->disk, dir_num, 0);
+    while (cursor->block_index < MAX_FILE_BLOCKS) {
+        int block_num = get_file_block(fs->disk, dir_inode, cursor->block_index);
+        if (block_num == 0) {
+            cursor->block_index++;
+            cursor->offset = 0;
+            continue;
+        }
+
+        // Walk from the start of the block: the entries may have moved
+        // since the cursor was taken, resume at the first one from offset on
+        struct ext2_dir_entry_2 *dir = get_dir_entry(fs->disk, block_num);
+        int curr_pos = 0;
+        while (curr_pos < EXT2_BLOCK_SIZE && dir->rec_len > 0) {
+            if (curr_pos >= cursor->offset && dir->inode != 0) {
+                if (n == max) {
+                    cursor->offset = curr_pos;
+                    unlock_dir(fs->disk, dir_num);
+                    return n;
+                }
+                entries[n].inode_num = (int) dir->inode;
+                entries[n].file_type = dir->file_type;
+                entries[n].name_len = dir->name_len;
+                memcpy(entries[n].name, dir->name, dir->name_len);
+                entries[n].name[dir->name_len] = '\0';
+                n++;
+            }
+            curr_pos = curr_pos + dir->rec_len;
+            dir = (void *) dir + dir->rec_len;
+        }
+        cursor->block_index++;
+        cursor->offset = 0;
+    }
+    unlock_dir(fs->disk, dir_num);
+    return n;
+}
+
+#define READDIR_BATCH 64
+
+int ext2_readdir(struct ext2_fs *fs, const char *path, ext2_readdir_fn fn, void *arg) {
+    struct ext2_dirent entries[READDIR_BATCH];
+    struct ext2_dir_cursor cursor = EXT2_DIR_CURSOR_INIT;
+    int n;
+    while ((n = ext2_readdir_batch(fs, path, &cursor, entries, READDIR_BATCH)) > 0) {
+        for (int i = 0; i < n; i++) {
+            int ret = fn(&entries[i], arg);
+            if (ret != 0) {
+                return ret;
+            }
+        }
+    }
+    return n;
+}
+
+static int compare_dirents(const void *a, const void *b) {
+    return strcmp(((const struct ext2_dirent *) a)->name, ((const struct ext2_dirent *) b)->name);
+}
+
+/*
+ * Write a sorted batch of entries to a new temporary file as one run of the
+ * merge: the inode number, type and name length of each entry, then its
+ * name. Return the file rewound, or NULL.
+ */
+static FILE *write_run(const struct ext2_dirent *entries, int n) {
+    FILE *run = tmpfile();
+    if (run == NULL) {
+        return NULL;
+    }
+    for (int i = 0; i < n; i++) {
+        if (fwrite(&entries[i], offsetof(struct ext2_dirent, name), 1, run) != 1
+            || fwrite(entries[i].name, 1, entries[i].name_len, run) != entries[i].name_len) {
+            fclose(run);
+            return NULL;
+        }
+    }
+    rewind(run);
+    return run;
+}
+
+/*
+ * Read the next entry of a run. Return 1, or 0 at its end.
+ */
+static int read_run(FILE *run, struct ext2_dirent *entry) {
+    if (fread(entry, offsetof(struct ext2_dirent, name), 1, run) != 1
+        || fread(entry->name, 1, entry->name_len, run) != entry->name_len) {
+        return 0;
+    }
+    entry->name[entry->name_len] = '\0';
+    return 1;
+}
+
+/*
+ * Restore the order of a min-heap of runs, keyed by the name of their head
+ * entry, from slot i down.
+ */
+static void sift_down(int *heap, int size, struct ext2_dirent *heads, int i) {
+    while (2 * i + 1 < size) {
+        int child = 2 * i + 1;
+        if (child + 1 < size && strcmp(heads[heap[child + 1]].name, heads[heap[child]].name) < 0) {
+            child++;
+        }
+        if (strcmp(heads[heap[i]].name, heads[heap[child]].name) <= 0) {
+            break;
+        }
+        int swap = heap[i];
+        heap[i] = heap[child];
+        heap[child] = swap;
+        i = child;
+    }
+}
+
+int ext2_readdir_sorted(struct ext2_fs *fs, const char *path, int batch, ext2_readdir_fn fn, void *arg) {
+    if (batch <= 0) {
+        return -EINVAL;
+    }
+    struct ext2_dirent *entries = malloc(sizeof(struct ext2_dirent) * batch);
+    FILE **runs = NULL;
+    int runs_count = 0;
+    int ret = 0;
+    if (entries == NULL) {
+        return -ENOMEM;
+    }
+
+    // Sort the directory batch by batch into runs
+    struct ext2_dir_cursor cursor = EXT2_DIR_CURSOR_INIT;
+    int n;
+    while ((n = ext2_readdir_batch(fs, path, &cursor, entries, batch)) > 0) {
+        qsort(entries, n, sizeof(struct ext2_dirent), compare_dirents);
+        if (runs_count == 0 && n < batch) { // The whole directory fit in one batch
+            for (int i = 0; i < n && ret == 0; i++) {
+                ret = fn(&entries[i], arg);
+            }
+            free(entries);
+            return ret;
+        }
+        FILE **more = realloc(runs, sizeof(FILE *) * (runs_count + 1));
+        if (more == NULL || (more[runs_count] = write_run(entries, n)) == NULL) {
+            runs = more != NULL ? more : runs;
+            n = more == NULL ? -ENOMEM : -EIO;
+            break;
+        }
+        runs = more;
+        runs_count++;
+    }
+    free(entries);
+
+    // Merge the runs, holding only the head entry of each
+    struct ext2_dirent *heads = malloc(sizeof(struct ext2_dirent) * (runs_count + 1));
+    int *heap = malloc(sizeof(int) * (runs_count + 1));
+    if (n < 0 || heads == NULL || heap == NULL) {
+        ret = n < 0 ? n : -ENOMEM;
+    } else {
+        int size = 0;
+        for (int r = 0; r < runs_count; r++) {
+            if (read_run(runs[r], &heads[r])) {
+                heap[size++] = r;
+            }
+        }
+        for (int i = size / 2 - 1; i >= 0; i--) {
+            sift_down(heap, size, heads, i);
+        }
+        while (size > 0 && ret == 0) {
+            int r = heap[0];
+            ret = fn(&heads[r], arg);
+            if (!read_run(runs[r], &heads[r])) {
+                heap[0] = heap[--size];
+            }
+            sift_down(heap, size, heads, 0);
+        }
+    }
+
+    for (int r = 0; r < runs_count; r++) {
+        fclose(runs[r]);
+    }
+    free(runs);
+    free(heads);
+    free(heap);
+    return ret;
+}
+
+int ext2_mkdir(struct ext2_fs *fs, const char *path) {
+    if (path[0] != '/') {
+        return -EINVAL;
+    }
+    char *name;
+    int parent_num = resolve_new(fs, path, 1, &name);
+    if (parent_num < 0) {
+        return parent_num;
+    }
+    // A block for the new directory and maybe one for its parent to grow
+    if (get_superblock_loc(fs->disk)->s_free_blocks_count < 2) {
+        free(name);
+        return -ENOSPC;
+    }
+    int inode_num = init_inode(fs->disk, parent_num, 0, 'd');
+    if (inode_num == -1) {
+        free(name);
+        return -ENOSPC;
+    }
+
+    // Fill the directory before it is linked into its parent
+    struct ext2_inode *inode = get_inode(fs->disk, inode_num);
+    if (add_new_entry(fs->disk, inode, (unsigned int) inode_num, ".", 'd') == -1
+        || add_new_entry(fs->disk, inode, (unsigned int) parent_num, "..", 'd') == -1
+        || add_new_entry(fs->disk, get_inode(fs->disk, parent_num), (unsigned int) inode_num, name, 'd') == -1) {
+        if (inode->i_block[0]) {
+            free_block(fs->disk, (int) inode->i_block[0]);
+        }
+        memset(inode->i_block, 0, sizeof(inode->i_block));
+        inode->i_links_count = 0;
+        free_inode(fs->disk, inode_num);
+        free(name);
+        return -ENOSPC;
+    }
+    count_used_dirs(fs->disk, inode_num, 1);
+    free(name);
+    return 0;
+}
+
+int ext2_mkdir_p(struct ext2_fs *fs, const char *path) {
+    if (path[0] != '/') {
+        return -EINVAL;
+    }
+    char *full_path = strdup(path);
+    char **names = malloc(sizeof(char *) * (strlen(path) / 2 + 1));
+    if (full_path == NULL || names == NULL) {
+        free(full_path);
+        free(names);
+        return -ENOMEM;
+    }
+
+    // One walk down from the root, as far as the directories exist
+    struct ext2_inode *dir_inode = get_inode(fs->disk, EXT2_ROOT_INO);
+    int count = 0;
+    int ret = 0;
+    char *save = NULL;
+    for (char *token = strtok_r(full_path, "/", &save); token != NULL && ret == 0;
+         token = strtok_r(NULL, "/", &save)) {
+        if (strlen(token) > EXT2_NAME_LEN) {
+            ret = -ENAMETOOLONG;
+        } else if (count > 0) { // Below a missing directory
+            names[count++] = token;
+        } else {
+            struct ext2_inode *next = get_entry_with_name(fs->disk, token, dir_inode);
+            if (next == NULL) {
+                names[count++] = token;
+            } else if (!(next->i_mode & EXT2_S_IFDIR)) {
+                ret = -ENOTDIR;
+            } else {
+                dir_inode = next;
+            }
+        }
+    }
+
+    if (ret == 0 && count > 0) {
+        struct ext2_super_block *sb = get_superblock_loc(fs->disk);
+        if (sb->s_free_inodes_count < count || sb->s_free_blocks_count < count + 1) {
+            ret = -ENOSPC;
+        } else if (make_dir_chain(fs->disk, get_inode_num(fs->disk, dir_inode), names, count) == -1) {
+            ret = -ENOSPC;
+        }
+    }
+    free(names);
+    free(full_path);
+    return ret;
+}
+
+int ext2_unlink(struct ext2_fs *fs, const char *path) {
+    int inode_num = ext2_lookup(fs, path);
+    if (inode_num < 0) {
+        return inode_num;
+    }
+    if (get_inode(fs->disk, inode_num)->i_mode & EXT2_S_IFDIR) {
+        return -EISDIR;
+    }
+    remove_file_or_link(fs->disk, (char *) path);
+    return 0;
+}
+
+int ext2_rmtree(struct ext2_fs *fs, const char *path) {
+    int inode_num = ext2_lookup(fs, path);
+    if (inode_num < 0) {
+        return inode_num;
+    }
+    if (inode_num == EXT2_ROOT_INO) {
+        return -EBUSY;
+    }
+    if (!(get_inode(fs->disk, inode_num)->i_mode & EXT2_S_IFDIR)) {
+        return -ENOTDIR;
+    }
+    remove_dir(fs->disk, (char *) path);
+    return 0;
+}
+
+int ext2_link(struct ext2_fs *fs, const char *old_path, const char *new_path) {
+    int inode_num = ext2_lookup(fs, old_path);
+    if (inode_num < 0) {
+        return inode_num;
+    }
+    if (new_path[0] != '/') {
+        return -EINVAL;
+    }
+    struct ext2_inode *inode = get_inode(fs->disk, inode_num);
+    if (inode->i_mode & EXT2_S_IFDIR) {
+        return -EISDIR;
+    }
+
+    char *name;
+    int parent_num = resolve_new(fs, new_path, 0, &name);
+    if (parent_num < 0) {
+        return parent_num;
+    }
+    char type = (inode->i_mode & EXT2_S_IFMT) == EXT2_S_IFLNK ? 'l' : 'f';
+    int ret = add_new_entry(fs->disk, get_inode(fs->disk, parent_num), (unsigned int) inode_num, name, type);
+    free(name);
+    if (ret == -1) {
+        return -ENOSPC;
+    }
+    inode->i_links_count++;
+    return 0;
+}
+
+int ext2_symlink(struct ext2_fs *fs, const char *target, const char *link_path) {
+    if (link_path[0] != '/') {
+        return -EINVAL;
+    }
+    int len = (int) strlen(target);
+    if (len == 0) {
+        return -ENOENT;
+    }
+    if (len > EXT2_MAX_FILE_SIZE) {
+        return -ENAMETOOLONG;
+    }
+
+    char *name;
+    int parent_num = resolve_new(fs, link_path, 0, &name);
+    if (parent_num < 0) {
+        return parent_num;
+    }
+    int inode_num = init_inode(fs->disk, parent_num, len, 'l');
+    if (inode_num == -1) {
+        free(name);
+        return -ENOSPC;
+    }
+    struct ext2_inode *inode = get_inode(fs->disk, inode_num);
+    if ((len >= FAST_SYMLINK_LEN && check_space(fs, inode, len) < 0)
+        || write_symlink(fs->disk, inode, (char *) target) == -1
+        || add_new_entry(fs->disk, get_inode(fs->disk, parent_num), (unsigned int) inode_num, name, 'l') == -1) {
+        if (!is_fast_symlink(inode)) {
+            truncate_file(fs->disk, inode, 0);
+        }
+        memset(inode->i_block, 0, sizeof(inode->i_block));
+        inode->i_links_count = 0;
+        free_inode(fs->disk, inode_num);
+        free(name);
+        return -ENOSPC;
+    }
+    free(name);
+    return 0;
+}
+
+int ext2_readlink(struct ext2_fs *fs, const char *path, char *buf, size_t size) {
+    int inode_num = ext2_lookup(fs, path);
+    if (inode_num < 0) {
+        return inode_num;
+    }
+    struct ext2_inode *inode = get_inode(fs->disk, inode_num);
+    if ((inode->i_mode & EXT2_S_IFMT) != EXT2_S_IFLNK) {
+        return -EINVAL;
+    }
+    char *target = read_symlink(fs->disk, inode);
+    if (size > 0) {
+        size_t len = strlen(target) < size - 1 ? strlen(target) : size - 1;
+        memcpy(buf, target, len);
+        buf[len] = '\0';
+    }
+    int len = (int) strlen(target);
+    free(target);
+    return len;
+}
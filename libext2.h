@@ -0,0 +1,169 @@
+#ifndef CSC369A3_LIBEXT2_H
+#define CSC369A3_LIBEXT2_H
+
+#include "fs.h"
+
+/*
+ * The embeddable interface of the tools, built as libext2.a and libext2.so.
+ * An image is opened with ext2_open() and closed with ext2_close() (fs.h);
+ * every call below takes the handle and an absolute path on the image.
+ * Nothing here prints or exits: functions return a non-negative value on
+ * success and a negated errno code on failure, e.g. -ENOENT. The
+ * EXT2_STATS, EXT2_TIMING, EXT2_TRACE and EXT2_RECORD variables only act
+ * on the tools; a host opts in with init_stats(), init_timers() and
+ * init_record() (stats.h, timer.h, record.h).
+ *
+ * Changes go to the mapping right away; ext2_sync() ends a batch of them
+ * (and commits it when the image was opened as a session). The calls are
+ * safe to make from several threads on one handle, as long as no two of
+ * them change the same file at once.
+ */
+
+/* Flags of ext2_file_open() */
+#define EXT2_O_CREAT 1  /* Create a regular file if the path does not exist */
+#define EXT2_O_EXCL  2  /* With EXT2_O_CREAT, fail with -EEXIST if it does */
+#define EXT2_O_TRUNC 4  /* Cut an existing file to size 0 */
+
+/* Largest file the single indirect block can map */
+#define EXT2_MAX_FILE_SIZE ((12 + 1024 / 4) * 1024)
+
+struct ext2_stat {
+    int inode_num;
+    unsigned short mode;         /* EXT2_S_IF* type bits and permissions */
+    unsigned short links_count;
+    unsigned int size;
+    unsigned int blocks;         /* 512-byte sectors, as i_blocks */
+};
+
+struct ext2_dirent {
+    int inode_num;
+    unsigned char file_type;     /* EXT2_FT_* */
+    unsigned char name_len;
+    char name[256];              /* NUL terminated */
+};
+
+/*
+ * Called by ext2_readdir() for every entry; a non-zero return stops the
+ * walk and is returned by ext2_readdir(). The directory is not locked while
+ * the callback runs.
+ */
+typedef int (*ext2_readdir_fn)(const struct ext2_dirent *entry, void *arg);
+
+/*
+ * Release the unused preallocated blocks and write the changes back: commit
+ * a session, or wait for the writeback when EXT2_SYNC is set. Return 0,
+ * -EIO, -ENOMEM, or -EBADMSG if a metadata block the batch used failed its
+ * checksum (csum.h): a session is then left uncommitted, and on a shared
+ * mapping the block keeps its old checksum for ext2_scrub to report.
+ */
+int ext2_sync(struct ext2_fs *fs);
+
+/*
+ * Return the inode number of the path, or -ENOENT.
+ */
+int ext2_lookup(struct ext2_fs *fs, const char *path);
+
+/*
+ * Fill st with the attributes of the path. Return 0 or -ENOENT.
+ */
+int ext2_stat(struct ext2_fs *fs, const char *path, struct ext2_stat *st);
+
+/*
+ * Open the regular file at path, creating it as the flags say. Return its
+ * inode number, which identifies the file to ext2_file_read/write/truncate.
+ */
+int ext2_file_open(struct ext2_fs *fs, const char *path, int flags);
+
+/*
+ * Read up to size bytes at offset of the file. Return the number of bytes
+ * read, 0 at the end of the file.
+ */
+long ext2_file_read(struct ext2_fs *fs, int inode_num, void *buf, size_t size, long offset);
+
+/*
+ * Write size bytes at offset of the file, growing it as needed. Blocks
+ * whose content does not change are not rewritten, and all-zero blocks stay
+ * holes. Return size, -EFBIG past EXT2_MAX_FILE_SIZE or -ENOSPC.
+ */
+long ext2_file_write(struct ext2_fs *fs, int inode_num, const void *buf, size_t size, long offset);
+
+/*
+ * Cut or extend (with a hole) the file to size bytes. Return 0 or -EFBIG.
+ */
+int ext2_file_truncate(struct ext2_fs *fs, int inode_num, long size);
+
+/*
+ * Where ext2_readdir_batch() resumes: a block of the directory and a byte
+ * offset in it. Callers only initialise it with EXT2_DIR_CURSOR_INIT and
+ * pass it back.
+ */
+struct ext2_dir_cursor {
+    int block_index;
+    int offset;
+};
+
+#define EXT2_DIR_CURSOR_INIT {0, 0}
+
+/*
+ * Fill entries with up to max entries of the directory at path, from the
+ * cursor on, and move the cursor past them. The directory is only locked
+ * during the call. Entries added or removed between calls may or may not be
+ * seen. The others are returned exactly once, unless the directory is
+ * compacted in between. Return the number of entries,
+ * 0 once the whole directory was read.
+ */
+int ext2_readdir_batch(struct ext2_fs *fs, const char *path, struct ext2_dir_cursor *cursor,
+                       struct ext2_dirent *entries, int max);
+
+/*
+ * Call fn for every entry of the directory at path, . and .. included.
+ */
+int ext2_readdir(struct ext2_fs *fs, const char *path, ext2_readdir_fn fn, void *arg);
+
+/*
+ * Call fn for every entry of the directory at path in name order. At most
+ * batch entries are held in memory: each batch is sorted into a temporary
+ * file and the files are merged. Return 0, what fn stopped with, -ENOMEM
+ * or -EIO.
+ */
+int ext2_readdir_sorted(struct ext2_fs *fs, const char *path, int batch, ext2_readdir_fn fn, void *arg);
+
+/*
+ * Create the directory at path; its parent must exist.
+ */
+int ext2_mkdir(struct ext2_fs *fs, const char *path);
+
+/*
+ * Create the directory at path and every missing directory above it, with
+ * a single walk of the path. Return 0 also if it exists already, or
+ * -ENOTDIR if a part of the path is not a directory.
+ */
+int ext2_mkdir_p(struct ext2_fs *fs, const char *path);
+
+/*
+ * Remove the file or symbolic link at path (-EISDIR for a directory).
+ */
+int ext2_unlink(struct ext2_fs *fs, const char *path);
+
+/*
+ * Remove the directory at path together with everything inside it.
+ */
+int ext2_rmtree(struct ext2_fs *fs, const char *path);
+
+/*
+ * Create new_path as a hard link to the file at old_path.
+ */
+int ext2_link(struct ext2_fs *fs, const char *old_path, const char *new_path);
+
+/*
+ * Create link_path as a symbolic link holding target.
+ */
+int ext2_symlink(struct ext2_fs *fs, const char *target, const char *link_path);
+
+/*
+ * Copy the target of the symbolic link at path into buf, NUL terminated and
+ * cut to size - 1 bytes. Return the length of the whole target.
+ */
+int ext2_readlink(struct ext2_fs *fs, const char *path, char *buf, size_t size);
+
+#endif
@@ -0,0 +1,344 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <time.h>
+#include "ext2.h"
+#include "mkfs.h"
+#include "csum.h"
+
+#define MKFS_INODE_SIZE 128
+#define MKFS_BYTES_PER_INODE 16384
+#define MKFS_MIN_INODES_PER_GROUP 16
+
+/*
+ * Return 1 if the group carries a backup of the super block and group
+ * descriptors: with sparse_super only groups 0, 1 and powers of 3, 5, 7 do.
+ */
+int group_has_super(unsigned int group) {
+    if (group <= 1) {
+        return 1;
+    }
+    int bases[] = {3, 5, 7};
+    for (int i = 0; i < 3; i++) {
+        unsigned long long power = bases[i];
+        while (power < group) {
+            power *= bases[i];
+        }
+        if (power == group) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Set the bits [from, to) of a bitmap.
+ */
+static void set_bits(unsigned char *bitmap, unsigned int from, unsigned int to) {
+    while (from < to && from % 8 != 0) {
+        bitmap[from / 8] |= 1 << (from % 8);
+        from++;
+    }
+    if (to - from >= 8) {
+        memset(&bitmap[from / 8], 0xFF, (to - from) / 8);
+        from += (to - from) / 8 * 8;
+    }
+    while (from < to) {
+        bitmap[from / 8] |= 1 << (from % 8);
+        from++;
+    }
+}
+
+/*
+ * Write the whole buffer at the given offset of fd.
+ */
+static int write_at(int fd, void *buf, size_t len, off_t offset) {
+    while (len > 0) {
+        ssize_t done = pwrite(fd, buf, len, offset);
+        if (done < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf = (char *) buf + done;
+        len -= done;
+        offset += done;
+    }
+    return 0;
+}
+
+/*
+ * Write a directory entry at the given offset of a directory block.
+ */
+static void put_entry(unsigned char *block, int offset, int inode, int rec_len, char *name) {
+    struct ext2_dir_entry_2 *dir = (struct ext2_dir_entry_2 *) (block + offset);
+    dir->inode = (unsigned int) inode;
+    dir->rec_len = (unsigned short) rec_len;
+    dir->name_len = (unsigned char) strlen(name);
+    dir->file_type = EXT2_FT_DIR;
+    memcpy(dir->name, name, dir->name_len);
+}
+
+/*
+ * Write a new empty ext2 file system (root and lost+found) of the given
+ * geometry into the image file at path, creating or truncating it. Only
+ * the metadata blocks are written; the inode tables and data blocks stay
+ * holes. Return 0 on success, otherwise -1 with errno set.
+ */
+int format_image(char *path, struct mkfs_params *params) {
+    struct mkfs_params p = *params;
+
+    if (p.block_size == 0) {
+        p.block_size = 1024;
+    }
+    if (p.block_size != 1024 && p.block_size != 2048 && p.block_size != 4096) {
+        errno = EINVAL;
+        return -1;
+    }
+    unsigned int bs = p.block_size;
+    unsigned int first_data = (bs == 1024) ? 1 : 0;
+
+    if (p.blocks_per_group == 0) {
+        p.blocks_per_group = 8 * bs;
+    }
+    unsigned int bpg = p.blocks_per_group;
+    if (bpg > 8 * bs || bpg < 256 || bpg % 8 != 0 || p.blocks_count <= first_data) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    unsigned int blocks = p.blocks_count;
+    unsigned int groups = (blocks - first_data + bpg - 1) / bpg;
+
+    // Inodes are spread evenly and every group's inode table fills whole blocks
+    unsigned int inodes_per_block = bs / MKFS_INODE_SIZE;
+    unsigned int ipg = p.inodes_per_group;
+    if (ipg == 0) {
+        unsigned long long inodes = p.inodes_count;
+        if (inodes == 0) {
+            inodes = (unsigned long long) blocks * bs / MKFS_BYTES_PER_INODE;
+        }
+        ipg = (unsigned int) ((inodes + groups - 1) / groups);
+    }
+    if (ipg < MKFS_MIN_INODES_PER_GROUP) {
+        ipg = MKFS_MIN_INODES_PER_GROUP;
+    }
+    ipg = (ipg + inodes_per_block - 1) / inodes_per_block * inodes_per_block;
+    if (ipg > 8 * bs || ipg > 0xFFFF) {
+        errno = EINVAL;
+        return -1;
+    }
+    unsigned int table_blocks = ipg / inodes_per_block;
+    unsigned int gdt_blocks = (groups * sizeof(struct ext2_group_desc) + bs - 1) / bs;
+
+    // Drop a last group too short to hold its own metadata and some data
+    unsigned int tail = blocks - first_data - (groups - 1) * bpg;
+    unsigned int tail_overhead = (group_has_super(groups - 1) ? 1 + gdt_blocks : 0) + 2 + table_blocks;
+    if (groups > 1 && tail < tail_overhead + MKFS_MIN_TAIL_DATA_BLOCKS) {
+        groups--;
+        blocks = first_data + groups * bpg;
+        gdt_blocks = (groups * sizeof(struct ext2_group_desc) + bs - 1) / bs;
+    }
+
+    // Group 0 also holds the root directory and lost+found blocks
+    unsigned int group0_blocks = (groups == 1) ? blocks - first_data : bpg;
+    if (group0_blocks < 1 + gdt_blocks + 2 + table_blocks + 2) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct ext2_group_desc *gdt = calloc(gdt_blocks, bs);
+    unsigned char *bitmaps = malloc(2 * bs);
+    unsigned char *dir_block = calloc(1, bs);
+    struct ext2_super_block *sb = calloc(1, sizeof(struct ext2_super_block));
+    if (gdt == NULL || bitmaps == NULL || dir_block == NULL || sb == NULL) {
+        free(gdt);
+        free(bitmaps);
+        free(dir_block);
+        free(sb);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    // Remember whether the file is new, to remove it again on failure
+    int fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0644);
+    int created = fd >= 0;
+    if (fd < 0 && errno == EEXIST) {
+        fd = open(path, O_RDWR | O_TRUNC);
+    }
+    if (fd < 0) {
+        goto fail;
+    }
+
+    // Size the image in one go: reserve the space, but never write the zeros
+    off_t size = (off_t) blocks * bs;
+    if (ftruncate(fd, size) < 0) {
+        goto fail;
+    }
+    if (!p.sparse && fallocate(fd, 0, 0, size) < 0 && errno != EOPNOTSUPP) {
+        goto fail;
+    }
+
+    unsigned int root_block = 0;
+    unsigned long long free_blocks = 0;
+    for (unsigned int g = 0; g < groups; g++) {
+        unsigned int start = first_data + g * bpg;
+        unsigned int count = (g == groups - 1) ? blocks - start : bpg;
+        unsigned int pos = start + (group_has_super(g) ? 1 + gdt_blocks : 0);
+
+        gdt[g].bg_block_bitmap = pos;
+        gdt[g].bg_inode_bitmap = pos + 1;
+        gdt[g].bg_inode_table = pos + 2;
+        unsigned int used = pos + 2 + table_blocks - start;
+        gdt[g].bg_free_inodes_count = (unsigned short) ipg;
+        if (g == 0) {
+            root_block = start + used;
+            used += 2;
+            gdt[g].bg_free_inodes_count -= EXT2_GOOD_OLD_FIRST_INO;
+            gdt[g].bg_used_dirs_count = 2;
+        }
+        gdt[g].bg_free_blocks_count = (unsigned short) (count - used);
+        free_blocks += count - used;
+
+        // Both bitmaps are adjacent, so write them with a single call
+        memset(bitmaps, 0, 2 * bs);
+        set_bits(bitmaps, 0, used);
+        set_bits(bitmaps, count, 8 * bs);
+        if (g == 0) {
+            set_bits(bitmaps + bs, 0, EXT2_GOOD_OLD_FIRST_INO);
+        }
+        set_bits(bitmaps + bs, ipg, 8 * bs);
+        if (write_at(fd, bitmaps, 2 * bs, (off_t) pos * bs) < 0) {
+            goto fail;
+        }
+    }
+
+    unsigned int now = (unsigned int) time(NULL);
+    sb->s_inodes_count = ipg * groups;
+    sb->s_blocks_count = blocks;
+    sb->s_free_blocks_count = (unsigned int) free_blocks;
+    sb->s_free_inodes_count = ipg * groups - EXT2_GOOD_OLD_FIRST_INO;
+    sb->s_first_data_block = first_data;
+    sb->s_log_block_size = (bs == 1024) ? 0 : (bs == 2048) ? 1 : 2;
+    sb->s_log_frag_size = sb->s_log_block_size;
+    sb->s_blocks_per_group = bpg;
+    sb->s_frags_per_group = bpg;
+    sb->s_inodes_per_group = ipg;
+    sb->s_wtime = now;
+    sb->s_lastcheck = now;
+    sb->s_max_mnt_count = 0xFFFF;
+    sb->s_magic = EXT2_SUPER_MAGIC;
+    sb->s_state = 1;  /* Cleanly unmounted */
+    sb->s_errors = 1; /* Continue on errors */
+    sb->s_rev_level = 1;
+    sb->s_first_ino = EXT2_GOOD_OLD_FIRST_INO;
+    sb->s_inode_size = MKFS_INODE_SIZE;
+    sb->s_feature_incompat = EXT2_FEATURE_INCOMPAT_FILETYPE;
+    sb->s_feature_ro_compat = EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER;
+    if (p.label != NULL) {
+        strncpy(sb->s_volume_name, p.label, sizeof(sb->s_volume_name));
+    }
+    int random_fd = open("/dev/urandom", O_RDONLY);
+    if (random_fd < 0 || read(random_fd, sb->s_uuid, sizeof(sb->s_uuid)) != sizeof(sb->s_uuid)) {
+        srand(now ^ getpid());
+        for (int i = 0; i < sizeof(sb->s_uuid); i++) {
+            sb->s_uuid[i] = (unsigned char) rand();
+        }
+    }
+    if (random_fd >= 0) {
+        close(random_fd);
+    }
+
+    // Primary and backup copies of the super block and group descriptors
+    for (unsigned int g = 0; g < groups; g++) {
+        if (!group_has_super(g)) {
+            continue;
+        }
+        unsigned int start = first_data + g * bpg;
+        sb->s_block_group_nr = (unsigned short) g;
+        off_t sb_offset = (g == 0) ? 1024 : (off_t) start * bs;
+        if (write_at(fd, sb, sizeof(struct ext2_super_block), sb_offset) < 0
+            || write_at(fd, gdt, (size_t) gdt_blocks * bs, (off_t) (start + 1) * bs) < 0) {
+            goto fail;
+        }
+    }
+
+    // Root directory and lost+found, in the first data blocks of group 0
+    struct ext2_inode dir_inode;
+    off_t table = (off_t) gdt[0].bg_inode_table * bs;
+
+    memset(dir_block, 0, bs);
+    put_entry(dir_block, 0, EXT2_ROOT_INO, 12, ".");
+    put_entry(dir_block, 12, EXT2_ROOT_INO, 12, "..");
+    put_entry(dir_block, 24, EXT2_GOOD_OLD_FIRST_INO, bs - 24, "lost+found");
+    memset(&dir_inode, 0, sizeof(dir_inode));
+    dir_inode.i_mode = EXT2_S_IFDIR | 0755;
+    dir_inode.i_size = bs;
+    dir_inode.i_atime = dir_inode.i_ctime = dir_inode.i_mtime = now;
+    dir_inode.i_links_count = 3;
+    dir_inode.i_blocks = bs / 512;
+    dir_inode.i_block[0] = root_block;
+    if (write_at(fd, dir_block, bs, (off_t) root_block * bs) < 0
+        || write_at(fd, &dir_inode, sizeof(dir_inode),
+                    table + (EXT2_ROOT_INO - 1) * MKFS_INODE_SIZE) < 0) {
+        goto fail;
+    }
+
+    memset(dir_block, 0, bs);
+    put_entry(dir_block, 0, EXT2_GOOD_OLD_FIRST_INO, 12, ".");
+    put_entry(dir_block, 12, EXT2_ROOT_INO, bs - 12, "..");
+    dir_inode.i_mode = EXT2_S_IFDIR | 0700;
+    dir_inode.i_links_count = 2;
+    dir_inode.i_block[0] = root_block + 1;
+    if (write_at(fd, dir_block, bs, (off_t) (root_block + 1) * bs) < 0
+        || write_at(fd, &dir_inode, sizeof(dir_inode),
+                    table + (EXT2_GOOD_OLD_FIRST_INO - 1) * MKFS_INODE_SIZE) < 0) {
+        goto fail;
+    }
+
+    if (close(fd) < 0) {
+        fd = -1;
+        goto fail;
+    }
+
+    // Checksums of an earlier file system in the image no longer apply
+    char *csum_path = malloc(strlen(path) + sizeof(CSUM_SUFFIX));
+    if (csum_path != NULL) {
+        sprintf(csum_path, "%s%s", path, CSUM_SUFFIX);
+        unlink(csum_path);
+        free(csum_path);
+    }
+
+    free(gdt);
+    free(bitmaps);
+    free(dir_block);
+    free(sb);
+    return 0;
+
+fail:
+    {
+        int saved = errno;
+        // Do not leave a partly allocated image of the full size behind
+        if (created) {
+            unlink(path);
+        } else if (fd >= 0) {
+            ftruncate(fd, 0);
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+        free(gdt);
+        free(bitmaps);
+        free(dir_block);
+        free(sb);
+        errno = saved;
+    }
+    return -1;
+}
@@ -0,0 +1,35 @@
+#ifndef CSC369A3_MKFS_H
+#define CSC369A3_MKFS_H
+
+#define MKFS_MIN_TAIL_DATA_BLOCKS 50 /* A shorter last group is dropped, as mke2fs does */
+
+/*
+ * Geometry of a new file system. Zero fields take their defaults.
+ */
+struct mkfs_params {
+    unsigned int blocks_count;      /* Blocks count, including the boot block */
+    unsigned int block_size;        /* 1024, 2048 or 4096 bytes */
+    unsigned int blocks_per_group;  /* Default: 8 * block_size, one bitmap block */
+    unsigned int inodes_per_group;  /* Default: derived from inodes_count */
+    unsigned int inodes_count;      /* Default: one inode per 16 KiB */
+    int sparse;                     /* Do not fallocate the image, leave it sparse */
+    char *label;                    /* Volume name, may be NULL */
+};
+
+/*
+ * Write a new empty ext2 file system (root and lost+found) of the given
+ * geometry into the image file at path, creating or truncating it. Only
+ * the metadata blocks are written; the inode tables and data blocks stay
+ * holes. Return 0 on success, otherwise -1 with errno set, EINVAL if the
+ * geometry does not fit. On failure a file it created is removed, and one
+ * that existed is left empty.
+ */
+int format_image(char *path, struct mkfs_params *params);
+
+/*
+ * Return 1 if the group carries a backup of the super block and group
+ * descriptors: with sparse_super only groups 0, 1 and powers of 3, 5, 7 do.
+ */
+int group_has_super(unsigned int group);
+
+#endif
@@ -0,0 +1,137 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include "record.h"
+
+/* Images noted per process; a tool opens one or two */
+#define RECORD_MAX_IMAGES 4
+
+int recording_enabled = 0;
+
+static char *record_target = NULL; /* Value of EXT2_RECORD */
+static int record_argc = 0;
+static char **record_argv = NULL;
+static long long *file_sizes = NULL; /* Size of each argument that names a local file, else -1 */
+static char *images[RECORD_MAX_IMAGES];
+static int images_len = 0;
+static pthread_mutex_t record_lock = PTHREAD_MUTEX_INITIALIZER;
+static long long start_wall = 0;
+static long long start_mono = 0;
+
+static long long clock_ns(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void record_image(const char *disk_name) {
+    if (!recording_enabled) {
+        return;
+    }
+    pthread_mutex_lock(&record_lock);
+    if (images_len < RECORD_MAX_IMAGES) {
+        images[images_len] = strdup(disk_name);
+        images_len += images[images_len] != NULL;
+    }
+    pthread_mutex_unlock(&record_lock);
+}
+
+void record_local_file(int arg, long long size) {
+    if (recording_enabled && arg > 0 && arg < record_argc) {
+        file_sizes[arg] = size;
+    }
+}
+
+/*
+ * Write one argument, escaped as record.h describes.
+ */
+static void put_arg(FILE *out, int arg) {
+    char *text = record_argv[arg];
+    for (int i = 0; i < images_len; i++) {
+        if (strcmp(text, images[i]) == 0) {
+            fputs("\t@image", out);
+            return;
+        }
+    }
+    if (file_sizes[arg] >= 0) {
+        char *name = strrchr(text, '/');
+        fprintf(out, "\t@file:%lld:", file_sizes[arg]);
+        text = name != NULL ? name + 1 : text;
+    } else {
+        fputc('\t', out);
+        if (text[0] == '@') {
+            fputc('\\', out);
+        }
+    }
+    for (; *text != '\0'; text++) {
+        if (*text == '\t') {
+            fputs("\\t", out);
+        } else if (*text == '\n') {
+            fputs("\\n", out);
+        } else if (*text == '\\') {
+            fputs("\\\\", out);
+        } else {
+            fputc(*text, out);
+        }
+    }
+}
+
+/*
+ * Append the line of this process to the record file, with a single append
+ * so that concurrent processes do not interleave inside one another's line.
+ */
+static void dump_record(int status, void *arg) {
+    if (!recording_enabled) {
+        return;
+    }
+    long long duration = clock_ns(CLOCK_MONOTONIC) - start_mono;
+    char *text = NULL;
+    size_t len = 0;
+    FILE *out = open_memstream(&text, &len);
+    if (out == NULL) {
+        return;
+    }
+    fprintf(out, "%lld\t%lld\t%d\t%s", start_wall, duration, status, program_invocation_short_name);
+    for (int i = 1; i < record_argc; i++) {
+        put_arg(out, i);
+    }
+    fputc('\n', out);
+    fclose(out);
+
+    int fd = open(record_target, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd < 0 || write(fd, text, len) != (ssize_t) len) {
+        perror(record_target);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    free(text);
+}
+
+void init_record(int argc, char **argv) {
+    char *env = getenv("EXT2_RECORD");
+    if (env == NULL || *env == '\0' || argc < 1 || argv == NULL) {
+        return;
+    }
+    file_sizes = malloc(sizeof(long long) * argc);
+    if (file_sizes == NULL) {
+        return;
+    }
+    for (int i = 0; i < argc; i++) {
+        file_sizes[i] = -1;
+    }
+
+    record_target = env;
+    record_argc = argc;
+    record_argv = argv;
+    start_wall = clock_ns(CLOCK_REALTIME);
+    start_mono = clock_ns(CLOCK_MONOTONIC);
+    recording_enabled = 1;
+    on_exit(dump_record, NULL);
+}
@@ -0,0 +1,38 @@
+#ifndef CSC369A3_RECORD_H
+#define CSC369A3_RECORD_H
+
+/*
+ * Operation recording for ext2_replay. With EXT2_RECORD=<file> every tool
+ * appends one line to the file when it exits, tab separated:
+ *
+ *   <start_ns> <duration_ns> <exit_status> <tool> <arg>...
+ *
+ * start_ns is wall clock time, so the lines of several processes sharing
+ * the file can be ordered. An argument that names the image a tool opened
+ * is written as @image, and a local file it read as @file:<size>:<name>, so
+ * a replay can run against another image with generated data. In other
+ * arguments a tab, newline or backslash is written as \t, \n or \\, and a
+ * leading @ as \@.
+ */
+extern int recording_enabled;
+
+/*
+ * Turn recording of the given command line on if EXT2_RECORD asks for it;
+ * the line is appended when the process exits. The tools call it before
+ * main() runs (tools.c); the library never does.
+ */
+void init_record(int argc, char **argv);
+
+/*
+ * Note that the image of the given name was opened, so that arguments
+ * naming it are recorded as @image.
+ */
+void record_image(const char *disk_name);
+
+/*
+ * Note that argument arg of the command line names a local file of the
+ * given size that the tool read.
+ */
+void record_local_file(int arg, long long size);
+
+#endif
@@ -0,0 +1,56 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "stats.h"
+
+int stats_enabled = 0;
+struct ext2_stats stats;
+
+/* Value of EXT2_STATS: "1" for stderr, otherwise the file to append to */
+static char *stats_target = NULL;
+
+/*
+ * Print the counters of this process as one JSON line.
+ */
+static void dump_stats(void) {
+    FILE *out = stderr;
+    if (strcmp(stats_target, "1") != 0 && (out = fopen(stats_target, "a")) == NULL) {
+        perror(stats_target);
+        return;
+    }
+
+    fprintf(out, "{\"tool\":\"%s\",\"pid\":%d,\"counters\":{"
+            "\"bitmap_bits_scanned\":%llu,\"bitmap_words_scanned\":%llu,"
+            "\"blocks_allocated\":%llu,\"blocks_freed\":%llu,"
+            "\"inodes_allocated\":%llu,\"inodes_freed\":%llu,"
+            "\"dirents_compared\":%llu,\"dir_blocks_visited\":%llu,\"filter_negatives\":%llu,"
+            "\"inode_table_scans\":%llu,\"bytes_copied\":%llu,"
+            "\"zero_blocks_skipped\":%llu,\"blocks_unchanged\":%llu,"
+            "\"prealloc_hits\":%llu,\"prealloc_released\":%llu,\"heap_allocations\":%llu}}\n",
+            program_invocation_short_name, (int) getpid(),
+            stats.bitmap_bits_scanned, stats.bitmap_words_scanned,
+            stats.blocks_allocated, stats.blocks_freed,
+            stats.inodes_allocated, stats.inodes_freed,
+            stats.dirents_compared, stats.dir_blocks_visited, stats.filter_negatives,
+            stats.inode_table_scans, stats.bytes_copied,
+            stats.zero_blocks_skipped, stats.blocks_unchanged,
+            stats.prealloc_hits, stats.prealloc_released, stats.heap_allocations);
+
+    if (out != stderr) {
+        fclose(out);
+    }
+}
+
+void init_stats(void) {
+    char *env = getenv("EXT2_STATS");
+    if (env == NULL || *env == '\0' || strcmp(env, "0") == 0) {
+        return;
+    }
+
+    stats_target = env;
+    stats_enabled = 1;
+    atexit(dump_stats);
+}
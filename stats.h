@@ -0,0 +1,53 @@
+#ifndef CSC369A3_STATS_H
+#define CSC369A3_STATS_H
+
+/*
+ * Hot-path counters of the helper functions. They are only collected when
+ * the EXT2_STATS environment variable is set, and are then dumped as one
+ * JSON line when the process exits: to stderr if EXT2_STATS is 1, otherwise
+ * appended to the file EXT2_STATS names.
+ */
+struct ext2_stats {
+    unsigned long long bitmap_bits_scanned;  /* Bits tested by get_free_block/get_free_inode */
+    unsigned long long bitmap_words_scanned; /* 64-bit bitmap words loaded by the same scans */
+    unsigned long long blocks_allocated;
+    unsigned long long blocks_freed;
+    unsigned long long inodes_allocated;
+    unsigned long long inodes_freed;
+    unsigned long long dirents_compared;     /* Names compared while looking up or removing */
+    unsigned long long dir_blocks_visited;   /* Directory blocks walked by any scan */
+    unsigned long long filter_negatives;     /* Lookups a directory filter answered without a scan */
+    unsigned long long inode_table_scans;    /* Inode tables probed by get_inode_num */
+    unsigned long long bytes_copied;         /* File data written into blocks */
+    unsigned long long zero_blocks_skipped;  /* All-zero blocks left as holes */
+    unsigned long long blocks_unchanged;     /* Blocks an update found identical and kept */
+    unsigned long long prealloc_hits;        /* Blocks handed out of a preallocation window */
+    unsigned long long prealloc_released;    /* Preallocated blocks given back unused */
+    unsigned long long heap_allocations;     /* malloc/strndup calls in helper.c */
+};
+
+extern int stats_enabled;
+extern struct ext2_stats stats;
+
+/*
+ * Turn the counters on if EXT2_STATS asks for them, and dump them when the
+ * process exits. The tools call it before main() runs (tools.c); the
+ * library never does.
+ */
+void init_stats(void);
+
+/*
+ * Counting costs one well predicted branch when the counters are disabled.
+ * The counters are shared by the threads of a process, so they are added
+ * to atomically (relaxed, nothing is ordered by them).
+ */
+#define STAT_ADD(field, n) \
+    do { \
+        if (__builtin_expect(stats_enabled, 0)) { \
+            __atomic_add_fetch(&stats.field, (n), __ATOMIC_RELAXED); \
+        } \
+    } while (0)
+
+#define STAT_INC(field) STAT_ADD(field, 1)
+
+#endif
@@ -0,0 +1,155 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include "ext2.h"
+#include "helper.h"
+#include "csum.h"
+#include "stream.h"
+
+void image_manifest(unsigned char *disk, unsigned long long *hashes) {
+    unsigned int blocks_count = get_superblock_loc(disk)->s_blocks_count;
+    for (unsigned int b = 0; b < blocks_count; b++) {
+        if (!block_in_use(disk, b)) {
+            hashes[b] = 0;
+            continue;
+        }
+        // 0 stands for a free block
+        unsigned long long hash = hash_block(disk + (size_t) b * EXT2_BLOCK_SIZE);
+        hashes[b] = hash != 0 ? hash : 1;
+    }
+}
+
+unsigned long long manifest_fingerprint(const unsigned long long *hashes, unsigned int blocks_count) {
+    unsigned long long print = blocks_count;
+    for (unsigned int b = 0; b < blocks_count; b++) {
+        print = (print ^ hashes[b]) * 0xFF51AFD7ED558CCDULL;
+        print ^= print >> 32;
+    }
+    return print;
+}
+
+int write_manifest(const char *path, const unsigned long long *hashes, unsigned int blocks_count) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+    struct stream_io io;
+    if (stream_open(&io, fd) < 0) {
+        close(fd);
+        errno = ENOMEM;
+        return -1;
+    }
+    struct manifest_header header = {MANIFEST_MAGIC, blocks_count, {0, 0}};
+    int ret = stream_write(&io, &header, sizeof(header));
+    if (ret == 0) {
+        ret = stream_write(&io, hashes, sizeof(unsigned long long) * blocks_count);
+    }
+    if (ret == 0) {
+        ret = stream_flush(&io);
+    }
+    stream_close(&io);
+    if (close(fd) < 0) {
+        ret = -1;
+    }
+    return ret;
+}
+
+unsigned long long *read_manifest(const char *path, unsigned int blocks_count) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stream_io io;
+    unsigned long long *hashes = malloc(sizeof(unsigned long long) * blocks_count);
+    if (hashes == NULL || stream_open(&io, fd) < 0) {
+        free(hashes);
+        close(fd);
+        errno = ENOMEM;
+        return NULL;
+    }
+    struct manifest_header header;
+    int ret = stream_read(&io, &header, sizeof(header));
+    if (ret == 0 && (header.magic != MANIFEST_MAGIC || header.blocks_count != blocks_count)) {
+        errno = EINVAL;
+        ret = -1;
+    }
+    if (ret == 0) {
+        ret = stream_read(&io, hashes, sizeof(unsigned long long) * blocks_count);
+    }
+    stream_close(&io);
+    close(fd);
+    if (ret < 0) {
+        free(hashes);
+        return NULL;
+    }
+    return hashes;
+}
+
+int stream_open(struct stream_io *io, int fd) {
+    io->fd = fd;
+    io->len = 0;
+    io->pos = 0;
+    io->buf = malloc(STREAM_BUFFER);
+    return io->buf != NULL ? 0 : -1;
+}
+
+int stream_flush(struct stream_io *io) {
+    size_t done = 0;
+    while (done < io->len) {
+        ssize_t n = write(io->fd, io->buf + done, io->len - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0) {
+            return -1;
+        }
+        done += n;
+    }
+    io->len = 0;
+    return 0;
+}
+
+int stream_write(struct stream_io *io, const void *data, size_t len) {
+    while (len > 0) {
+        size_t n = STREAM_BUFFER - io->len < len ? STREAM_BUFFER - io->len : len;
+        memcpy(io->buf + io->len, data, n);
+        io->len += n;
+        data = (const unsigned char *) data + n;
+        len -= n;
+        if (io->len == STREAM_BUFFER && stream_flush(io) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int stream_read(struct stream_io *io, void *data, size_t len) {
+    while (len > 0) {
+        if (io->pos == io->len) {
+            ssize_t n = read(io->fd, io->buf, STREAM_BUFFER);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            } else if (n < 0) {
+                return -1;
+            } else if (n == 0) {
+                errno = EIO;
+                return -1;
+            }
+            io->len = n;
+            io->pos = 0;
+        }
+        size_t n = io->len - io->pos < len ? io->len - io->pos : len;
+        memcpy(data, io->buf + io->pos, n);
+        io->pos += n;
+        data = (unsigned char *) data + n;
+        len -= n;
+    }
+    return 0;
+}
+
+void stream_close(struct stream_io *io) {
+    free(io->buf);
+    io->buf = NULL;
+}
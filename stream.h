@@ -0,0 +1,110 @@
+#ifndef CSC369A3_STREAM_H
+#define CSC369A3_STREAM_H
+
+#include <stddef.h>
+
+/*
+ * Incremental image streams, written by ext2_send and applied by
+ * ext2_receive. A stream holds the blocks in use in the new image that
+ * differ from a base, which is either the base image itself or a manifest
+ * of it:
+ *
+ *   struct stream_header
+ *   for each run of changed blocks:
+ *       struct stream_extent, then count blocks of data
+ *   a struct stream_extent with count 0
+ *
+ * A manifest is a struct manifest_header followed by the hash_block() of
+ * every block of an image, 0 for the blocks not in use. The fingerprint of
+ * an image is a hash of its manifest, so free blocks do not count: the image
+ * a stream is applied to only has to match the base in the blocks the base
+ * uses.
+ */
+
+#define STREAM_MAGIC 0x64733265    /* "e2sd" */
+#define STREAM_VERSION 1
+#define MANIFEST_MAGIC 0x666d3265  /* "e2mf" */
+
+/* Buffer of the stream reader and writer, for large sequential I/O */
+#define STREAM_BUFFER (1 << 20)
+
+struct stream_header {
+    unsigned int magic;
+    unsigned int version;
+    unsigned int blocks_count;       /* Geometry the stream is for */
+    unsigned int blocks_per_group;
+    unsigned int inodes_count;
+    unsigned int flags;              /* STREAM_FULL */
+    unsigned long long base_print;   /* Fingerprint of the base */
+    unsigned long long new_print;    /* Fingerprint of the image once applied */
+};
+
+/* The stream holds every block in use and applies to any image of the geometry */
+#define STREAM_FULL 0x1
+
+struct stream_extent {
+    unsigned int start;
+    unsigned int count;
+};
+
+struct manifest_header {
+    unsigned int magic;
+    unsigned int blocks_count;
+    unsigned int reserved[2];
+};
+
+/*
+ * Buffered I/O on a file descriptor.
+ */
+struct stream_io {
+    int fd;
+    unsigned char *buf;
+    size_t len;     /* Bytes buffered */
+    size_t pos;     /* Bytes of the buffer already read */
+};
+
+/*
+ * Fill hashes (one per block) with the manifest of the disk.
+ */
+void image_manifest(unsigned char *disk, unsigned long long *hashes);
+
+/*
+ * Return the fingerprint of a manifest of blocks_count hashes.
+ */
+unsigned long long manifest_fingerprint(const unsigned long long *hashes, unsigned int blocks_count);
+
+/*
+ * Write a manifest to path. Return 0, or -1 with errno set.
+ */
+int write_manifest(const char *path, const unsigned long long *hashes, unsigned int blocks_count);
+
+/*
+ * Return the malloc'd hashes of the manifest at path, which must be of an
+ * image of blocks_count blocks, or NULL with errno set.
+ */
+unsigned long long *read_manifest(const char *path, unsigned int blocks_count);
+
+/*
+ * Start buffered I/O on fd. Return 0, or -1 if memory ran out.
+ */
+int stream_open(struct stream_io *io, int fd);
+
+/*
+ * Write len bytes through the buffer, or flush what it holds. Return 0, or
+ * -1 with errno set.
+ */
+int stream_write(struct stream_io *io, const void *data, size_t len);
+int stream_flush(struct stream_io *io);
+
+/*
+ * Read exactly len bytes through the buffer. Return 0, or -1 with errno set
+ * (EIO if the stream ends first).
+ */
+int stream_read(struct stream_io *io, void *data, size_t len);
+
+/*
+ * Free the buffer. The descriptor is left open.
+ */
+void stream_close(struct stream_io *io);
+
+#endif
@@ -0,0 +1,297 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include "timer.h"
+
+/* Log-linear buckets: 4 linear sub buckets for every power of two */
+#define TIMER_SUB_BUCKETS 4
+#define TIMER_BUCKETS (64 * TIMER_SUB_BUCKETS)
+
+/* Trace events kept per thread, later spans are only counted */
+#define TIMER_MAX_EVENTS (1 << 20)
+
+static const char *phase_names[PHASE_COUNT] = {
+    "path", "alloc", "copy", "dir_update", "writeback", "command"
+};
+
+struct timer_histogram {
+    unsigned long long count;
+    unsigned long long total_ns;
+    unsigned long long max_ns;
+    unsigned long long buckets[TIMER_BUCKETS];
+};
+
+struct trace_event {
+    int phase;
+    long long start;
+    long long duration;
+};
+
+/*
+ * Everything one thread records. Threads register themselves on a lock-free
+ * list the first time they record, and the list is only read at exit.
+ */
+struct timer_thread {
+    struct timer_histogram phases[PHASE_COUNT];
+    struct trace_event *events;
+    int events_len;
+    int events_cap;
+    unsigned long long events_dropped;
+    int tid;
+    struct timer_thread *next;
+};
+
+int timers_enabled = 0;
+
+static char *timing_target = NULL; /* Value of EXT2_TIMING */
+static char *trace_target = NULL;  /* Value of EXT2_TRACE */
+static long long process_start = 0;
+static struct timer_thread *threads = NULL;
+static __thread struct timer_thread *self = NULL;
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+ * Return the histogram bucket of a latency: exact below 4 ns, then the
+ * power of two and the next two bits.
+ */
+static int bucket_of(unsigned long long ns) {
+    if (ns < TIMER_SUB_BUCKETS) {
+        return (int) ns;
+    }
+    int msb = 63 - __builtin_clzll(ns);
+    return (msb - 1) * TIMER_SUB_BUCKETS + (int) ((ns >> (msb - 2)) & (TIMER_SUB_BUCKETS - 1));
+}
+
+/*
+ * Return the largest latency that falls in the given bucket.
+ */
+static unsigned long long bucket_upper_bound(int bucket) {
+    if (bucket < TIMER_SUB_BUCKETS) {
+        return (unsigned long long) bucket;
+    }
+    int msb = bucket / TIMER_SUB_BUCKETS + 1;
+    unsigned long long sub = bucket % TIMER_SUB_BUCKETS;
+    return ((TIMER_SUB_BUCKETS + sub + 1) << (msb - 2)) - 1;
+}
+
+/*
+ * Return the state of the calling thread, registering it on first use.
+ */
+static struct timer_thread *get_self(void) {
+    if (self != NULL) {
+        return self;
+    }
+
+    self = calloc(1, sizeof(struct timer_thread));
+    if (self == NULL) {
+        return NULL;
+    }
+    self->tid = (int) syscall(SYS_gettid);
+    self->next = __atomic_load_n(&threads, __ATOMIC_ACQUIRE);
+    while (!__atomic_compare_exchange_n(&threads, &self->next, self, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_ACQUIRE)) {
+        // self->next was refreshed by the failed exchange, try again
+    }
+    return self;
+}
+
+/*
+ * Record one span of the given phase for the calling thread.
+ */
+static void record_span(int phase, long long start, long long duration) {
+    struct timer_thread *me = get_self();
+    if (me == NULL) {
+        return;
+    }
+
+    struct timer_histogram *h = &(me->phases[phase]);
+    h->count++;
+    h->total_ns += duration;
+    if (duration > h->max_ns) {
+        h->max_ns = duration;
+    }
+    h->buckets[bucket_of(duration)]++;
+
+    if (trace_target == NULL) {
+        return;
+    }
+    if (me->events_len == me->events_cap) {
+        int cap = me->events_cap ? me->events_cap * 2 : 1024;
+        struct trace_event *events = NULL;
+        if (cap <= TIMER_MAX_EVENTS) {
+            events = realloc(me->events, sizeof(struct trace_event) * cap);
+        }
+        if (events == NULL) {
+            me->events_dropped++;
+            return;
+        }
+        me->events = events;
+        me->events_cap = cap;
+    }
+    me->events[me->events_len].phase = phase;
+    me->events[me->events_len].start = start;
+    me->events[me->events_len].duration = duration;
+    me->events_len++;
+}
+
+struct timer_scope timer_scope_begin(int phase) {
+    struct timer_scope scope = {phase, 0};
+    if (__builtin_expect(timers_enabled, 0)) {
+        scope.start = now_ns();
+    }
+    return scope;
+}
+
+void timer_scope_end(struct timer_scope *scope) {
+    if (__builtin_expect(scope->start == 0, 1)) {
+        return;
+    }
+    record_span(scope->phase, scope->start, now_ns() - scope->start);
+}
+
+/*
+ * Return the latency below which the given fraction of the samples fall.
+ */
+static unsigned long long percentile(struct timer_histogram *h, double fraction) {
+    unsigned long long rank = (unsigned long long) (fraction * (h->count - 1));
+    unsigned long long seen = 0;
+    for (int b = 0; b < TIMER_BUCKETS; b++) {
+        seen += h->buckets[b];
+        if (seen > rank) {
+            unsigned long long bound = bucket_upper_bound(b);
+            return bound < h->max_ns ? bound : h->max_ns;
+        }
+    }
+    return h->max_ns;
+}
+
+/*
+ * Print the merged per-phase histograms of all threads as one JSON line.
+ */
+static void dump_timing(void) {
+    struct timer_histogram merged[PHASE_COUNT];
+    memset(merged, 0, sizeof(merged));
+    for (struct timer_thread *t = __atomic_load_n(&threads, __ATOMIC_ACQUIRE); t != NULL; t = t->next) {
+        for (int p = 0; p < PHASE_COUNT; p++) {
+            merged[p].count += t->phases[p].count;
+            merged[p].total_ns += t->phases[p].total_ns;
+            if (t->phases[p].max_ns > merged[p].max_ns) {
+                merged[p].max_ns = t->phases[p].max_ns;
+            }
+            for (int b = 0; b < TIMER_BUCKETS; b++) {
+                merged[p].buckets[b] += t->phases[p].buckets[b];
+            }
+        }
+    }
+
+    FILE *out = stderr;
+    if (strcmp(timing_target, "1") != 0 && (out = fopen(timing_target, "a")) == NULL) {
+        perror(timing_target);
+        return;
+    }
+    fprintf(out, "{\"tool\":\"%s\",\"pid\":%d,\"phases\":{", program_invocation_short_name, (int) getpid());
+    int first = 1;
+    for (int p = 0; p < PHASE_COUNT; p++) {
+        if (merged[p].count == 0) {
+            continue;
+        }
+        fprintf(out, "%s\"%s\":{\"count\":%llu,\"total_ns\":%llu,\"p50_ns\":%llu,"
+                "\"p90_ns\":%llu,\"p99_ns\":%llu,\"max_ns\":%llu}",
+                first ? "" : ",", phase_names[p], merged[p].count, merged[p].total_ns,
+                percentile(&merged[p], 0.5), percentile(&merged[p], 0.9),
+                percentile(&merged[p], 0.99), merged[p].max_ns);
+        first = 0;
+    }
+    fprintf(out, "}}\n");
+    if (out != stderr) {
+        fclose(out);
+    }
+}
+
+/*
+ * Append all recorded spans to the trace file as complete ("X") events.
+ * The events of this process are written with a single append so that
+ * concurrent processes do not interleave inside one another's events.
+ */
+static void dump_trace(void) {
+    char *text = NULL;
+    size_t len = 0;
+    FILE *out = open_memstream(&text, &len);
+    if (out == NULL) {
+        return;
+    }
+
+    int pid = (int) getpid();
+    fprintf(out, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"%s\"}},\n",
+            pid, program_invocation_short_name);
+    for (struct timer_thread *t = __atomic_load_n(&threads, __ATOMIC_ACQUIRE); t != NULL; t = t->next) {
+        for (int i = 0; i < t->events_len; i++) {
+            struct trace_event *e = &(t->events[i]);
+            fprintf(out, "{\"name\":\"%s\",\"cat\":\"ext2\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+                    "\"pid\":%d,\"tid\":%d},\n", phase_names[e->phase],
+                    e->start / 1000.0, e->duration / 1000.0, pid, t->tid);
+        }
+        if (t->events_dropped) {
+            fprintf(out, "{\"name\":\"events_dropped\",\"ph\":\"C\",\"ts\":%.3f,\"pid\":%d,"
+                    "\"args\":{\"dropped\":%llu}},\n", now_ns() / 1000.0, pid, t->events_dropped);
+        }
+    }
+    fclose(out);
+
+    // The array format tolerates a missing "]", so processes can keep appending
+    int fd = open(trace_target, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd < 0) {
+        perror(trace_target);
+        free(text);
+        return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size == 0 && write(fd, "[\n", 2) != 2) {
+        perror(trace_target);
+    }
+    if (write(fd, text, len) != (ssize_t) len) {
+        perror(trace_target);
+    }
+    close(fd);
+    free(text);
+}
+
+static void dump_timers(void) {
+    record_span(PHASE_COMMAND, process_start, now_ns() - process_start);
+    if (timing_target != NULL) {
+        dump_timing();
+    }
+    if (trace_target != NULL) {
+        dump_trace();
+    }
+}
+
+void init_timers(void) {
+    char *timing = getenv("EXT2_TIMING");
+    char *trace = getenv("EXT2_TRACE");
+    if (timing != NULL && *timing != '\0' && strcmp(timing, "0") != 0) {
+        timing_target = timing;
+    }
+    if (trace != NULL && *trace != '\0') {
+        trace_target = trace;
+    }
+    if (timing_target == NULL && trace_target == NULL) {
+        return;
+    }
+
+    process_start = now_ns();
+    timers_enabled = 1;
+    atexit(dump_timers);
+}
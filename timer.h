@@ -0,0 +1,53 @@
+#ifndef CSC369A3_TIMER_H
+#define CSC369A3_TIMER_H
+
+/*
+ * Phases of a tool operation that are timed.
+ */
+enum timer_phase {
+    PHASE_PATH,       /* Path resolution */
+    PHASE_ALLOC,      /* Inode and block allocation */
+    PHASE_COPY,       /* File data copy */
+    PHASE_DIR_UPDATE, /* Directory entry insertion and removal */
+    PHASE_WRITEBACK,  /* Writing the image back to disk */
+    PHASE_COMMAND,    /* The whole process, recorded at exit */
+    PHASE_COUNT
+};
+
+/*
+ * Per-phase latency timing. Every thread records into its own log-linear
+ * histogram, so recording takes no lock. Enabled by environment variables:
+ *
+ *   EXT2_TIMING=1|<file>  at exit, print per-phase count, total and
+ *                         percentiles as one JSON line to stderr or
+ *                         append it to the file.
+ *   EXT2_TRACE=<file>     at exit, append every timed span as a Chrome
+ *                         trace event (JSON array format, loadable in
+ *                         chrome://tracing and Perfetto). Several processes
+ *                         may append to the same file.
+ */
+extern int timers_enabled;
+
+/*
+ * Turn timing on if EXT2_TIMING or EXT2_TRACE ask for it, and write the
+ * results when the process exits. The tools call it before main() runs
+ * (tools.c); the library never does.
+ */
+void init_timers(void);
+
+struct timer_scope {
+    int phase;
+    long long start; /* 0 when timing is disabled */
+};
+
+struct timer_scope timer_scope_begin(int phase);
+void timer_scope_end(struct timer_scope *scope);
+
+/*
+ * Time the rest of the enclosing block as the given phase. The span ends
+ * when the block is left, whichever return path is taken.
+ */
+#define TIMED_SCOPE(phase) \
+    struct timer_scope phase_timer __attribute__((cleanup(timer_scope_end))) = timer_scope_begin(phase)
+
+#endif
@@ -0,0 +1,20 @@
+#include <stdlib.h>
+#include "fs.h"
+#include "stats.h"
+#include "timer.h"
+#include "record.h"
+
+/*
+ * Set up what the command line tools do around their operation, before
+ * main() runs: the counters, timing and recording the environment asks for,
+ * and the release of preallocated blocks at exit. glibc passes the command
+ * line to constructors. Only the tools link this object, so a process that
+ * embeds libext2 gets none of it unless it calls the init functions itself.
+ */
+__attribute__((constructor))
+static void init_tool(int argc, char **argv, char **envp) {
+    init_stats();
+    init_timers();
+    init_record(argc, argv);
+    atexit(discard_all_prealloc);
+}